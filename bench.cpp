@@ -0,0 +1,49 @@
+#include "bench_backend.h"
+
+int main(const int argc, const char *argv[]) {
+    struct bench::bench_config config;
+
+    bench::parse_bench_options(argc, argv, config);
+
+    /* The server may vanish under us; report it instead of dying on SIGPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    bench::clock_start = bench::monotonic_us();
+
+    std::vector<struct bench::payload_template> templates = bench::load_payloads(config.payloads);
+
+    int scenario = 0;
+
+    /* Payload types swept: the requested ones present in the payload file */
+    for (int type: config.types) {
+        std::vector<const struct bench::payload_template *> values;
+
+        for (auto& value: templates) {
+            if (value.type == type) {
+                values.push_back(&value);
+            }
+        }
+
+        if (values.empty()) {
+            fprintf(stderr, "No %s payloads in %s, skipped\n", bench::TYPE_NAMES[type], config.payloads);
+            continue;
+        }
+
+        for (int topics: config.topics) {
+            for (int wildcard_percent: config.wildcards) {
+                fprintf(stderr, "Scenario %d: %s, %d topics, %d%% wildcard subscribers\n",
+                        scenario, bench::TYPE_NAMES[type], topics, wildcard_percent);
+
+                struct bench::scenario_result result = bench::run_scenario(config, scenario, std::max(topics, 1),
+                                                                            wildcard_percent, values);
+
+                bench::print_result(stdout, config, topics, wildcard_percent, type, result);
+                fflush(stdout);
+
+                scenario++;
+            }
+        }
+    }
+
+    return 0;
+}
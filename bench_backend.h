@@ -0,0 +1,779 @@
+#ifndef BENCH_BACKEND_H
+#define BENCH_BACKEND_H
+
+#include "subscriber_backend.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 12400
+#define BENCH_PUBLISHERS 2
+#define BENCH_SUBSCRIBERS 8
+#define BENCH_RECEIVERS 4           // threads reading the subscriber connections
+#define BENCH_DURATION 1000         // milliseconds of publishing per scenario
+#define BENCH_DRAIN 2000            // longest wait for notifications still in flight (milliseconds)
+#define BENCH_SEND_BATCH 32         // datagrams per sendmmsg()
+#define BENCH_READ_BUFFER (64 << 10)
+#define BENCH_PAYLOADS "pcom_hw2_udp_client/sample_payloads.json"
+
+namespace bench {
+    const char *TYPE_NAMES[] = {"INT", "SHORT_REAL", "FLOAT", "STRING"};
+
+    /**
+     * Benchmark options, given as "--name=value" arguments.
+     */
+    struct bench_config {
+        const char *server = "./server";
+        std::string server_args;        // --server-args="..." (options passed on to the server)
+        const char *payloads = BENCH_PAYLOADS;
+        int port = BENCH_PORT;          // first port; each scenario runs a server on the next one
+
+        int publishers = BENCH_PUBLISHERS;
+        int subscribers = BENCH_SUBSCRIBERS;
+        int receivers = BENCH_RECEIVERS;
+        int duration = BENCH_DURATION;  // --duration=MS
+        int rate = 0;                   // datagrams per second and publisher (0: as fast as possible)
+        bool raw = false;               // --raw: subscribers ask for raw notifications
+
+        /* Sweep */
+        std::vector<int> topics = {1, 16, 256};     // --topics=N,N,...
+        std::vector<int> wildcards = {0, 50, 100};  // --wildcards=PERCENT,... of subscribers on "bench/+"
+        std::vector<int> types = {0, 1, 2, 3};      // --types=INT,STRING,...
+    };
+
+    /**
+     * Value of a datagram from the payload file, used as a template.
+     */
+    struct payload_template {
+        uint8_t type;
+        std::string value;
+    };
+
+    /**
+     * Outcome of a scenario.
+     */
+    struct scenario_result {
+        uint64_t published = 0;
+        uint64_t delivered = 0;             // notifications received, drain included
+        uint64_t delivered_in_window = 0;   // notifications received while publishing
+        double seconds = 0;                 // length of the publishing window
+        std::vector<uint32_t> latencies;    // microseconds, sorted
+    };
+
+    /**
+     * Connection of a benchmark subscriber.
+     */
+    struct subscriber_connection {
+        int socket;
+        std::vector<char> buffer;
+        size_t used = 0;
+    };
+
+    /**
+     * State of a thread reading subscriber connections.
+     */
+    struct receiver {
+        std::vector<struct subscriber_connection *> connections;
+        std::atomic<uint64_t> delivered{0};
+        std::vector<uint32_t> latencies;
+        std::thread thread;
+    };
+
+    uint64_t clock_start;
+
+    uint64_t monotonic_us() {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    }
+
+    /**
+     * Microseconds since the start of the benchmark; publishers embed it in
+     * the datagrams (it wraps every ~71 minutes, latencies are differences).
+     */
+    uint32_t bench_clock() {
+        return monotonic_us() - clock_start;
+    }
+
+    /**
+     * Parses a comma-separated list of numbers (or of type names).
+     */
+    std::vector<int> parse_list(const char *list, bool type_names) {
+        std::vector<int> values;
+        std::string items(list);
+
+        size_t start = 0;
+
+        while (start <= items.size()) {
+            size_t end = std::min(items.find(',', start), items.size());
+            std::string item = items.substr(start, end - start);
+
+            if (type_names) {
+                int type = 0;
+
+                while (type < 4 && item != TYPE_NAMES[type]) {
+                    type++;
+                }
+
+                DIE(type == 4, "Unknown payload type");
+                values.push_back(type);
+            } else {
+                values.push_back(atoi(item.c_str()));
+                DIE(values.back() < 0, "Invalid list value");
+            }
+
+            start = end + 1;
+        }
+
+        return values;
+    }
+
+    /**
+     * Parses the benchmark options.
+     *
+     * @param argc
+     * @param argv
+     * @param config
+     */
+    void parse_bench_options(const int argc, const char *argv[], struct bench_config& config) {
+        for (int index = 1; index < argc; index++) {
+            const char *option = argv[index];
+            const char *value = strchr(option, '=');
+
+            DIE(strncmp(option, "--", 2) != 0, "Unknown option");
+
+            if (strcmp(option, "--raw") == 0) {
+                config.raw = true;
+                continue;
+            }
+
+            DIE(value == NULL, "Option without value");
+
+            std::string name(option + 2, value - option - 2);
+            value++;
+
+            if (name == "server") {
+                config.server = value;
+            } else if (name == "server-args") {
+                config.server_args = value;
+            } else if (name == "payloads") {
+                config.payloads = value;
+            } else if (name == "port") {
+                config.port = atoi(value);
+            } else if (name == "publishers") {
+                config.publishers = atoi(value);
+            } else if (name == "subscribers") {
+                config.subscribers = atoi(value);
+            } else if (name == "receivers") {
+                config.receivers = atoi(value);
+            } else if (name == "duration") {
+                config.duration = atoi(value);
+            } else if (name == "rate") {
+                config.rate = atoi(value);
+            } else if (name == "topics") {
+                config.topics = parse_list(value, false);
+            } else if (name == "wildcards") {
+                config.wildcards = parse_list(value, false);
+            } else if (name == "types") {
+                config.types = parse_list(value, true);
+            } else {
+                DIE(true, "Unknown option");
+            }
+        }
+
+        DIE(config.publishers < 1 || config.subscribers < 1 || config.receivers < 1, "Invalid thread counts");
+        DIE(config.subscribers > 999, "At most 999 subscribers");
+        DIE(config.duration < 1 || config.rate < 0, "Invalid duration or rate");
+    }
+
+    /**
+     * Decodes base64 text (the payload_base64 fields of the payload files).
+     */
+    std::string decode_base64(std::string_view text) {
+        std::string bytes;
+        uint32_t bits = 0;
+        int count = 0;
+
+        for (char c: text) {
+            const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            const char *digit = c != '\0' ? strchr(alphabet, c) : NULL;
+
+            if (digit == NULL) {    // Padding
+                break;
+            }
+
+            bits = bits << 6 | (digit - alphabet);
+            count += 6;
+
+            if (count >= 8) {
+                count -= 8;
+                bytes.push_back((char)(bits >> count));
+            }
+        }
+
+        return bytes;
+    }
+
+    /**
+     * Loads the datagrams of a payload file (JSON array of objects with a
+     * "payload_base64" member, as read by udp_client.py).
+     *
+     * @param path
+     * @return one template per datagram
+     */
+    std::vector<struct payload_template> load_payloads(const char *path) {
+        FILE *file = fopen(path, "r");
+        DIE(file == NULL, "Cannot open payload file");
+
+        std::string text;
+        char chunk[4096];
+        size_t length;
+
+        while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            text.append(chunk, length);
+        }
+
+        fclose(file);
+
+        std::vector<struct payload_template> templates;
+        size_t position = 0;
+
+        while ((position = text.find("\"payload_base64\"", position)) != std::string::npos) {
+            size_t start = text.find('"', text.find(':', position)) + 1;
+            size_t end = text.find('"', start);
+
+            DIE(start == 0 || end == std::string::npos, "Malformed payload file");
+
+            std::string datagram = decode_base64(std::string_view(text).substr(start, end - start));
+
+            if (datagram.size() > MAX_TOPIC_SIZE && (uint8_t)datagram[MAX_TOPIC_SIZE] < 4) {
+                templates.push_back({(uint8_t)datagram[MAX_TOPIC_SIZE], datagram.substr(MAX_TOPIC_SIZE + 1)});
+            }
+
+            position = end;
+        }
+
+        return templates;
+    }
+
+    /**
+     * Builds a datagram carrying the send time: in the value of INT and
+     * FLOAT datagrams, as the leading number of STRING ones. SHORT_REAL
+     * values are too narrow and are sent as in the template (no latency).
+     *
+     * @param packet
+     * @param topic
+     * @param value template
+     * @return datagram length
+     */
+    size_t build_datagram(struct udp_packet& packet, const char *topic, const struct payload_template& value) {
+        size_t topic_length = strnlen(topic, MAX_TOPIC_SIZE);
+
+        /* A topic of MAX_TOPIC_SIZE characters has no terminator on the wire */
+        memcpy(packet.topic, topic, topic_length);
+        memset(packet.topic + topic_length, 0, MAX_TOPIC_SIZE - topic_length);
+        packet.data_type = value.type;
+
+        uint32_t timestamp = htonl(bench_clock());
+        size_t length;
+
+        switch (value.type) {
+            case 0:
+                packet.payload[0] = 0;
+                memcpy(packet.payload + 1, &timestamp, sizeof(timestamp));
+                length = 1 + sizeof(timestamp);
+                break;
+
+            case 2:
+                packet.payload[0] = 0;
+                memcpy(packet.payload + 1, &timestamp, sizeof(timestamp));
+                packet.payload[1 + sizeof(timestamp)] = 0;
+                length = 1 + sizeof(timestamp) + 1;
+                break;
+
+            case 3:
+                length = snprintf(packet.payload, MAX_UDP_PAYLOAD_SIZE, "%u %.*s", ntohl(timestamp),
+                                    (int)strnlen(value.value.data(), value.value.size()), value.value.data());
+                length = std::min(length, (size_t)MAX_UDP_PAYLOAD_SIZE - 1);
+                break;
+
+            default:
+                length = std::min(value.value.size(), (size_t)MAX_UDP_PAYLOAD_SIZE);
+                memcpy(packet.payload, value.value.data(), length);
+                break;
+        }
+
+        return offsetof(struct udp_packet, payload) + length;
+    }
+
+    /**
+     * Publishes datagrams until told to stop, BENCH_SEND_BATCH at a time.
+     *
+     * @param config
+     * @param port
+     * @param topics number of topics ("bench/0" ...) cycled through
+     * @param values templates cycled through
+     * @param stop
+     * @param published
+     */
+    void run_publisher(const struct bench_config& config, int port, int topics,
+                        const std::vector<const struct payload_template *>& values,
+                        std::atomic<bool>& stop, std::atomic<uint64_t>& published) {
+        int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        DIE(udp_socket < 0, "Publisher socket error");
+
+        struct sockaddr_in server_addr = {};
+
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+        DIE(connect(udp_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0, "Publisher connect error");
+
+        std::vector<struct udp_packet> packets(BENCH_SEND_BATCH);
+        struct iovec iovecs[BENCH_SEND_BATCH];
+        struct mmsghdr messages[BENCH_SEND_BATCH] = {};
+
+        char topic[MAX_TOPIC_SIZE + 1];
+        uint64_t sent = 0;
+        uint64_t start = monotonic_us();
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            /* Rate limit: stay behind rate * elapsed */
+            if (config.rate > 0 && sent * 1000000 >= (monotonic_us() - start) * config.rate) {
+                usleep(100);
+                continue;
+            }
+
+            for (int index = 0; index < BENCH_SEND_BATCH; index++) {
+                uint64_t number = sent + index;
+
+                snprintf(topic, sizeof(topic), "bench/%d", (int)(number % topics));
+
+                iovecs[index] = {&packets[index],
+                                    build_datagram(packets[index], topic, *values[number % values.size()])};
+                messages[index].msg_hdr.msg_iov = &iovecs[index];
+                messages[index].msg_hdr.msg_iovlen = 1;
+            }
+
+            int count = sendmmsg(udp_socket, messages, BENCH_SEND_BATCH, 0);
+
+            if (count < 0) {
+                DIE(errno != EINTR && errno != ENOBUFS && errno != ECONNREFUSED, "sendmmsg failed");
+                continue;
+            }
+
+            sent += count;
+            published.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        close(udp_socket);
+    }
+
+    /**
+     * Gets the send time embedded in a notification.
+     *
+     * @param type frame type
+     * @param message frame payload
+     * @param length
+     * @param timestamp
+     * @return false if the notification carries none
+     */
+    bool read_timestamp(uint8_t type, const char *message, size_t length, uint32_t& timestamp) {
+        if (type == FRAME_RAW_NOTIFICATION) {
+            struct udp_packet packet;
+            size_t packet_length;
+            struct sockaddr_in from;
+
+            if (!decode_raw_notification(message, length, packet, packet_length, from)) {
+                return false;
+            }
+
+            if (packet.data_type == 0 || packet.data_type == 2) {
+                memcpy(&timestamp, packet.payload + 1, sizeof(timestamp));
+                timestamp = ntohl(timestamp);
+                return true;
+            }
+
+            return packet.data_type == 3 && sscanf(packet.payload, "%u", &timestamp) == 1;
+        }
+
+        /* "<topic> - <type> - <value>"; benchmark topics have no " - " */
+        std::string_view text(message, length);
+        size_t type_start = text.find(" - ");
+        size_t value_start = type_start != std::string_view::npos ? text.find(" - ", type_start + 3) : type_start;
+
+        if (value_start == std::string_view::npos) {
+            return false;
+        }
+
+        std::string_view name = text.substr(type_start + 3, value_start - type_start - 3);
+
+        if (name == "SHORT_REAL") {
+            return false;
+        }
+
+        std::string_view value = text.substr(value_start + 3);
+
+        return std::from_chars(value.data(), value.data() + value.size(), timestamp).ec == std::errc();
+    }
+
+    /**
+     * Reads notifications from a share of the subscriber connections until
+     * told to stop, counting them and recording their latency.
+     *
+     * @param state
+     * @param stop
+     */
+    void run_receiver(struct receiver& state, std::atomic<bool>& stop) {
+        int epoll_fd = epoll_create1(0);
+        DIE(epoll_fd < 0, "epoll_create1 failed");
+
+        for (auto& subscriber: state.connections) {
+            struct epoll_event event = {};
+
+            event.events = EPOLLIN;
+            event.data.ptr = subscriber;
+
+            DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, subscriber->socket, &event) < 0, "epoll_ctl failed");
+        }
+
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 50);
+
+            for (int index = 0; index < count; index++) {
+                struct subscriber_connection *subscriber = (struct subscriber_connection *)events[index].data.ptr;
+
+                ssize_t rc = recv(subscriber->socket, subscriber->buffer.data() + subscriber->used,
+                                    subscriber->buffer.size() - subscriber->used, 0);
+
+                if (rc <= 0) {
+                    DIE(rc == 0 || (errno != EAGAIN && errno != EINTR), "Subscriber connection lost");
+                    continue;
+                }
+
+                subscriber->used += rc;
+
+                uint32_t now = bench_clock();
+                uint64_t received = 0;
+
+                /* Whole frames; a partial one waits for the next read */
+                char *frame = subscriber->buffer.data();
+                size_t left = subscriber->used;
+
+                while (left >= sizeof(struct connection::frame_header)) {
+                    struct connection::frame_header *header = (struct connection::frame_header *)frame;
+                    size_t length = ntohs(header->length);
+
+                    if (left < sizeof(struct connection::frame_header) + length) {
+                        break;
+                    }
+
+                    uint32_t timestamp;
+
+                    if (read_timestamp(header->type, frame + sizeof(struct connection::frame_header), length, timestamp)) {
+                        state.latencies.push_back(now - timestamp);
+                    }
+
+                    received += header->type == FRAME_NOTIFICATION || header->type == FRAME_RAW_NOTIFICATION;
+
+                    frame += sizeof(struct connection::frame_header) + length;
+                    left -= sizeof(struct connection::frame_header) + length;
+                }
+
+                memmove(subscriber->buffer.data(), frame, left);
+                subscriber->used = left;
+
+                state.delivered.fetch_add(received, std::memory_order_relaxed);
+            }
+        }
+
+        close(epoll_fd);
+    }
+
+    /**
+     * Server under test, fed commands through a pipe.
+     */
+    struct server_process {
+        pid_t pid;
+        int input;
+    };
+
+    /**
+     * Starts the server on a port and waits until it accepts connections.
+     *
+     * @param config
+     * @param port
+     * @return server_process
+     */
+    struct server_process start_server(const struct bench_config& config, int port) {
+        int fds[2];
+        DIE(pipe(fds) < 0, "pipe failed");
+
+        std::string port_text = std::to_string(port);
+        std::vector<std::string> words = {config.server, port_text};
+
+        for (size_t start = 0; start < config.server_args.size();) {
+            size_t end = std::min(config.server_args.find(' ', start), config.server_args.size());
+
+            if (end > start) {
+                words.push_back(config.server_args.substr(start, end - start));
+            }
+
+            start = end + 1;
+        }
+
+        pid_t pid = fork();
+        DIE(pid < 0, "fork failed");
+
+        if (pid == 0) {
+            std::vector<char *> argv;
+
+            for (auto& word: words) {
+                argv.push_back(word.data());
+            }
+
+            argv.push_back(NULL);
+
+            int null_fd = open("/dev/null", O_WRONLY);
+
+            dup2(fds[0], STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(fds[1]);
+
+            execv(config.server, argv.data());
+            _exit(127);
+        }
+
+        close(fds[0]);
+
+        struct sockaddr_in server_addr = {};
+
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+        for (int attempt = 0; ; attempt++) {
+            DIE(attempt == 500 || waitpid(pid, NULL, WNOHANG) != 0, "Server did not start");
+
+            int probe = socket(AF_INET, SOCK_STREAM, 0);
+            DIE(probe < 0, "Probe socket error");
+
+            int rc = connect(probe, (struct sockaddr *)&server_addr, sizeof(server_addr));
+            close(probe);
+
+            if (rc == 0) {
+                break;
+            }
+
+            usleep(10000);
+        }
+
+        return {pid, fds[1]};
+    }
+
+    void stop_server(struct server_process& server) {
+        DIE(write(server.input, "exit\n", 5) != 5, "Cannot stop the server");
+        close(server.input);
+
+        waitpid(server.pid, NULL, 0);
+    }
+
+    /**
+     * Logs a benchmark subscriber in and subscribes it, to "bench/+" or to
+     * each topic in turn.
+     *
+     * @param config
+     * @param port
+     * @param ID
+     * @param topics
+     * @param wildcard
+     * @return connected socket (non-blocking)
+     */
+    int connect_subscriber(const struct bench_config& config, int port, char *ID, int topics, bool wildcard) {
+        uint8_t protocol_version = PROTOCOL_FRAMED;
+        uint8_t login_flags = config.raw ? LOGIN_FLAG_RAW : 0;
+        uint16_t aliases = 0;   // Frames are read as sent, without an alias table
+
+        int socket_fd = subscriber::connect_to_server(inet_addr("127.0.0.1"), port, ID, protocol_version, login_flags,
+                                                        aliases);
+        DIE(socket_fd < 0 || protocol_version < PROTOCOL_FRAMED, "Subscriber login failed");
+
+        char command[MAX_COMMAND_LEN];
+
+        for (int topic = 0; topic < (wildcard ? 1 : topics); topic++) {
+            int length = wildcard ? snprintf(command, sizeof(command), "subscribe bench/+")
+                                    : snprintf(command, sizeof(command), "subscribe bench/%d", topic);
+
+            send_message(socket_fd, protocol_version, FRAME_COMMAND, command, length);
+            DIE(!subscriber::await_confirmation(socket_fd, protocol_version), "Subscribe failed");
+        }
+
+        connection::set_non_blocking(socket_fd);
+
+        return socket_fd;
+    }
+
+    /**
+     * Runs one scenario against a fresh server: the subscribers connect
+     * first, then the publishers send for config.duration milliseconds,
+     * and notifications still in flight are awaited (up to BENCH_DRAIN).
+     *
+     * @param config
+     * @param scenario index of the scenario (gives the port and client IDs)
+     * @param topics
+     * @param wildcard_percent share of subscribers on "bench/+"
+     * @param values templates of the payload type
+     * @return scenario_result
+     */
+    struct scenario_result run_scenario(const struct bench_config& config, int scenario, int topics,
+                                        int wildcard_percent, const std::vector<const struct payload_template *>& values) {
+        int port = config.port + scenario;
+        struct server_process server = start_server(config, port);
+
+        std::vector<struct subscriber_connection> subscribers(config.subscribers);
+        int wildcard_count = (config.subscribers * wildcard_percent + 50) / 100;
+
+        for (int index = 0; index < config.subscribers; index++) {
+            char ID[24];
+            int ID_length = snprintf(ID, sizeof(ID), "b%ds%d", scenario % 1000, index);
+
+            DIE(ID_length >= MAX_ID_LEN, "Too many subscribers for the client IDs");
+
+            subscribers[index].socket = connect_subscriber(config, port, ID, topics, index < wildcard_count);
+            subscribers[index].buffer.resize(BENCH_READ_BUFFER);
+        }
+
+        /* Receivers, each reading a share of the connections */
+        int receiver_count = std::min(config.receivers, config.subscribers);
+        std::vector<struct receiver> receivers(receiver_count);
+        std::atomic<bool> stop_receivers{false};
+
+        for (int index = 0; index < config.subscribers; index++) {
+            receivers[index % receiver_count].connections.push_back(&subscribers[index]);
+        }
+
+        for (auto& state: receivers) {
+            state.thread = std::thread(run_receiver, std::ref(state), std::ref(stop_receivers));
+        }
+
+        auto delivered = [&]() {
+            uint64_t total = 0;
+
+            for (auto& state: receivers) {
+                total += state.delivered.load(std::memory_order_relaxed);
+            }
+
+            return total;
+        };
+
+        /* Publishing window */
+        std::vector<std::thread> publishers;
+        std::atomic<bool> stop_publishers{false};
+        std::atomic<uint64_t> published{0};
+
+        struct scenario_result result;
+        uint64_t start = monotonic_us();
+
+        for (int index = 0; index < config.publishers; index++) {
+            publishers.emplace_back(run_publisher, std::cref(config), port, topics, std::cref(values),
+                                    std::ref(stop_publishers), std::ref(published));
+        }
+
+        usleep(config.duration * 1000);
+        stop_publishers = true;
+
+        for (auto& thread: publishers) {
+            thread.join();
+        }
+
+        result.seconds = (monotonic_us() - start) / 1e6;
+        result.delivered_in_window = delivered();
+        result.published = published;
+
+        /* Drain: wait until deliveries stop for 100 ms */
+        uint64_t deadline = monotonic_us() + BENCH_DRAIN * 1000ULL;
+        uint64_t last = result.delivered_in_window;
+
+        while (monotonic_us() < deadline) {
+            usleep(100000);
+
+            uint64_t now = delivered();
+
+            if (now == last) {
+                break;
+            }
+
+            last = now;
+        }
+
+        stop_receivers = true;
+
+        for (auto& state: receivers) {
+            state.thread.join();
+            result.latencies.insert(result.latencies.end(), state.latencies.begin(), state.latencies.end());
+        }
+
+        result.delivered = delivered();
+
+        for (auto& subscriber: subscribers) {
+            close(subscriber.socket);
+        }
+
+        stop_server(server);
+
+        std::sort(result.latencies.begin(), result.latencies.end());
+
+        return result;
+    }
+
+    /**
+     * Gets a latency percentile.
+     *
+     * @param latencies sorted
+     * @param fraction
+     */
+    uint32_t percentile(const std::vector<uint32_t>& latencies, double fraction) {
+        size_t index = std::min((size_t)(fraction * latencies.size()), latencies.size() - 1);
+
+        return latencies[index];
+    }
+
+    /**
+     * Prints a scenario result as one line of JSON.
+     */
+    void print_result(FILE *out, const struct bench_config& config, int topics, int wildcard_percent, int type,
+                        const struct scenario_result& result) {
+        uint64_t expected = result.published * config.subscribers;
+
+        fprintf(out, "{\"topics\": %d, \"wildcard_percent\": %d, \"type\": \"%s\", \"publishers\": %d, "
+                        "\"subscribers\": %d, \"raw\": %s, \"rate\": %d, \"duration_ms\": %d, "
+                        "\"published\": %lu, \"delivered\": %lu, \"loss\": %.4f, "
+                        "\"published_per_sec\": %.0f, \"delivered_per_sec\": %.0f, \"latency_samples\": %zu",
+                topics, wildcard_percent, TYPE_NAMES[type], config.publishers, config.subscribers,
+                config.raw ? "true" : "false", config.rate, config.duration,
+                result.published, result.delivered,
+                expected > 0 ? 1.0 - (double)result.delivered / expected : 0.0,
+                result.published / result.seconds, result.delivered_in_window / result.seconds,
+                result.latencies.size());
+
+        if (result.latencies.empty()) {
+            fprintf(out, ", \"latency_us\": null}\n");
+            return;
+        }
+
+        fprintf(out, ", \"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}}\n",
+                percentile(result.latencies, 0.5), percentile(result.latencies, 0.99),
+                percentile(result.latencies, 0.999), result.latencies.back());
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef FANOUT_CACHE_H
+#define FANOUT_CACHE_H
+
+#include "topic_intern.h"
+#include "topic_trie.h"
+
+#define FANOUT_CACHE_MAX_BYTES (4 << 20)
+
+namespace subscription_protocol {
+    /**
+     * Fan-out list of an interned topic.
+     */
+    struct fanout_entry {
+        std::vector<struct TCP_Client *> clients;
+        uint64_t generation = 0;    // of the trie the list was computed from
+        bool cached = false;
+    };
+
+    /**
+     * Cache mapping a concrete topic to the deduplicated list of clients
+     * subscribed to (at least) one pattern matching it.
+     *
+     * Topics are interned on the way in: the lists live in an array
+     * indexed by topic ID, and a topic evicted from the intern table
+     * takes its list with it.
+     *
+     * Lists hold every matching client, connected or not; sessions keep
+     * their subscriptions across reconnects, so a disconnect does not
+     * change them and senders only have to skip inactive clients.
+     *
+     * Subscription changes never touch the cache: a list computed before
+     * the latest change of the trie (see topic_trie::generation) is
+     * recomputed by the next lookup of its topic.
+     */
+    struct fanout_cache {
+        topic_table topics;
+        std::vector<struct fanout_entry> entries;   // by topic ID
+
+        size_t max_bytes;
+        size_t used_bytes = 0;
+        size_t cached = 0;
+
+        size_t hits = 0;
+        size_t misses = 0;      // stale lists included
+        size_t evictions = 0;
+
+        explicit fanout_cache(size_t max_bytes = FANOUT_CACHE_MAX_BYTES, size_t max_topics = TOPIC_TABLE_MAX)
+                : topics(max_topics), max_bytes(max_bytes) {}
+
+        /**
+         * Gets the clients to be notified about given topic, computing
+         * (and caching) the list from the subscription trie on a miss.
+         *
+         * @param topic
+         * @param subscriptions
+         * @return
+         */
+        const std::vector<struct TCP_Client *>& lookup(std::string_view topic, const topic_trie& subscriptions) {
+            uint32_t id = topics.intern(topic, [&](uint32_t evicted) {
+                if (evicted < entries.size() && entries[evicted].cached) {
+                    drop(entries[evicted]);
+                }
+            });
+
+            if (id >= entries.size()) {
+                entries.resize(topics.id_limit());
+            }
+
+            struct fanout_entry& entry = entries[id];
+
+            if (entry.cached) {
+                if (entry.generation == subscriptions.generation) {
+                    hits++;
+                    return entry.clients;
+                }
+
+                drop(entry);
+            }
+
+            misses++;
+
+            std::vector<struct TCP_Client *>& clients = entry.clients;
+
+            subscriptions.match(topic, [&](const std::vector<struct TCP_Client *>& subscribers) {
+                clients.insert(clients.end(), subscribers.begin(), subscribers.end());
+            });
+
+            // A client subscribed to several matching patterns is notified once
+            std::sort(clients.begin(), clients.end());
+            clients.erase(std::unique(clients.begin(), clients.end()), clients.end());
+            clients.shrink_to_fit();
+
+            size_t cost = entry_cost(clients);
+
+            while (used_bytes + cost > max_bytes && cached > 0) {
+                evict_next();
+            }
+
+            used_bytes += cost;
+            entry.generation = subscriptions.generation;
+            entry.cached = true;
+            cached++;
+
+            return clients;
+        }
+
+    private:
+        size_t hand = 0;    // next entry looked at for eviction
+
+        static size_t entry_cost(const std::vector<struct TCP_Client *>& clients) {
+            // Rough estimate of entry and vector storage
+            return sizeof(struct fanout_entry) + clients.size() * sizeof(struct TCP_Client *);
+        }
+
+        void drop(struct fanout_entry& entry) {
+            used_bytes -= entry_cost(entry.clients);
+            std::vector<struct TCP_Client *>().swap(entry.clients);
+            entry.cached = false;
+            cached--;
+        }
+
+        /**
+         * Evicts the next cached list after the hand (the list being
+         * computed is not cached yet, so it is never picked).
+         */
+        void evict_next() {
+            while (!entries[hand % entries.size()].cached) {
+                hand++;
+            }
+
+            drop(entries[hand % entries.size()]);
+            hand++;
+            evictions++;
+        }
+    };
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <cstring>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -11,17 +13,20 @@
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
-#include <regex>
+#include <algorithm>
 #include <cmath>
 
 #ifndef HELPERS_H
 #define HELPERS_H
 
-#define MAX_POLL_FDS 32
+#define MAX_EPOLL_EVENTS 64
 #define MAX_COMMAND_LEN 256
 #define MAX_ID_LEN 10
 #define MAX_IP_LEN 20
+#define MAX_TOPIC_SIZE 50
+#define MAX_UDP_PAYLOAD_SIZE 1500
 #define MAX_NOTIFICATION_LEN 2000
+#define MAX_FRAME_PAYLOAD MAX_NOTIFICATION_LEN
 
 #define DIE(assertion, call_description)                                       \
   do {                                                                         \
@@ -33,6 +38,19 @@
   } while (0)
 
 namespace connection {
+    /**
+     * Puts descriptor in non-blocking mode.
+     *
+     * @param fd
+     */
+    void set_non_blocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        DIE(flags < 0, "fcntl(F_GETFL) failed");
+
+        int rc = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        DIE(rc < 0, "fcntl(F_SETFL) failed");
+    }
+
     /**
      * Get command keyword from STDIN buffer.
      *
@@ -40,7 +58,7 @@ namespace connection {
      * @return
      */
     char *get_command(char *buffer) {
-        char backup[MAX_COMMAND_LEN];
+        static thread_local char backup[MAX_COMMAND_LEN];   // workers parse commands concurrently
 
         strncpy(backup, buffer, MAX_COMMAND_LEN);
 
@@ -60,16 +78,38 @@ namespace connection {
      * @return
      */
     char *get_topic(char *buffer) {
-        char *backup = (char *)calloc(MAX_COMMAND_LEN, sizeof(char));
+        static thread_local char backup[MAX_COMMAND_LEN];
+
+        strncpy(backup, buffer, MAX_COMMAND_LEN - 1);
 
-        strncpy(backup, buffer, MAX_COMMAND_LEN);
-        
         char *p = strtok(backup, " ");
         p = strtok(NULL, " ");
 
         return p;
     }
 
+    /**
+     * Get an argument following the topic of a command (e.g. the SF flag
+     * of "subscribe <topic> <sf>").
+     *
+     * @param buffer
+     * @param index position of the argument after the topic
+     * @return NULL if the command has no such argument
+     */
+    char *get_argument(char *buffer, int index = 0) {
+        static thread_local char backup[MAX_COMMAND_LEN];
+
+        strncpy(backup, buffer, MAX_COMMAND_LEN - 1);
+
+        char *p = strtok(backup, " \n");
+
+        for (index += 2; index > 0 && p != NULL; index--) {
+            p = strtok(NULL, " \n");
+        }
+
+        return p;
+    }
+
     /**
      * Receive full message from socket-descriptor argument.
      *
@@ -77,7 +117,8 @@ namespace connection {
      * @param buffer message buffer
      * @param len length of message
      * @param isUDP
-     * @return number of bytes received
+     * @return number of bytes received (actual datagram size for UDP,
+     *         0 if a non-blocking UDP socket has nothing pending)
      */
     size_t receive_full_message(int socket, void *buffer, size_t len,
                                     bool isUDP = false, struct sockaddr *from = NULL, socklen_t *addrlen = NULL) {
@@ -95,16 +136,25 @@ namespace connection {
         }
 
         if (isUDP) {    // UDP message - use recvfrom()
-            size_t current_byte_count = recvfrom(socket, buff, len, 0, from, addrlen);
+            ssize_t current_byte_count = recvfrom(socket, buff, len, 0, from, addrlen);
+
+            if (current_byte_count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;   // Non-blocking socket has no pending datagram
+            }
+
             DIE(current_byte_count == -1, "Receive bytes error");
 
-            return len;
+            return current_byte_count;
         }
 
         while (bytes_remaining != 0) {
             size_t current_byte_count = recv(socket, buff + bytes_received, bytes_remaining, 0);
             DIE(current_byte_count == -1, "Receive bytes error");
 
+            if (current_byte_count == 0) {  // Peer closed the connection
+                break;
+            }
+
             bytes_remaining -= current_byte_count;
             bytes_received += current_byte_count;
         }
@@ -118,7 +168,7 @@ namespace connection {
      * @param socket socket to send data to
      * @param buffer message buffer
      * @param len length of message
-     * @return number of bytes sent
+     * @return number of bytes sent (less than len if the connection failed)
      */
     size_t send_full_message(int socket, void *buffer, size_t len) {
         size_t bytes_sent = 0;
@@ -126,8 +176,22 @@ namespace connection {
         char *buff = (char *) buffer;
 
         while (bytes_remaining != 0) {
-            size_t current_byte_count = send(socket, buff + bytes_sent, bytes_remaining, 0);
-            DIE(current_byte_count == -1, "Send bytes error");
+            ssize_t current_byte_count = send(socket, buff + bytes_sent, bytes_remaining, MSG_NOSIGNAL);
+
+            if (current_byte_count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* Non-blocking socket is full; wait until it drains */
+                struct pollfd writable = {socket, POLLOUT, 0};
+                poll(&writable, 1, -1);
+                continue;
+            }
+
+            if (current_byte_count == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (current_byte_count == -1) {     // Peer went away; let the caller decide
+                break;
+            }
 
             bytes_remaining -= current_byte_count;
             bytes_sent += current_byte_count;
@@ -135,6 +199,55 @@ namespace connection {
 
         return bytes_sent;
     }
+
+    /**
+     * Header preceding every frame of the v2 (length-prefixed) protocol.
+     */
+    struct __attribute__((packed)) frame_header {
+        uint8_t type;
+        uint8_t flags;
+        uint16_t length;    // payload length, network byte order
+    };
+
+    /**
+     * Encode a frame (header + payload) into buffer.
+     *
+     * @param buffer output buffer, at least sizeof(frame_header) + len bytes
+     * @param type frame type
+     * @param flags frame flags
+     * @param payload frame payload
+     * @param len length of payload
+     * @return frame length
+     */
+    size_t encode_frame(char *buffer, uint8_t type, uint8_t flags, const void *payload, size_t len) {
+        DIE(len > MAX_FRAME_PAYLOAD, "Frame payload too long");
+
+        struct frame_header *header = (struct frame_header *)buffer;
+
+        header->type = type;
+        header->flags = flags;
+        header->length = htons(len);
+
+        memmove(buffer + sizeof(struct frame_header), payload, len);
+
+        return sizeof(struct frame_header) + len;
+    }
+
+    /**
+     * Send a frame (header + payload) to socket-descriptor argument.
+     *
+     * @param socket socket to send data to
+     * @param type frame type
+     * @param flags frame flags
+     * @param payload frame payload
+     * @param len length of payload
+     * @return number of bytes sent
+     */
+    size_t send_frame(int socket, uint8_t type, uint8_t flags, const void *payload, size_t len) {
+        char buffer[sizeof(struct frame_header) + MAX_FRAME_PAYLOAD];
+
+        return send_full_message(socket, buffer, encode_frame(buffer, type, flags, payload, len));
+    }
 }
 
 #endif
@@ -0,0 +1,551 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include "helpers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+
+#define LOG_SEGMENT_SIZE (16 << 20)
+#define LOG_MIN_SEGMENT_SIZE (64 << 10)
+#define LOG_RETENTION_BYTES (1UL << 30)
+#define LOG_RETENTION_AGE (7 * 24 * 3600)  // seconds; 0 keeps segments regardless of age
+#define LOG_SYNC_INTERVAL 50        // milliseconds between two group commits
+#define LOG_INDEX_INTERVAL 64       // records between two sparse index entries
+
+namespace message_log {
+    /**
+     * Header of a record; the datagram follows it and records are padded
+     * to 8 bytes. A zero length marks the end of the written part.
+     */
+    struct record_header {
+        uint32_t length;        // datagram bytes
+        uint32_t checksum;      // over the fields below and the datagram
+        uint64_t sequence;
+        int64_t timestamp;      // milliseconds since the epoch
+        uint32_t address;       // publisher (network byte order)
+        uint16_t port;
+        uint16_t reserved;
+    };
+
+    struct index_entry {
+        uint64_t sequence;
+        size_t offset;
+    };
+
+    /**
+     * Fixed-size file mapped in memory; records are appended to the last
+     * segment of the log only.
+     */
+    struct segment {
+        std::string path;
+        int fd;
+        char *data;
+        size_t size;
+
+        uint64_t base;          // sequence of the first record
+        uint64_t next;          // sequence following the last record
+        int64_t last_timestamp = 0;
+
+        std::atomic<size_t> end{0};     // bytes taken by complete records
+        size_t synced = 0;      // bytes known to be on disk (flusher only)
+
+        std::vector<struct index_entry> index;  // every LOG_INDEX_INTERVAL-th record
+    };
+
+    /**
+     * Append-only log of datagrams, split in segments numbered by the
+     * sequence of their first record. Appends only copy into the mapped
+     * pages; a flusher thread commits them to disk in groups.
+     */
+    struct segmented_log {
+        std::string directory;
+        size_t segment_size = LOG_SEGMENT_SIZE;
+        size_t retention_bytes = LOG_RETENTION_BYTES;
+        int64_t retention_age = LOG_RETENTION_AGE;
+        int sync_interval = LOG_SYNC_INTERVAL;
+
+        std::deque<struct segment *> segments;  // oldest first
+        uint64_t next_sequence = 0;
+        size_t bytes = 0;
+        int64_t last_retention_check = 0;
+
+        /* Latest sessions file of the server (see save_sessions()), written by the flusher */
+        std::string sessions;
+        bool sessions_dirty = false;
+
+        /* Guards the segment list and the sessions file against the flusher (appends do not take it) */
+        std::mutex lock;
+        /* Held by the flusher while it writes segments out: retention only tries it */
+        std::mutex sync_lock;
+        std::condition_variable wakeup;
+        bool stopping = false;
+        std::thread flusher;
+
+        uint64_t appended = 0;
+        std::atomic<uint64_t> syncs{0};
+        uint64_t deleted_segments = 0;
+    };
+
+    int64_t current_time() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    size_t record_size(uint32_t length) {
+        return (sizeof(struct record_header) + length + 7) & ~(size_t)7;
+    }
+
+    /**
+     * FNV-1a over the header (checksum and length excluded) and the datagram;
+     * tells complete records from the leftovers of an interrupted write.
+     */
+    uint32_t checksum(const struct record_header& header, const char *data) {
+        uint32_t hash = 2166136261u ^ header.length;
+
+        const char *fields = (const char *)&header.sequence;
+        size_t fields_length = sizeof(header) - offsetof(struct record_header, sequence);
+
+        for (size_t index = 0; index < fields_length; index++) {
+            hash = (hash ^ (uint8_t)fields[index]) * 16777619u;
+        }
+
+        for (size_t index = 0; index < header.length; index++) {
+            hash = (hash ^ (uint8_t)data[index]) * 16777619u;
+        }
+
+        return hash;
+    }
+
+    /**
+     * Opens (or creates) and maps the segment starting at given sequence.
+     *
+     * @param log
+     * @param base
+     * @return
+     */
+    struct segment *map_segment(struct segmented_log& log, uint64_t base) {
+        struct segment *s = new segment{};
+
+        char name[32];
+        snprintf(name, sizeof(name), "/%020lu.log", base);
+
+        s->path = log.directory + name;
+        s->base = base;
+        s->next = base;
+
+        s->fd = open(s->path.c_str(), O_RDWR | O_CREAT, 0644);
+        DIE(s->fd < 0, "Cannot open log segment");
+
+        struct stat info;
+        DIE(fstat(s->fd, &info) < 0, "fstat failed");
+
+        /* New segments are allocated at full size (sparse), old ones keep theirs */
+        s->size = info.st_size > 0 ? info.st_size : log.segment_size;
+
+        if (info.st_size == 0) {
+            DIE(ftruncate(s->fd, s->size) < 0, "Cannot allocate log segment");
+        }
+
+        s->data = (char *)mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        DIE(s->data == MAP_FAILED, "Cannot map log segment");
+
+        return s;
+    }
+
+    void unmap_segment(struct segment *s) {
+        munmap(s->data, s->size);
+        close(s->fd);
+
+        delete s;
+    }
+
+    /**
+     * Finds the complete records of a segment written by an earlier run
+     * and rebuilds its index.
+     *
+     * @param s
+     */
+    void scan_segment(struct segment *s) {
+        size_t offset = 0;
+
+        while (offset + sizeof(struct record_header) <= s->size) {
+            const struct record_header *header = (const struct record_header *)(s->data + offset);
+
+            if (header->length == 0 || header->length > s->size - offset - sizeof(struct record_header)
+                || header->sequence != s->next || header->checksum != checksum(*header, (const char *)(header + 1))) {
+                break;
+            }
+
+            if ((header->sequence - s->base) % LOG_INDEX_INTERVAL == 0) {
+                s->index.push_back({header->sequence, offset});
+            }
+
+            s->next++;
+            s->last_timestamp = header->timestamp;
+
+            offset += record_size(header->length);
+        }
+
+        s->end.store(offset, std::memory_order_relaxed);
+        s->synced = offset;
+    }
+
+    /**
+     * Writes the dirty part of given segments to disk.
+     *
+     * @param log
+     * @param segments
+     */
+    template <typename Segments>
+    void sync_segments(struct segmented_log& log, const Segments& segments) {
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+        for (struct segment *s: segments) {
+            size_t end = s->end.load(std::memory_order_acquire);
+
+            if (s->synced == end) {
+                continue;
+            }
+
+            size_t start = s->synced & ~(page_size - 1);
+
+            if (msync(s->data + start, end - start, MS_SYNC) < 0) {
+                perror("msync failed");
+            }
+
+            s->synced = end;
+            log.syncs++;
+        }
+    }
+
+    /**
+     * Replaces the sessions file in the log directory atomically.
+     *
+     * @param directory
+     * @param contents
+     */
+    void write_sessions(const std::string& directory, const std::string& contents) {
+        std::string path = directory + "/sessions";
+        std::string temporary = path + ".tmp";
+
+        FILE *file = fopen(temporary.c_str(), "w");
+        DIE(file == NULL, "Cannot write log sessions");
+
+        fwrite(contents.data(), 1, contents.size(), file);
+
+        fflush(file);
+        fsync(fileno(file));
+        fclose(file);
+
+        DIE(rename(temporary.c_str(), path.c_str()) < 0, "Cannot write log sessions");
+    }
+
+    /**
+     * Hands the latest sessions file over to the flusher, which writes it
+     * after its next group commit (the positions it holds are then on disk).
+     *
+     * @param log
+     * @param contents
+     */
+    void save_sessions(struct segmented_log& log, std::string contents) {
+        std::lock_guard<std::mutex> guard(log.lock);
+
+        log.sessions = std::move(contents);
+        log.sessions_dirty = true;
+    }
+
+    /**
+     * Group commit: whatever has been appended since the last round goes
+     * to disk together, so ingest never waits for the disk; so does the
+     * sessions file, if it has been handed over since.
+     */
+    void run_flusher(struct segmented_log& log) {
+        std::vector<struct segment *> segments;
+        std::string contents;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(log.lock);
+
+                if (log.stopping) {
+                    return;
+                }
+
+                log.wakeup.wait_for(guard, std::chrono::milliseconds(log.sync_interval));
+            }
+
+            /* The disk is only waited for with the segment list released: appends
+             * sealing a segment take it, and retention leaves the round alone */
+            std::lock_guard<std::mutex> syncing(log.sync_lock);
+            bool sessions_dirty;
+
+            {
+                std::lock_guard<std::mutex> guard(log.lock);
+
+                segments.assign(log.segments.begin(), log.segments.end());
+
+                sessions_dirty = log.sessions_dirty;
+
+                if (sessions_dirty) {
+                    contents = std::move(log.sessions);
+                    log.sessions_dirty = false;
+                }
+            }
+
+            sync_segments(log, segments);
+
+            if (sessions_dirty) {
+                write_sessions(log.directory, contents);
+            }
+        }
+    }
+
+    /**
+     * Deletes the oldest segments while the log is over its size or age
+     * limit; the segment being written is always kept. Nothing is deleted
+     * while the flusher writes segments out: the next append tries again.
+     *
+     * @param log
+     * @param now
+     */
+    void enforce_retention(struct segmented_log& log, int64_t now) {
+        std::unique_lock<std::mutex> syncing(log.sync_lock, std::try_to_lock);
+
+        if (!syncing.owns_lock()) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(log.lock);
+
+        log.last_retention_check = now;
+
+        while (log.segments.size() > 1) {
+            struct segment *oldest = log.segments.front();
+
+            bool too_big = log.bytes > log.retention_bytes;
+            bool too_old = log.retention_age > 0 && now - oldest->last_timestamp > log.retention_age * 1000;
+
+            if (!too_big && !too_old) {
+                break;
+            }
+
+            log.bytes -= oldest->end.load(std::memory_order_relaxed);
+            log.deleted_segments++;
+
+            unlink(oldest->path.c_str());
+            unmap_segment(oldest);
+
+            log.segments.pop_front();
+        }
+    }
+
+    /**
+     * Opens the log kept in given directory (created if missing) and
+     * starts its flusher.
+     *
+     * @param log limits already set
+     * @param directory
+     */
+    void open_log(struct segmented_log& log, const char *directory) {
+        log.directory = directory;
+
+        DIE(mkdir(directory, 0755) < 0 && errno != EEXIST, "Cannot create log directory");
+
+        DIR *listing = opendir(directory);
+        DIE(listing == NULL, "Cannot open log directory");
+
+        std::vector<uint64_t> bases;
+
+        for (struct dirent *entry = readdir(listing); entry != NULL; entry = readdir(listing)) {
+            uint64_t base;
+            char suffix[8];
+
+            if (sscanf(entry->d_name, "%20lu.%7s", &base, suffix) == 2 && strcmp(suffix, "log") == 0) {
+                bases.push_back(base);
+            }
+        }
+
+        closedir(listing);
+
+        std::sort(bases.begin(), bases.end());
+
+        for (uint64_t base: bases) {
+            struct segment *s = map_segment(log, base);
+
+            scan_segment(s);
+
+            log.segments.push_back(s);
+            log.bytes += s->end.load(std::memory_order_relaxed);
+        }
+
+        if (log.segments.empty()) {
+            log.segments.push_back(map_segment(log, 0));
+        }
+
+        struct segment *active = log.segments.back();
+
+        /* Zero whatever an interrupted write left after the last complete record */
+        size_t end = active->end.load(std::memory_order_relaxed);
+
+        DIE(ftruncate(active->fd, end) < 0 || ftruncate(active->fd, active->size) < 0, "Cannot trim log segment");
+
+        log.next_sequence = active->next;
+
+        enforce_retention(log, current_time());
+
+        log.flusher = std::thread(run_flusher, std::ref(log));
+    }
+
+    /**
+     * Stops the flusher after a last commit and unmaps the segments.
+     */
+    void close_log(struct segmented_log& log) {
+        {
+            std::lock_guard<std::mutex> guard(log.lock);
+            log.stopping = true;
+        }
+
+        log.wakeup.notify_one();
+        log.flusher.join();
+
+        sync_segments(log, log.segments);
+
+        if (log.sessions_dirty) {
+            write_sessions(log.directory, log.sessions);
+            log.sessions_dirty = false;
+        }
+
+        for (struct segment *s: log.segments) {
+            unmap_segment(s);
+        }
+
+        log.segments.clear();
+    }
+
+    /**
+     * Appends a datagram to the log.
+     *
+     * @param log
+     * @param data
+     * @param length
+     * @param from publisher address
+     * @return sequence number of the record
+     */
+    uint64_t append(struct segmented_log& log, const void *data, size_t length, const struct sockaddr_in& from) {
+        int64_t now = current_time();
+        size_t size = record_size(length);
+
+        struct segment *active = log.segments.back();
+        size_t offset = active->end.load(std::memory_order_relaxed);
+
+        if (offset + size > active->size) {
+            /* Seal the segment; the flusher commits what is left of it */
+            struct segment *next = map_segment(log, log.next_sequence);
+
+            {
+                std::lock_guard<std::mutex> guard(log.lock);
+                log.segments.push_back(next);
+            }
+
+            log.wakeup.notify_one();
+
+            active = next;
+            offset = 0;
+
+            enforce_retention(log, now);
+        } else if (now - log.last_retention_check >= 1000) {
+            enforce_retention(log, now);
+        }
+
+        struct record_header *header = (struct record_header *)(active->data + offset);
+
+        memcpy(header + 1, data, length);
+
+        header->length = length;
+        header->sequence = log.next_sequence;
+        header->timestamp = now;
+        header->address = from.sin_addr.s_addr;
+        header->port = from.sin_port;
+        header->reserved = 0;
+        header->checksum = checksum(*header, (const char *)data);
+
+        if ((header->sequence - active->base) % LOG_INDEX_INTERVAL == 0) {
+            active->index.push_back({header->sequence, offset});
+        }
+
+        active->end.store(offset + size, std::memory_order_release);
+        active->next = ++log.next_sequence;
+        active->last_timestamp = now;
+
+        log.bytes += size;
+        log.appended++;
+
+        return header->sequence;
+    }
+
+    /**
+     * Visits the records of the log from given sequence on, reading them
+     * straight from the mapped segments (records deleted by retention
+     * are skipped). visit(header, data) returns false to stop.
+     *
+     * @param log
+     * @param sequence first record to visit
+     * @param visit
+     * @return sequence following the last visited record
+     */
+    template <typename Visit>
+    uint64_t replay(struct segmented_log& log, uint64_t sequence, Visit&& visit) {
+        /* Last segment starting at or before the sequence, found by base */
+        auto iter = std::upper_bound(log.segments.begin(), log.segments.end(), sequence,
+                                        [](uint64_t value, const struct segment *s) { return value < s->base; });
+
+        if (iter != log.segments.begin()) {
+            iter--;
+        }
+
+        for (; iter != log.segments.end(); iter++) {
+            struct segment *s = *iter;
+            size_t end = s->end.load(std::memory_order_relaxed);
+            size_t offset = 0;
+
+            /* Sparse index: closest indexed record at or before the sequence */
+            auto entry = std::upper_bound(s->index.begin(), s->index.end(), sequence,
+                                            [](uint64_t value, const struct index_entry& e) { return value < e.sequence; });
+
+            if (entry != s->index.begin()) {
+                offset = (entry - 1)->offset;
+            }
+
+            while (offset < end) {
+                const struct record_header *header = (const struct record_header *)(s->data + offset);
+
+                offset += record_size(header->length);
+
+                if (header->sequence < sequence) {
+                    continue;
+                }
+
+                sequence = header->sequence + 1;
+
+                if (!visit(*header, (const char *)(header + 1))) {
+                    return sequence;
+                }
+            }
+        }
+
+        return log.next_sequence;
+    }
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef METRICS_ENDPOINT_H
+#define METRICS_ENDPOINT_H
+
+#include "helpers.h"
+#include "server_stats.h"
+#include "subscription_protocol.h"
+
+#include <string>
+
+#define METRICS_MAX_REQUEST 8192        // request line and headers of a scrape
+#define METRICS_CLIENTS_PER_PASS 256    // sessions formatted per pass of the event loop
+
+namespace metrics {
+    enum scrape_state {
+        SCRAPE_READING,     // waiting for the end of the request headers
+        SCRAPE_BUILDING,    // formatting the per-client series, a chunk per pass
+        SCRAPE_SENDING,     // writing the response out
+    };
+
+    /**
+     * HTTP connection of a scraper (one request, then the server closes it).
+     *
+     * The exposition is built over several passes of the event loop: the
+     * server-wide series at once, then METRICS_CLIENTS_PER_PASS sessions
+     * at a time, so that a scrape never holds up the datagrams.
+     */
+    struct scrape {
+        int fd;
+        enum scrape_state state = SCRAPE_READING;
+
+        std::string request;
+        std::string body;           // server-wide series
+        std::string response;
+        size_t sent = 0;
+
+        /* Sessions still to format; they are never freed while the server runs */
+        std::vector<struct subscription_protocol::TCP_Client *> clients;
+        size_t next_client = 0;
+        size_t active = 0, inactive = 0;
+
+        /* One string per family: samples of a family have to be adjacent */
+        std::string queue_bytes, queue_messages, dropped, conflated;
+    };
+
+    /**
+     * Opens the non-blocking metrics listener on the loopback interface.
+     *
+     * @param port
+     * @return listening socket
+     */
+    int open_listener(uint16_t port) {
+        const int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        DIE(listen_fd < 0, "Metrics socket error");
+
+        const int enable = 1;
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+            perror("setsockopt(SO_REUSEADDR) failed");
+
+        struct sockaddr_in addr = {};
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int rc = bind(listen_fd, (const struct sockaddr *)&addr, sizeof(addr));
+        DIE(rc < 0, "Metrics binding error");
+
+        rc = listen(listen_fd, SOMAXCONN);
+        DIE(rc < 0, "Metrics listening error");
+
+        return listen_fd;
+    }
+
+    /**
+     * Reads what the scraper has sent.
+     *
+     * @param s
+     * @return false if the connection is to be closed (EOF, error, request too long)
+     */
+    bool read_request(struct scrape& s) {
+        char buffer[1024];
+
+        while (true) {
+            ssize_t rc = read(s.fd, buffer, sizeof(buffer));
+
+            if (rc < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+
+            if (rc == 0) {
+                return false;
+            }
+
+            s.request.append(buffer, rc);
+
+            if (s.request.size() > METRICS_MAX_REQUEST) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * @return true once the request headers are complete
+     */
+    bool request_complete(const struct scrape& s) {
+        return s.request.find("\r\n\r\n") != std::string::npos || s.request.find("\n\n") != std::string::npos;
+    }
+
+    /**
+     * Checks the request line: only GET /metrics (or /) is served.
+     *
+     * @param s
+     * @return NULL, or the status line of the error to reply with
+     */
+    const char *check_request(const struct scrape& s) {
+        if (s.request.compare(0, 4, "GET ") != 0) {
+            return "405 Method Not Allowed";
+        }
+
+        size_t end = s.request.find_first_of(" ?\r\n", 4);
+        std::string_view path = std::string_view(s.request).substr(4, end - 4);
+
+        if (path != "/metrics" && path != "/") {
+            return "404 Not Found";
+        }
+
+        return NULL;
+    }
+
+    /**
+     * Prepares the response (headers and body) for sending.
+     */
+    void set_response(struct scrape& s, const char *status, const std::string& body) {
+        char header[256];
+
+        snprintf(header, sizeof(header),
+                    "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body.size());
+
+        s.response = header;
+        s.response += body;
+        s.state = SCRAPE_SENDING;
+    }
+
+    /**
+     * Writes as much of the response as the socket takes.
+     *
+     * @param s
+     * @return true once the response is out (or the scraper is gone)
+     */
+    bool send_response(struct scrape& s) {
+        while (s.sent < s.response.size()) {
+            ssize_t rc = send(s.fd, s.response.data() + s.sent, s.response.size() - s.sent,
+                                MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return errno != EAGAIN && errno != EWOULDBLOCK;
+            }
+
+            s.sent += rc;
+        }
+
+        return true;
+    }
+
+    /**
+     * Appends the HELP and TYPE lines of a metric family.
+     */
+    void append_family(std::string& out, const char *name, const char *type, const char *help) {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    /**
+     * Appends a label value, escaped as the text format requires.
+     */
+    void append_label_value(std::string& out, std::string_view value) {
+        for (char c: value) {
+            if (c == '\\' || c == '"') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    /**
+     * Appends a sample: name{labels} value (labels already formatted, or NULL).
+     */
+    void append_sample(std::string& out, const char *name, const char *labels, double value) {
+        char line[256];
+
+        /* Counts are printed whole, fractions with 9 significant digits */
+        const char *format = value == std::floor(value) && std::fabs(value) < 1e15 ? "%s%s%s%s %.0f\n"
+                                                                                   : "%s%s%s%s %.9g\n";
+
+        snprintf(line, sizeof(line), format, name, labels != NULL ? "{" : "",
+                    labels != NULL ? labels : "", labels != NULL ? "}" : "", value);
+
+        out += line;
+    }
+
+    /**
+     * Appends the sample of a client: name{client="ID"} value.
+     */
+    void append_client_sample(std::string& out, const char *name, const char *client_ID, uint64_t value) {
+        char number[32];
+
+        out += name;
+        out += "{client=\"";
+        append_label_value(out, client_ID);
+        out += "\"} ";
+
+        snprintf(number, sizeof(number), "%lu\n", value);
+        out += number;
+    }
+
+    /**
+     * Appends the quantiles, sum and count of a histogram as summary samples.
+     *
+     * @param out
+     * @param name
+     * @param label label placed before the quantile (e.g. stage="match"), or ""
+     * @param values
+     * @param scale multiplier turning recorded values into the exported unit
+     */
+    void append_summary(std::string& out, const char *name, const char *label,
+                        const struct server_stats::histogram_counts& values, double scale) {
+        const char *separator = label[0] != '\0' ? "," : "";
+        char labels[128];
+        char suffixed[128];
+
+        for (double quantile: {0.5, 0.9, 0.99, 0.999}) {
+            snprintf(labels, sizeof(labels), "%s%squantile=\"%g\"", label, separator, quantile);
+            append_sample(out, name, labels, values.percentile(quantile) * scale);
+        }
+
+        snprintf(suffixed, sizeof(suffixed), "%s_sum", name);
+        append_sample(out, suffixed, label[0] != '\0' ? label : NULL, values.sum * scale);
+
+        snprintf(suffixed, sizeof(suffixed), "%s_count", name);
+        append_sample(out, suffixed, label[0] != '\0' ? label : NULL, values.total());
+    }
+
+    /**
+     * Appends the series of the hot path instrumentation (server_stats).
+     */
+    void append_stats(std::string& out, const struct server_stats::snapshot& totals) {
+        append_family(out, "pubsub_received_datagrams_total", "counter", "Datagrams read from the UDP sockets.");
+        append_sample(out, "pubsub_received_datagrams_total", NULL, totals.datagrams_in);
+
+        append_family(out, "pubsub_received_bytes_total", "counter", "Bytes of the datagrams read.");
+        append_sample(out, "pubsub_received_bytes_total", NULL, totals.bytes_in);
+
+        append_family(out, "pubsub_sent_notifications_total", "counter",
+                        "Notifications handed to the subscribers' output queues.");
+        append_sample(out, "pubsub_sent_notifications_total", NULL, totals.notifications_out);
+
+        append_family(out, "pubsub_sent_bytes_total", "counter", "Bytes of the notifications handed out.");
+        append_sample(out, "pubsub_sent_bytes_total", NULL, totals.bytes_out);
+
+        append_family(out, "pubsub_dropped_notifications_total", "counter",
+                        "Notifications dropped by the output queue overflow policy.");
+        append_sample(out, "pubsub_dropped_notifications_total", NULL, totals.drops);
+
+        append_family(out, "pubsub_matches_per_datagram", "summary", "Subscribers matched by a datagram.");
+        append_summary(out, "pubsub_matches_per_datagram", "", totals.matches, 1);
+
+        append_family(out, "pubsub_stage_latency_seconds", "summary",
+                        "Time spent in each stage of the hot path since startup.");
+
+        for (int stage = 0; stage < server_stats::STAGE_COUNT; stage++) {
+            char label[64];
+
+            snprintf(label, sizeof(label), "stage=\"%s\"", server_stats::STAGE_NAMES[stage]);
+            append_summary(out, "pubsub_stage_latency_seconds", label, totals.stages[stage],
+                            1e-9 / server_stats::ticks_per_ns);
+        }
+    }
+
+    /**
+     * Formats the next chunk of sessions of a scrape.
+     *
+     * @param s
+     * @return true once every session has been formatted
+     */
+    bool append_clients(struct scrape& s) {
+        size_t end = std::min(s.next_client + METRICS_CLIENTS_PER_PASS, s.clients.size());
+
+        for (; s.next_client < end; s.next_client++) {
+            struct subscription_protocol::TCP_Client *client = s.clients[s.next_client];
+
+            if (!client->isActive) {
+                s.inactive++;
+                continue;
+            }
+
+            s.active++;
+
+            append_client_sample(s.queue_bytes, "pubsub_client_output_queue_bytes", client->ID,
+                                    client->output.queued_bytes);
+            append_client_sample(s.queue_messages, "pubsub_client_output_queue_messages", client->ID,
+                                    client->output.messages.size());
+            append_client_sample(s.dropped, "pubsub_client_dropped_notifications_total", client->ID,
+                                    client->output.dropped_messages);
+            append_client_sample(s.conflated, "pubsub_client_conflated_notifications_total", client->ID,
+                                    client->output.replaced_messages);
+        }
+
+        return s.next_client == s.clients.size();
+    }
+
+    /**
+     * Appends the session series gathered by append_clients().
+     */
+    void append_sessions(struct scrape& s) {
+        append_family(s.body, "pubsub_sessions", "gauge", "Client sessions, connected or not.");
+        append_sample(s.body, "pubsub_sessions", "state=\"active\"", s.active);
+        append_sample(s.body, "pubsub_sessions", "state=\"inactive\"", s.inactive);
+
+        append_family(s.body, "pubsub_client_output_queue_bytes", "gauge",
+                        "Bytes waiting in the output queue of a connected client.");
+        s.body += s.queue_bytes;
+
+        append_family(s.body, "pubsub_client_output_queue_messages", "gauge",
+                        "Messages waiting in the output queue of a connected client.");
+        s.body += s.queue_messages;
+
+        append_family(s.body, "pubsub_client_dropped_notifications_total", "counter",
+                        "Notifications dropped from the output queue of a connected client.");
+        s.body += s.dropped;
+
+        append_family(s.body, "pubsub_client_conflated_notifications_total", "counter",
+                        "Notifications of a connected client replaced by a newer one of the same topic.");
+        s.body += s.conflated;
+    }
+}
+
+#endif
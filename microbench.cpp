@@ -0,0 +1,506 @@
+#include "subscription_protocol.h"
+
+#include <random>
+#include <string>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/*
+ * Microbenchmarks of the server's hot paths: topic matching, fan-out cache,
+ * subscription churn, notification formatting/encoding, command parsing and
+ * the retained value store.
+ * Each prints one JSON line: ns/op, allocations/op and, when the kernel
+ * lets us open a perf counter, cycles/op.
+ *
+ * Options: --filter=SUBSTRING (benchmarks whose name contains it),
+ *          --max-patterns=N (largest subscription table, 100000 by default)
+ */
+
+#define MICROBENCH_MIN_TIME 100000000ULL    // nanoseconds a measurement has to last
+#define MICROBENCH_CLIENTS 1000             // fake subscribers the patterns are spread over
+#define MICROBENCH_TOPICS 4096              // topics published in the matching benchmarks
+
+using namespace subscription_protocol;
+
+/* Allocation counter: malloc and friends are interposed (operator new goes through malloc) */
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+    void __libc_free(void *pointer);
+}
+
+static uint64_t allocations = 0;
+
+extern "C" void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer) {
+    __libc_free(pointer);
+}
+
+namespace microbench {
+    const char *filter = "";
+    int max_patterns = 100000;
+    int cycles_fd = -1;     // perf_event_open() counter of user-space CPU cycles, if permitted
+
+    volatile size_t sink;   // results of the measured calls, so that they are not optimized away
+
+    void open_cycle_counter() {
+        struct perf_event_attr attr = {};
+
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+        if (cycles_fd < 0) {
+            fprintf(stderr, "perf_event_open unavailable (%s); cycles/op not reported\n", strerror(errno));
+        }
+    }
+
+    uint64_t now_ns() {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    /**
+     * Times body(index) over batches of growing size until one lasts
+     * MICROBENCH_MIN_TIME, and reports that batch.
+     *
+     * @param name benchmark name
+     * @param params extra JSON members ("\"patterns\": 100, ...")
+     * @param body
+     */
+    template <typename Body>
+    void measure(const char *name, const std::string& params, Body&& body) {
+        if (strstr(name, filter) == NULL) {
+            return;
+        }
+
+        uint64_t operations = 16;
+
+        while (true) {
+            uint64_t allocated = allocations;
+            uint64_t cycles = 0;
+
+            if (cycles_fd >= 0) {
+                ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+
+            uint64_t start = now_ns();
+
+            for (uint64_t index = 0; index < operations; index++) {
+                body(index);
+            }
+
+            uint64_t elapsed = now_ns() - start;
+
+            if (cycles_fd >= 0) {
+                ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+                if (read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+                    cycles = 0;
+                }
+            }
+
+            allocated = allocations - allocated;
+
+            if (elapsed < MICROBENCH_MIN_TIME) {
+                operations = elapsed > 0 ? std::max(operations * 2, (uint64_t)(operations * MICROBENCH_MIN_TIME * 5 / 4 / elapsed))
+                                         : operations * 16;
+                continue;
+            }
+
+            fprintf(stdout, "{\"benchmark\": \"%s\"%s%s, \"operations\": %lu, \"ns_per_op\": %.2f, "
+                            "\"allocs_per_op\": %.3f, \"cycles_per_op\": ",
+                    name, params.empty() ? "" : ", ", params.c_str(), operations,
+                    (double)elapsed / operations, (double)allocated / operations);
+
+            if (cycles_fd >= 0) {
+                fprintf(stdout, "%.1f}\n", (double)cycles / operations);
+            } else {
+                fprintf(stdout, "null}\n");
+            }
+
+            fflush(stdout);
+            return;
+        }
+    }
+
+    /**
+     * Synthetic topics "s<a>/d<b>/m<c>" (16 x 64 x 256 of them).
+     */
+    std::string random_topic(std::mt19937& random) {
+        return "s" + std::to_string(random() % 16) + "/d" + std::to_string(random() % 64)
+                + "/m" + std::to_string(random() % 256);
+    }
+
+    /**
+     * Subscription pattern: 60% exact topics, 25% with one level replaced
+     * by '+', 15% ending in '*' after one or two levels.
+     */
+    std::string random_pattern(std::mt19937& random) {
+        unsigned kind = random() % 100;
+
+        if (kind < 60) {
+            return random_topic(random);
+        }
+
+        if (kind < 85) {
+            std::string levels[3] = {"s" + std::to_string(random() % 16), "d" + std::to_string(random() % 64),
+                                        "m" + std::to_string(random() % 256)};
+
+            levels[random() % 3] = "+";
+
+            return levels[0] + "/" + levels[1] + "/" + levels[2];
+        }
+
+        if (random() % 2 == 0) {
+            return "s" + std::to_string(random() % 16) + "/*";
+        }
+
+        return "s" + std::to_string(random() % 16) + "/d" + std::to_string(random() % 64) + "/*";
+    }
+
+    /**
+     * Builds a datagram of given type (STRING values have value_length bytes).
+     */
+    size_t build_datagram(struct udp_packet& packet, const char *topic, uint8_t type, size_t value_length = 16) {
+        memset(&packet, 0, sizeof(packet));
+        memcpy(packet.topic, topic, strnlen(topic, MAX_TOPIC_SIZE));
+        packet.data_type = type;
+
+        uint32_t number = htonl(1234567890);
+
+        switch (type) {
+            case 0:
+                packet.payload[0] = 1;
+                memcpy(packet.payload + 1, &number, sizeof(number));
+                return offsetof(struct udp_packet, payload) + 5;
+
+            case 1:
+                packet.payload[0] = 0x12;
+                packet.payload[1] = 0x34;
+                return offsetof(struct udp_packet, payload) + 2;
+
+            case 2:
+                memcpy(packet.payload + 1, &number, sizeof(number));
+                packet.payload[5] = 4;
+                return offsetof(struct udp_packet, payload) + 6;
+
+            default:
+                memset(packet.payload, 'x', value_length);
+                return offsetof(struct udp_packet, payload) + value_length;
+        }
+    }
+
+    void bench_matching(std::vector<struct TCP_Client>& clients) {
+        for (int patterns = 1; patterns <= max_patterns; patterns *= 10) {
+            std::mt19937 random(42);
+
+            topic_trie subscriptions;
+
+            for (int index = 0; index < patterns; index++) {
+                subscriptions.insert(random_pattern(random), &clients[index % clients.size()]);
+            }
+
+            std::vector<std::string> topics(MICROBENCH_TOPICS);
+
+            for (auto& topic: topics) {
+                topic = random_topic(random);
+            }
+
+            std::string params = "\"patterns\": " + std::to_string(patterns);
+            size_t matched = 0;
+
+            /* Trie walk only (what a fan-out cache miss starts with) */
+            measure("match", params, [&](uint64_t index) {
+                subscriptions.match(topics[index % topics.size()], [&](const std::vector<struct TCP_Client *>& subscribers) {
+                    matched += subscribers.size();
+                });
+            });
+
+            /* Cached fan-out lists (the steady state of notify_subscribers) */
+            fanout_cache fanout;
+
+            measure("fanout_hit", params, [&](uint64_t index) {
+                matched += fanout.lookup(topics[index % topics.size()], subscriptions).size();
+            });
+
+            /* Topic to ID, the first step of every lookup */
+            topic_table table;
+
+            measure("intern", params, [&](uint64_t index) {
+                matched += table.intern(topics[index % topics.size()]);
+            });
+
+            /* Every lookup misses: trie walk, deduplication, insertion and eviction */
+            fanout_cache tiny(0);
+
+            measure("fanout_miss", params, [&](uint64_t index) {
+                matched += tiny.lookup(topics[index % topics.size()], subscriptions).size();
+            });
+
+            /* Subscription churn: a new pattern added and removed again */
+            std::vector<std::string> churn(MICROBENCH_TOPICS);
+
+            for (auto& pattern: churn) {
+                pattern = random_pattern(random);
+            }
+
+            struct TCP_Client newcomer{};
+
+            measure("churn", params, [&](uint64_t index) {
+                const std::string& pattern = churn[index % churn.size()];
+
+                subscriptions.insert(pattern, &newcomer);
+                subscriptions.remove(pattern, &newcomer);
+            });
+
+            /* Same, through the server's handlers, plus the lookup that follows: a change
+             * only makes the cached lists stale, and the next lookup of a topic recomputes
+             * its own. The cache stays as fanout_hit left it */
+            for (auto& topic: topics) {
+                fanout.lookup(topic, subscriptions);
+            }
+
+            measure("churn_cached", params + ", \"cached_topics\": " + std::to_string(fanout.cached),
+                [&](uint64_t index) {
+                    const std::string& pattern = churn[index % churn.size()];
+
+                    subscribe_to_topic(&newcomer, pattern, subscriptions);
+                    unsubscribe_from_topic(&newcomer, pattern, subscriptions);
+                    matched += fanout.lookup(topics[index % topics.size()], subscriptions).size();
+                });
+
+            sink = matched;
+        }
+    }
+
+    void bench_formatting() {
+        const char *names[] = {"INT", "SHORT_REAL", "FLOAT", "STRING"};
+        char notification[MAX_NOTIFICATION_LEN];
+        char frame[MESSAGE_BUFFER_SIZE];
+        struct sockaddr_in from = {};
+
+        size_t total = 0;
+
+        for (uint8_t type = 0; type < 4; type++) {
+            for (size_t value_length: {(size_t)16, (size_t)1400}) {
+                if (type != 3 && value_length > 16) {
+                    continue;
+                }
+
+                struct udp_packet packet;
+                size_t length = build_datagram(packet, "s1/d2/m3", type, value_length);
+
+                std::string params = std::string("\"type\": \"") + names[type] + "\", \"value_bytes\": "
+                                        + std::to_string(length - offsetof(struct udp_packet, payload));
+
+                measure("format_notification", params, [&](uint64_t) {
+                    total += format_notification(notification, packet, length);
+                });
+
+                measure("encode_framed", params, [&](uint64_t) {
+                    size_t text_length = format_notification(notification, packet, length);
+
+                    total += encode_message(frame, PROTOCOL_FRAMED, FRAME_NOTIFICATION, notification, text_length);
+                });
+
+                measure("encode_raw", params, [&](uint64_t) {
+                    char payload[MAX_FRAME_PAYLOAD];
+                    size_t payload_length = encode_raw_notification(payload, packet, length, from);
+
+                    total += connection::encode_frame(frame, FRAME_RAW_NOTIFICATION, 0, payload, payload_length);
+                });
+            }
+        }
+
+        /* Payload mix: the four types in turn */
+        struct udp_packet mix[4];
+        size_t mix_lengths[4];
+
+        for (uint8_t type = 0; type < 4; type++) {
+            mix_lengths[type] = build_datagram(mix[type], "s1/d2/m3", type);
+        }
+
+        measure("format_notification", "\"type\": \"mixed\"", [&](uint64_t index) {
+            total += format_notification(notification, mix[index % 4], mix_lengths[index % 4]);
+        });
+
+        sink = total;
+    }
+
+    void bench_notify(std::vector<struct TCP_Client>& clients) {
+        struct udp_packet packet;
+        size_t length = build_datagram(packet, "s1/d2/m3", 0);
+        struct sockaddr_in from = {};
+
+        size_t delivered = 0;
+
+        for (size_t fanout: {(size_t)1, (size_t)10, (size_t)100, (size_t)1000}) {
+            for (bool mixed: {false, true}) {
+                std::vector<struct TCP_Client *> targets;
+
+                for (size_t index = 0; index < fanout; index++) {
+                    struct TCP_Client *client = &clients[index];
+
+                    client->isActive = true;
+                    client->protocol_version = mixed && index % 4 == 1 ? PROTOCOL_LEGACY : PROTOCOL_FRAMED;
+                    client->raw_notifications = mixed && index % 4 == 2;
+
+                    targets.push_back(client);
+                }
+
+                std::string params = "\"fanout\": " + std::to_string(fanout) + ", \"formats\": \""
+                                        + (mixed ? "mixed" : "framed") + "\"";
+
+                /* Encoding once per format and handing the shared buffer out; deliver is a no-op */
+                measure("notify_clients", params, [&](uint64_t) {
+                    notify_clients(packet, length, from, targets,
+                        [&](struct TCP_Client *, struct connection::message_buffer *message) {
+                            delivered += message->length;
+                        },
+                        [&](struct TCP_Client *) {
+                            return false;
+                        });
+                });
+            }
+        }
+
+        sink = delivered;
+    }
+
+    /**
+     * Retained store of topics "s<a>/d<b>/m<c>" (a, b, c below 100): storing
+     * a new value, and the values a new subscription gets.
+     */
+    void bench_retained() {
+        for (int topic_count = 1000; topic_count <= 1000000; topic_count *= 1000) {
+            retained_store retained(SIZE_MAX);
+            std::vector<std::string> topics(topic_count);
+            struct udp_packet packet;
+            struct sockaddr_in from = {};
+
+            for (int index = 0; index < topic_count; index++) {
+                topics[index] = "s" + std::to_string(index / 10000) + "/d" + std::to_string(index / 100 % 100)
+                                + "/m" + std::to_string(index % 100);
+
+                retained.store((const char *)&packet, build_datagram(packet, topics[index].c_str(), 3, 8), from);
+            }
+
+            std::string params = "\"topics\": " + std::to_string(topic_count) + ", \"retained_bytes\": "
+                                    + std::to_string(retained.bytes);
+            size_t matched = 0;
+
+            /* A topic's value replaced (datagrams are pre-built) */
+            std::vector<struct udp_packet> packets(MICROBENCH_TOPICS);
+            std::vector<size_t> lengths(MICROBENCH_TOPICS);
+
+            for (size_t index = 0; index < packets.size(); index++) {
+                lengths[index] = build_datagram(packets[index], topics[index * 7919 % topics.size()].c_str(), 3, 8);
+            }
+
+            measure("retained_store", params, [&](uint64_t index) {
+                retained.store((const char *)&packets[index % packets.size()], lengths[index % lengths.size()], from);
+            });
+
+            auto count = [&](struct retained_value *) {
+                matched++;
+            };
+
+            measure("retained_match_exact", params, [&](uint64_t index) {
+                retained.match(topics[index * 7919 % topics.size()], count);
+            });
+
+            /* One level of a hundred topics */
+            measure("retained_match_plus", params, [&](uint64_t index) {
+                retained.match("s0/d" + std::to_string(index % std::min(topic_count / 100, 100)) + "/+", count);
+            });
+
+            /* Every topic: the cost is the number of values reported */
+            measure("retained_match_all", params, [&](uint64_t) {
+                retained.match("*", count);
+            });
+
+            sink = matched;
+        }
+    }
+
+    void bench_parsing() {
+        char command[MAX_COMMAND_LEN] = "subscribe s1/d2/+ 1";
+        size_t total = 0;
+
+        measure("get_command", "", [&](uint64_t) {
+            total += strlen(connection::get_command(command));
+        });
+
+        measure("get_topic", "", [&](uint64_t) {
+            total += strlen(connection::get_topic(command));
+        });
+
+        measure("get_argument", "", [&](uint64_t) {
+            total += strlen(connection::get_argument(command));
+        });
+
+        sink = total;
+    }
+}
+
+int main(const int argc, const char *argv[]) {
+    for (int index = 1; index < argc; index++) {
+        if (strncmp(argv[index], "--filter=", strlen("--filter=")) == 0) {
+            microbench::filter = argv[index] + strlen("--filter=");
+            continue;
+        }
+
+        if (sscanf(argv[index], "--max-patterns=%d", &microbench::max_patterns) == 1) {
+            continue;
+        }
+
+        DIE(true, "Unknown option");
+    }
+
+    microbench::open_cycle_counter();
+
+    std::vector<struct TCP_Client> clients(MICROBENCH_CLIENTS);
+
+    for (size_t index = 0; index < clients.size(); index++) {
+        char ID[24];
+        int ID_length = snprintf(ID, sizeof(ID), "c%zu", index);
+
+        DIE(ID_length >= MAX_ID_LEN, "Too many clients for the client IDs");
+        memcpy(clients[index].ID, ID, ID_length + 1);
+        clients[index].socket = -1;
+    }
+
+    microbench::bench_matching(clients);
+    microbench::bench_formatting();
+    microbench::bench_notify(clients);
+    microbench::bench_parsing();
+    microbench::bench_retained();
+
+    return 0;
+}
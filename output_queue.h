@@ -0,0 +1,834 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include "helpers.h"
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define OUTPUT_QUEUE_MAX_BYTES (1 << 20)
+
+#define MESSAGE_BUFFER_SIZE 2048    // capacity of pooled buffers; longer messages get their own allocation
+#define MESSAGE_POOL_MAX 4096       // free buffers kept by each thread
+
+#define FLUSH_IOVECS 64     // iovecs written by one sendmsg() (a message takes one or two)
+
+#define MESSAGE_HEADER_MAX 24   // per-connection header placed in front of a shared message
+#define RESUME_HISTORY 1024     // notifications a sequenced session keeps for retransmission
+
+namespace connection {
+    /**
+     * Encoded message shared by every output queue it is waiting in: a
+     * notification is encoded once, and each slow subscriber only holds
+     * a reference to it.
+     *
+     * Buffers never cross threads (a message is encoded by the thread
+     * that serves its subscribers), so the count is a plain integer.
+     */
+    struct message_buffer {
+        uint32_t references;
+        uint32_t capacity;
+        size_t length;
+        size_t topic_length;    // of the datagram a notification is about (0: no topic)
+        char data[];
+    };
+
+    /**
+     * Free list of MESSAGE_BUFFER_SIZE buffers, one per thread.
+     */
+    struct message_pool {
+        std::vector<struct message_buffer *> buffers;
+
+        ~message_pool() {
+            for (struct message_buffer *buffer: buffers) {
+                free(buffer);
+            }
+        }
+    };
+
+    struct message_pool& local_message_pool() {
+        static thread_local struct message_pool pool;
+
+        return pool;
+    }
+
+    /**
+     * Gets a buffer of at least capacity bytes, holding one reference.
+     *
+     * @param capacity
+     * @return message_buffer
+     */
+    struct message_buffer *acquire_buffer(size_t capacity = MESSAGE_BUFFER_SIZE) {
+        struct message_pool& pool = local_message_pool();
+        struct message_buffer *buffer;
+
+        if (capacity <= MESSAGE_BUFFER_SIZE && !pool.buffers.empty()) {
+            buffer = pool.buffers.back();
+            pool.buffers.pop_back();
+        } else {
+            capacity = std::max(capacity, (size_t)MESSAGE_BUFFER_SIZE);
+
+            buffer = (struct message_buffer *)malloc(sizeof(struct message_buffer) + capacity);
+            DIE(buffer == NULL, "Allocation error");
+
+            buffer->capacity = capacity;
+        }
+
+        buffer->references = 1;
+        buffer->length = 0;
+        buffer->topic_length = 0;
+
+        return buffer;
+    }
+
+    /**
+     * Gets a buffer holding a copy of a message.
+     */
+    struct message_buffer *copy_buffer(const char *data, size_t len) {
+        struct message_buffer *buffer = acquire_buffer(len);
+
+        memcpy(buffer->data, data, len);
+        buffer->length = len;
+
+        return buffer;
+    }
+
+    void retain_buffer(struct message_buffer *buffer) {
+        buffer->references++;
+    }
+
+    /**
+     * Drops a reference; the last one gives the buffer back to the pool.
+     */
+    void release_buffer(struct message_buffer *buffer) {
+        if (--buffer->references > 0) {
+            return;
+        }
+
+        struct message_pool& pool = local_message_pool();
+
+        if (buffer->capacity == MESSAGE_BUFFER_SIZE && pool.buffers.size() < MESSAGE_POOL_MAX) {
+            pool.buffers.push_back(buffer);
+        } else {
+            free(buffer);
+        }
+    }
+
+    /**
+     * What to do with a message that does not fit in a full output queue.
+     */
+    enum overflow_policy {
+        DROP_NEWEST,    // discard the new message
+        DROP_OLDEST,    // discard queued messages (not yet started) to make room
+        DISCONNECT,     // close the connection of the slow consumer
+    };
+
+    /**
+     * Result of queue_message().
+     */
+    enum queue_status {
+        QUEUE_OK,           // message written or queued
+        QUEUE_DROPPED,      // message (or older ones) dropped by the policy
+        QUEUE_OVERFLOW,     // queue full and the policy asks for a disconnect
+        QUEUE_ERROR,        // connection failed
+    };
+
+    /**
+     * Message waiting in an output queue: an optional header of this
+     * connection alone (e.g. a sequence number), then a shared buffer
+     * whose first skip bytes the header replaces. A pinned message is
+     * never dropped to make room (see queue_pinned()).
+     */
+    struct queued_message {
+        struct message_buffer *buffer;
+        uint16_t skip;
+        uint8_t header_length;
+        bool pinned;
+        char header[MESSAGE_HEADER_MAX];
+        const std::string *key;     // latest-value slot the message holds (see find_latest()), or NULL
+
+        size_t length() const {
+            return header_length + buffer->length - skip;
+        }
+    };
+
+    /**
+     * Hashes the keys of the latest-value slots, looked up by string_view.
+     */
+    struct key_hasher {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view key) const noexcept {
+            return std::hash<std::string_view>{}(key);
+        }
+    };
+
+    /**
+     * Bounded queue of messages waiting for a non-blocking socket to drain.
+     * It holds a reference to each queued buffer; queued_bytes counts the
+     * bytes still to be written to this socket.
+     *
+     * Messages queued with a key (a topic) take its latest-value slot: a
+     * newer message with the same key replaces the queued one in place,
+     * as long as it has not started going out (see replace_message()).
+     */
+    struct output_queue {
+        std::deque<struct queued_message> messages;
+        size_t sent = 0;            // bytes of the front message already written
+        size_t queued_bytes = 0;
+
+        std::unordered_map<std::string, struct queued_message *, key_hasher, std::equal_to<>> latest;
+
+        /* Corked: new messages are only queued; the owner flushes them later in one go */
+        bool corked = false;
+        size_t corked_bytes = 0;    // bytes queued while corked, since the last flush
+
+        size_t max_bytes = OUTPUT_QUEUE_MAX_BYTES;
+        size_t peak_bytes = 0;
+        uint64_t dropped_messages = 0;
+        uint64_t dropped_bytes = 0;
+        uint64_t replaced_messages = 0;     // queued messages replaced by a newer one with the same key
+        size_t overwritten = 0;             // messages overwritten in place since the queue was compacted
+
+        output_queue() = default;
+        output_queue(const output_queue&) = delete;
+        output_queue& operator=(const output_queue&) = delete;
+
+        ~output_queue() {
+            clear();
+        }
+
+        bool empty() const {
+            return messages.empty();
+        }
+
+        /* Frees the queued messages; counters are kept */
+        void clear() {
+            for (struct queued_message& message: messages) {
+                release_buffer(message.buffer);
+            }
+
+            messages.clear();
+            latest.clear();
+            sent = 0;
+            queued_bytes = 0;
+            corked = false;
+            corked_bytes = 0;
+            overwritten = 0;
+        }
+    };
+
+    /**
+     * Lets go of a message leaving the queue (written out or dropped),
+     * and of the latest-value slot it holds.
+     */
+    void release_message(struct output_queue& queue, const struct queued_message& message) {
+        if (message.key != NULL) {
+            queue.latest.erase(*message.key);
+        }
+
+        release_buffer(message.buffer);
+    }
+
+    /**
+     * Points the latest-value slots at their messages again, once erasing
+     * from the middle of the deque has moved them.
+     */
+    void relink_latest(struct output_queue& queue) {
+        for (struct queued_message& message: queue.messages) {
+            if (message.key != NULL) {
+                queue.latest.find(*message.key)->second = &message;
+            }
+        }
+    }
+
+    /**
+     * Writes as much of a message as a non-blocking socket accepts.
+     *
+     * @param socket
+     * @param data
+     * @param len
+     * @return number of bytes written, or -1 if the connection failed
+     */
+    ssize_t write_some(int socket, const char *data, size_t len) {
+        size_t bytes_sent = 0;
+
+        while (bytes_sent < len) {
+            ssize_t rc = send(socket, data + bytes_sent, len - bytes_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if (rc < 0) {
+                return -1;
+            }
+
+            bytes_sent += rc;
+        }
+
+        return bytes_sent;
+    }
+
+    /**
+     * Same as above, for a header followed by the message (one sendmsg()).
+     *
+     * @return number of bytes written (header included), or -1 if the
+     *         connection failed
+     */
+    ssize_t write_some(int socket, const char *header, size_t header_length, const char *data, size_t len) {
+        size_t bytes_sent = 0;
+
+        while (bytes_sent < header_length + len) {
+            struct iovec iovecs[2];
+            struct msghdr message = {};
+
+            if (bytes_sent < header_length) {
+                iovecs[0] = {(char *)header + bytes_sent, header_length - bytes_sent};
+                iovecs[1] = {(char *)data, len};
+                message.msg_iovlen = 2;
+            } else {
+                iovecs[0] = {(char *)data + bytes_sent - header_length, header_length + len - bytes_sent};
+                message.msg_iovlen = 1;
+            }
+
+            message.msg_iov = iovecs;
+
+            ssize_t rc = sendmsg(socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if (rc < 0) {
+                return -1;
+            }
+
+            bytes_sent += rc;
+        }
+
+        return bytes_sent;
+    }
+
+    /**
+     * Describes what is left of a message (header, then buffer) once its
+     * first sent bytes are out.
+     *
+     * @param message
+     * @param sent
+     * @param iovecs room for two entries
+     * @return number of iovecs filled in
+     */
+    int message_iovecs(const struct queued_message& message, size_t sent, struct iovec *iovecs) {
+        int count = 0;
+
+        if (sent < message.header_length) {
+            iovecs[count++] = {(char *)message.header + sent, message.header_length - sent};
+            sent = 0;
+        } else {
+            sent -= message.header_length;
+        }
+
+        size_t skip = message.skip + sent;
+
+        if (skip < message.buffer->length) {
+            iovecs[count++] = {message.buffer->data + skip, message.buffer->length - skip};
+        }
+
+        return count;
+    }
+
+    /**
+     * Writes queued messages until the socket is full or the queue is empty,
+     * up to FLUSH_IOVECS iovecs with each sendmsg().
+     *
+     * @param socket
+     * @param queue
+     * @return false if the connection failed
+     */
+    bool flush_queue(int socket, struct output_queue& queue) {
+        struct iovec iovecs[FLUSH_IOVECS];
+
+        while (!queue.messages.empty()) {
+            size_t count = 0;
+            size_t total = 0;
+
+            for (size_t index = 0; index < queue.messages.size() && count + 2 <= FLUSH_IOVECS; index++) {
+                const struct queued_message& message = queue.messages[index];
+                size_t skip = index == 0 ? queue.sent : 0;
+
+                count += message_iovecs(message, skip, iovecs + count);
+                total += message.length() - skip;
+            }
+
+            struct msghdr header = {};
+
+            header.msg_iov = iovecs;
+            header.msg_iovlen = count;
+
+            ssize_t rc;
+
+            do {
+                rc = sendmsg(socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+            } while (rc < 0 && errno == EINTR);
+
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;    // Socket is full; wait for EPOLLOUT
+            }
+
+            if (rc < 0) {
+                return false;
+            }
+
+            size_t written = rc;
+            bool short_write = written < total;
+
+            queue.queued_bytes -= written;
+
+            /* Release the messages written out completely */
+            while (written > 0) {
+                struct queued_message& message = queue.messages.front();
+                size_t left = message.length() - queue.sent;
+
+                if (written < left) {
+                    queue.sent += written;
+                    break;
+                }
+
+                written -= left;
+                release_message(queue, message);
+                queue.messages.pop_front();
+                queue.sent = 0;
+            }
+
+            if (short_write) {
+                return true;    // Socket is full; wait for EPOLLOUT
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Makes room for len bytes by dropping the oldest messages that have
+     * not started going out (a partially sent message has to be finished
+     * to keep the stream in sync); pinned messages are kept.
+     *
+     * @return true if the message now fits
+     */
+    bool drop_oldest(struct output_queue& queue, size_t len) {
+        auto victim = queue.messages.begin() + (queue.sent > 0 ? 1 : 0);
+        bool erased = false;
+
+        while (queue.queued_bytes + len > queue.max_bytes && victim != queue.messages.end()) {
+            if (victim->pinned) {
+                victim++;
+                continue;
+            }
+
+            size_t victim_length = victim->length();
+
+            queue.queued_bytes -= victim_length;
+            queue.dropped_bytes += victim_length;
+            queue.dropped_messages++;
+
+            release_message(queue, *victim);
+            victim = queue.messages.erase(victim);
+            erased = true;
+        }
+
+        if (erased && !queue.latest.empty()) {
+            relink_latest(queue);
+        }
+
+        return queue.queued_bytes + len <= queue.max_bytes;
+    }
+
+    /**
+     * Sends a message on a non-blocking socket without ever waiting: it is
+     * written right away when nothing is queued, and whatever the socket
+     * does not take is queued (subject to the overflow policy).
+     *
+     * A message passed as a shared buffer is queued by reference, with
+     * the header of this connection (if any) replacing the bytes of the
+     * buffer before data; other messages are copied into a buffer of
+     * their own. A corked queue is never written to here.
+     *
+     * @param socket
+     * @param queue output queue of the connection
+     * @param data
+     * @param len
+     * @param policy
+     * @param shared buffer holding data, or NULL
+     * @param header bytes sent before data (shared messages only), or NULL
+     * @param header_length at most MESSAGE_HEADER_MAX
+     * @param key latest-value slot taken by the message if it is queued
+     *            (empty: none); a message already holding it lets it go
+     * @return queue_status
+     */
+    enum queue_status queue_message(int socket, struct output_queue& queue, const char *data, size_t len,
+                                        enum overflow_policy policy, struct message_buffer *shared = NULL,
+                                        const char *header = NULL, size_t header_length = 0,
+                                        std::string_view key = {}) {
+        enum queue_status status = QUEUE_OK;
+        size_t total = header_length + len;
+        size_t written = 0;
+
+        if (queue.messages.empty() && !queue.corked) {
+            ssize_t rc = header_length > 0 ? write_some(socket, header, header_length, data, len)
+                                           : write_some(socket, data, len);
+
+            if (rc < 0) {
+                return QUEUE_ERROR;
+            }
+
+            /* The rest of a started message is always queued */
+            written = rc;
+
+            if (written == total) {
+                return QUEUE_OK;
+            }
+        } else if (queue.queued_bytes + total > queue.max_bytes) {
+            if (policy == DISCONNECT) {
+                return QUEUE_OVERFLOW;
+            }
+
+            status = QUEUE_DROPPED;
+
+            if (policy == DROP_NEWEST || !drop_oldest(queue, total)) {
+                queue.dropped_bytes += total;
+                queue.dropped_messages++;
+
+                return QUEUE_DROPPED;
+            }
+        }
+
+        struct queued_message message = {};
+
+        if (shared != NULL) {
+            retain_buffer(shared);
+            message.buffer = shared;
+            message.skip = data - shared->data;
+            message.header_length = header_length;
+
+            if (header_length > 0) {
+                memcpy(message.header, header, header_length);
+            }
+        } else {
+            message.buffer = copy_buffer(data + written, len - written);    // Only the unwritten rest is kept
+            written = 0;
+        }
+
+        if (queue.messages.empty()) {
+            queue.sent = written;
+        }
+
+        queue.messages.push_back(message);
+        queue.queued_bytes += message.length() - written;
+
+        if (queue.corked) {
+            queue.corked_bytes += message.length();
+        }
+
+        queue.peak_bytes = std::max(queue.peak_bytes, queue.queued_bytes);
+
+        if (!key.empty()) {
+            auto iter = queue.latest.find(key);
+
+            if (iter == queue.latest.end()) {
+                iter = queue.latest.emplace(std::string(key), nullptr).first;
+            } else {
+                iter->second->key = NULL;
+            }
+
+            iter->second = &queue.messages.back();
+            iter->second->key = &iter->first;
+        }
+
+        return status;
+    }
+
+    /**
+     * Finds the queued message holding a latest-value slot. A message that
+     * has started going out cannot be replaced any more, and gives the
+     * slot up.
+     *
+     * @param queue
+     * @param key
+     * @return message, or NULL if there is none to replace
+     */
+    struct queued_message *find_latest(struct output_queue& queue, std::string_view key) {
+        auto iter = queue.latest.find(key);
+
+        if (iter == queue.latest.end()) {
+            return NULL;
+        }
+
+        struct queued_message *message = iter->second;
+
+        if (message == &queue.messages.front() && queue.sent > 0) {
+            message->key = NULL;
+            queue.latest.erase(iter);
+
+            return NULL;
+        }
+
+        return message;
+    }
+
+    /**
+     * Replaces a queued message (see find_latest()) with a newer one, which
+     * goes out in its place; same arguments as queue_message(), for a
+     * shared message.
+     */
+    void replace_message(struct output_queue& queue, struct queued_message *message, struct message_buffer *shared,
+                            const char *data, const char *header, size_t header_length) {
+        size_t old_length = message->length();
+
+        retain_buffer(shared);
+        release_buffer(message->buffer);
+
+        message->buffer = shared;
+        message->skip = data - shared->data;
+        message->header_length = header_length;
+
+        if (header_length > 0) {
+            memcpy(message->header, header, header_length);
+        }
+
+        queue.queued_bytes = queue.queued_bytes - old_length + message->length();
+
+        if (queue.corked) {
+            queue.corked_bytes = queue.corked_bytes - std::min(old_length, queue.corked_bytes) + message->length();
+        }
+
+        queue.peak_bytes = std::max(queue.peak_bytes, queue.queued_bytes);
+        queue.replaced_messages++;
+    }
+
+    /**
+     * Puts a message of its own (e.g. a notice that the queued one is gone)
+     * in place of a queued message (see find_latest()), which gives its
+     * latest-value slot up; a newer message for the slot is then queued
+     * as usual, behind the others.
+     *
+     * @param queue
+     * @param message
+     * @param data
+     * @param len
+     */
+    void overwrite_message(struct output_queue& queue, struct queued_message *message, const char *data, size_t len) {
+        size_t old_length = message->length();
+
+        release_message(queue, *message);
+
+        message->buffer = copy_buffer(data, len);
+        message->skip = 0;
+        message->header_length = 0;
+        message->key = NULL;
+
+        queue.queued_bytes = queue.queued_bytes - old_length + len;
+
+        if (queue.corked) {
+            queue.corked_bytes = queue.corked_bytes - std::min(old_length, queue.corked_bytes) + len;
+        }
+
+        queue.replaced_messages++;
+        queue.overwritten++;
+    }
+
+    /**
+     * Folds each queued message into the one before it where merge() can
+     * (e.g. adjacent notices about consecutive messages), and drops the
+     * folded ones. Nothing is folded into a message that has started
+     * going out.
+     *
+     * @param queue
+     * @param merge bool(struct queued_message& previous, const struct queued_message& next):
+     *              true if next has been folded into previous, whose length stays the same
+     */
+    template <typename Merge>
+    void compact_queue(struct output_queue& queue, Merge merge) {
+        std::deque<struct queued_message> kept;
+
+        for (struct queued_message& message: queue.messages) {
+            if (!kept.empty() && (kept.size() > 1 || queue.sent == 0) && merge(kept.back(), message)) {
+                queue.queued_bytes -= message.length();
+                queue.corked_bytes -= std::min(message.length(), queue.corked_bytes);
+
+                release_message(queue, message);
+                continue;
+            }
+
+            kept.push_back(message);
+        }
+
+        queue.messages.swap(kept);
+        queue.overwritten = 0;
+
+        relink_latest(queue);
+    }
+
+    /**
+     * Sends a message that later ones depend on (e.g. a definition they
+     * refer to): like queue_message(), it never waits, but whatever the
+     * socket does not take is queued whatever the bound, and never dropped
+     * by drop_oldest(). Callers keep such messages small and rare.
+     *
+     * @param socket
+     * @param queue
+     * @param data
+     * @param len
+     * @return QUEUE_OK, or QUEUE_ERROR if the connection failed
+     */
+    enum queue_status queue_pinned(int socket, struct output_queue& queue, const char *data, size_t len) {
+        size_t written = 0;
+
+        if (queue.messages.empty() && !queue.corked) {
+            ssize_t rc = write_some(socket, data, len);
+
+            if (rc < 0) {
+                return QUEUE_ERROR;
+            }
+
+            written = rc;
+
+            if (written == len) {
+                return QUEUE_OK;
+            }
+        }
+
+        struct queued_message message = {};
+
+        message.buffer = copy_buffer(data + written, len - written);
+        message.pinned = true;
+
+        queue.messages.push_back(message);
+        queue.queued_bytes += message.length();
+
+        if (queue.corked) {
+            queue.corked_bytes += message.length();
+        }
+
+        queue.peak_bytes = std::max(queue.peak_bytes, queue.queued_bytes);
+
+        return QUEUE_OK;
+    }
+
+    /**
+     * Sends a batch of messages with writev(); like queue_message(), it
+     * never waits. Messages the socket does not take are queued whole,
+     * whatever the bound (callers keep batches small), and nothing is
+     * written before already queued data.
+     *
+     * @param socket
+     * @param queue
+     * @param messages
+     * @param count
+     * @return QUEUE_OK, or QUEUE_ERROR if the connection failed
+     */
+    enum queue_status queue_batch(int socket, struct output_queue& queue, const struct iovec *messages, int count) {
+        size_t written = 0;
+
+        if (queue.messages.empty()) {
+            struct msghdr header = {};
+
+            header.msg_iov = (struct iovec *)messages;
+            header.msg_iovlen = count;
+
+            ssize_t rc;
+
+            do {
+                rc = sendmsg(socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+            } while (rc < 0 && errno == EINTR);
+
+            if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return QUEUE_ERROR;
+            }
+
+            written = std::max(rc, (ssize_t)0);
+        }
+
+        for (int index = 0; index < count; index++) {
+            const char *data = (const char *)messages[index].iov_base;
+            size_t len = messages[index].iov_len;
+
+            if (written >= len) {
+                written -= len;
+                continue;
+            }
+
+            queue.messages.push_back({copy_buffer(data + written, len - written), 0, 0, false, {}, NULL});
+            queue.queued_bytes += len - written;
+            written = 0;
+        }
+
+        queue.peak_bytes = std::max(queue.peak_bytes, queue.queued_bytes);
+
+        return QUEUE_OK;
+    }
+
+    /**
+     * Last messages numbered for a sequenced session, first .. next - 1,
+     * kept for retransmission when the subscriber resumes. It holds a
+     * reference to each buffer; past limit messages, the oldest goes.
+     */
+    struct message_history {
+        std::deque<struct message_buffer *> messages;
+        uint64_t first = 1;     // sequence number of messages.front()
+        uint64_t next = 1;      // sequence number of the next message
+        size_t limit = RESUME_HISTORY;
+
+        message_history() = default;
+        message_history(const message_history&) = delete;
+        message_history& operator=(const message_history&) = delete;
+
+        ~message_history() {
+            clear();
+        }
+
+        /**
+         * Numbers a message and keeps it.
+         *
+         * @return its sequence number
+         */
+        uint64_t push(struct message_buffer *message) {
+            retain_buffer(message);
+            messages.push_back(message);
+
+            while (messages.size() > limit) {
+                release_buffer(messages.front());
+                messages.pop_front();
+                first++;
+            }
+
+            return next++;
+        }
+
+        struct message_buffer *at(uint64_t sequence) const {
+            return messages[sequence - first];
+        }
+
+        /* Lets go of the kept messages; the numbering goes on */
+        void clear() {
+            for (struct message_buffer *message: messages) {
+                release_buffer(message);
+            }
+
+            messages.clear();
+            first = next;
+        }
+    };
+}
+
+#endif
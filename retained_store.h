@@ -0,0 +1,556 @@
+#ifndef RETAINED_STORE_H
+#define RETAINED_STORE_H
+
+#include "helpers.h"
+#include "topic_trie.h"
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define RETAINED_INDEX_MIN_SLOTS 64
+
+namespace subscription_protocol {
+    /**
+     * Last datagram published on a topic, kept for the subscribers to come:
+     * the topic, then the bytes following the topic field of the datagram
+     * (type and value).
+     *
+     * One copy is shared (reference counted) by the store and by the
+     * sessions it is being sent to; it is encoded in the format of a
+     * session only when sent.
+     */
+    struct retained_value {
+        std::atomic<uint32_t> references;
+        std::atomic<bool> replaced;     // a newer value of the topic has been stored since
+        uint8_t topic_length;
+        uint16_t length;                // bytes after the topic field
+        struct sockaddr_in from;
+        char data[];
+
+        std::string_view topic() const {
+            return std::string_view(data, topic_length);
+        }
+    };
+
+    /**
+     * Copies a datagram into a new retained_value (one reference, owned by
+     * the caller).
+     *
+     * @param topic
+     * @param datagram
+     * @param length datagram length
+     * @param from publisher address
+     * @return
+     */
+    struct retained_value *retain_datagram(std::string_view topic, const char *datagram, size_t length,
+                                            const struct sockaddr_in& from) {
+        size_t value_length = length > MAX_TOPIC_SIZE ? length - MAX_TOPIC_SIZE : 0;
+
+        void *memory = malloc(sizeof(struct retained_value) + topic.size() + value_length);
+        DIE(memory == NULL, "Allocation error");
+
+        struct retained_value *value = new (memory) retained_value;
+
+        value->references.store(1, std::memory_order_relaxed);
+        value->replaced.store(false, std::memory_order_relaxed);
+        value->topic_length = topic.size();
+        value->length = value_length;
+        value->from = from;
+
+        memcpy(value->data, topic.data(), topic.size());
+        memcpy(value->data + topic.size(), datagram + MAX_TOPIC_SIZE, value_length);
+
+        return value;
+    }
+
+    /**
+     * Rebuilds the datagram of a retained value.
+     *
+     * @param value
+     * @param packet output, zeroed by the caller
+     * @return datagram length
+     */
+    size_t unpack_retained(const struct retained_value *value, void *packet) {
+        memcpy(packet, value->data, value->topic_length);
+        memcpy((char *)packet + MAX_TOPIC_SIZE, value->data + value->topic_length, value->length);
+
+        return MAX_TOPIC_SIZE + value->length;
+    }
+
+    void retain(struct retained_value *value) {
+        value->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(struct retained_value *value) {
+        if (value->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            value->~retained_value();
+            free(value);
+        }
+    }
+
+    /**
+     * Memory charged to the store for a retained value.
+     */
+    size_t retained_size(const struct retained_value *value) {
+        return sizeof(struct retained_value) + value->topic_length + value->length;
+    }
+
+    /**
+     * Retained values a session still has to be sent (matches of a new
+     * subscription), in order; it holds a reference to each of them.
+     */
+    struct retained_cursor {
+        std::vector<struct retained_value *> values;
+        size_t next = 0;
+
+        retained_cursor() = default;
+        retained_cursor(const retained_cursor&) = delete;
+        retained_cursor& operator=(const retained_cursor&) = delete;
+
+        ~retained_cursor() {
+            clear();
+        }
+
+        bool empty() const {
+            return next == values.size();
+        }
+
+        /* Adds a value to send, holding a reference to it */
+        void push(struct retained_value *value) {
+            retain(value);
+            values.push_back(value);
+        }
+
+        /* Takes the next value; its reference goes to the caller */
+        struct retained_value *pop() {
+            struct retained_value *value = values[next++];
+
+            if (next == values.size()) {
+                values.clear();
+                next = 0;
+            }
+
+            return value;
+        }
+
+        void clear() {
+            for (; next < values.size(); next++) {
+                release(values[next]);
+            }
+
+            values.clear();
+            next = 0;
+        }
+    };
+
+    /**
+     * Last value of every concrete topic published, within max_bytes.
+     *
+     * The values hang off a trie of topic levels, so that a subscription
+     * pattern only walks the branches it can match: a literal level
+     * follows one edge, '+' the children of a node, and only '*' takes
+     * in whole subtrees. Nodes live in one array, linked to their parent
+     * and siblings by index; a child is found through a single
+     * open-addressed index keyed by (parent, level), which keeps the hash
+     * of each entry.
+     *
+     * Once the values and nodes take more than max_bytes, the topics
+     * updated least recently are evicted first.
+     *
+     * A store is used by one thread at a time.
+     */
+    struct retained_store {
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        struct node {
+            std::string level;
+            struct retained_value *value = NULL;
+            uint32_t parent = NONE;
+            uint32_t first_child = NONE, last_child = NONE;     // children in the order they were added
+            uint32_t next_sibling = NONE, previous_sibling = NONE;
+            uint32_t older = NONE, newer = NONE;    // update order of the nodes holding a value
+            uint32_t mark = 0;                      // last match() that reported the value
+        };
+
+        struct index_slot {
+            uint32_t node = 0;      // node + 1; 0 marks a free slot
+            uint32_t hash = 0;      // low bits of the (parent, level) hash
+        };
+
+        std::vector<struct node> nodes;     // nodes[0] is the root
+        std::vector<uint32_t> free_nodes;
+        std::vector<struct index_slot> slots;
+
+        uint32_t oldest = NONE, newest = NONE;
+        uint32_t marks = 0;
+
+        size_t max_bytes;
+        size_t count = 0;       // topics with a value
+        size_t bytes = 0;       // values and nodes
+        size_t evictions = 0;
+
+        explicit retained_store(size_t max_bytes = 0) : nodes(1), slots(RETAINED_INDEX_MIN_SLOTS),
+                                                        max_bytes(max_bytes) {}
+
+        retained_store(const retained_store&) = delete;
+        retained_store& operator=(const retained_store&) = delete;
+
+        ~retained_store() {
+            for (struct node& entry: nodes) {
+                if (entry.value != NULL) {
+                    release(entry.value);
+                }
+            }
+        }
+
+        bool enabled() const {
+            return max_bytes > 0;
+        }
+
+        /**
+         * Keeps a datagram as the value of its topic, replacing the
+         * previous one.
+         *
+         * @param datagram
+         * @param length datagram length
+         * @param from publisher address
+         */
+        void store(const char *datagram, size_t length, const struct sockaddr_in& from) {
+            std::string_view topic{datagram, strnlen(datagram, std::min(length, (size_t)MAX_TOPIC_SIZE))};
+            std::string_view levels[MAX_TOPIC_LEVELS];
+            int level_count = split_topic(topic, levels);
+
+            if (level_count < 0) {
+                return;
+            }
+
+            uint32_t id = 0;
+
+            for (int index = 0; index < level_count; index++) {
+                uint32_t next = find_child(id, levels[index]);
+
+                id = next != NONE ? next : add_child(id, levels[index]);
+            }
+
+            struct retained_value *value = retain_datagram(topic, datagram, length, from);
+            struct node& entry = nodes[id];
+
+            if (entry.value != NULL) {
+                entry.value->replaced.store(true, std::memory_order_release);
+                bytes -= retained_size(entry.value);
+                release(entry.value);
+                unlink_value(id);
+            } else {
+                count++;
+            }
+
+            entry.value = value;
+            bytes += retained_size(value);
+            link_value(id);
+
+            while (bytes > max_bytes && oldest != id) {
+                evict(oldest);
+            }
+        }
+
+        /**
+         * Calls visitor(value) for the value of every topic matching a
+         * subscription pattern, once per topic.
+         */
+        template <typename Visitor>
+        void match(std::string_view pattern, Visitor &&visitor) {
+            std::string_view levels[MAX_TOPIC_LEVELS];
+            int level_count = split_topic(pattern, levels);
+
+            if (level_count < 0 || count == 0) {
+                return;
+            }
+
+            /* Several '*' may reach a topic in more than one way; a mark per match reports it once */
+            if (++marks == 0) {
+                for (struct node& entry: nodes) {
+                    entry.mark = 0;
+                }
+
+                marks = 1;
+            }
+
+            match_level(0, levels, 0, level_count, visitor);
+        }
+
+    private:
+        static size_t hash_child(uint32_t parent, std::string_view level) {
+            return std::hash<std::string_view>{}(level) ^ (parent * 0x9E3779B97F4A7C15ULL);
+        }
+
+        /**
+         * Memory charged to the store for a node.
+         */
+        static size_t node_size(std::string_view level) {
+            return sizeof(struct node) + 2 * sizeof(struct index_slot) + level.size();
+        }
+
+        /**
+         * Finds the slot of a child, or the free slot where it belongs.
+         */
+        size_t find_slot(uint32_t parent, std::string_view level, size_t hash) const {
+            size_t mask = slots.size() - 1;
+
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                const struct index_slot& entry = slots[slot];
+
+                if (entry.node == 0) {
+                    return slot;
+                }
+
+                const struct node& child = nodes[entry.node - 1];
+
+                if (entry.hash == (uint32_t)hash && child.parent == parent && child.level == level) {
+                    return slot;
+                }
+            }
+        }
+
+        uint32_t find_child(uint32_t parent, std::string_view level) const {
+            const struct index_slot& entry = slots[find_slot(parent, level, hash_child(parent, level))];
+
+            return entry.node != 0 ? entry.node - 1 : NONE;
+        }
+
+        uint32_t add_child(uint32_t parent, std::string_view level) {
+            if ((nodes.size() - free_nodes.size() + 1) * 2 > slots.size()) {
+                rebuild(slots.size() * 2);
+            }
+
+            uint32_t id;
+
+            if (!free_nodes.empty()) {
+                id = free_nodes.back();
+                free_nodes.pop_back();
+            } else {
+                id = nodes.size();
+                nodes.emplace_back();
+            }
+
+            struct node& child = nodes[id];
+            struct node& owner = nodes[parent];
+
+            child.level.assign(level);
+            child.parent = parent;
+            child.next_sibling = NONE;
+            child.previous_sibling = owner.last_child;
+            child.mark = 0;
+
+            if (owner.last_child != NONE) {
+                nodes[owner.last_child].next_sibling = id;
+            } else {
+                owner.first_child = id;
+            }
+
+            owner.last_child = id;
+
+            size_t hash = hash_child(parent, level);
+
+            slots[find_slot(parent, level, hash)] = {id + 1, (uint32_t)hash};
+            bytes += node_size(level);
+
+            return id;
+        }
+
+        /**
+         * Takes a node without value nor children out of the trie.
+         */
+        void remove_node(uint32_t id) {
+            struct node& entry = nodes[id];
+
+            erase_slot(find_slot(entry.parent, entry.level, hash_child(entry.parent, entry.level)));
+
+            if (entry.previous_sibling != NONE) {
+                nodes[entry.previous_sibling].next_sibling = entry.next_sibling;
+            } else {
+                nodes[entry.parent].first_child = entry.next_sibling;
+            }
+
+            if (entry.next_sibling != NONE) {
+                nodes[entry.next_sibling].previous_sibling = entry.previous_sibling;
+            } else {
+                nodes[entry.parent].last_child = entry.previous_sibling;
+            }
+
+            bytes -= node_size(entry.level);
+
+            std::string().swap(entry.level);
+            entry.parent = NONE;
+            free_nodes.push_back(id);
+        }
+
+        /**
+         * Frees an index slot, moving the entries probed past it back
+         * (backward shift), so that lookups never need tombstones.
+         */
+        void erase_slot(size_t hole) {
+            size_t mask = slots.size() - 1;
+
+            for (size_t slot = (hole + 1) & mask; slots[slot].node != 0; slot = (slot + 1) & mask) {
+                size_t home = slots[slot].hash & mask;
+
+                /* An entry whose home lies after the hole (cyclically) has to stay */
+                if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                    slots[hole] = slots[slot];
+                    hole = slot;
+                }
+            }
+
+            slots[hole] = {};
+        }
+
+        /**
+         * Rebuilds the index with given number of slots (a power of two).
+         */
+        void rebuild(size_t slot_count) {
+            slots.assign(slot_count, {});
+
+            size_t mask = slot_count - 1;
+
+            for (uint32_t id = 1; id < nodes.size(); id++) {
+                const struct node& entry = nodes[id];
+
+                if (entry.parent == NONE) {
+                    continue;
+                }
+
+                size_t hash = hash_child(entry.parent, entry.level);
+                size_t slot = hash & mask;
+
+                while (slots[slot].node != 0) {
+                    slot = (slot + 1) & mask;
+                }
+
+                slots[slot] = {id + 1, (uint32_t)hash};
+            }
+        }
+
+        void link_value(uint32_t id) {
+            nodes[id].older = newest;
+            nodes[id].newer = NONE;
+
+            if (newest != NONE) {
+                nodes[newest].newer = id;
+            } else {
+                oldest = id;
+            }
+
+            newest = id;
+        }
+
+        void unlink_value(uint32_t id) {
+            struct node& entry = nodes[id];
+
+            if (entry.older != NONE) {
+                nodes[entry.older].newer = entry.newer;
+            } else {
+                oldest = entry.newer;
+            }
+
+            if (entry.newer != NONE) {
+                nodes[entry.newer].older = entry.older;
+            } else {
+                newest = entry.older;
+            }
+        }
+
+        /**
+         * Drops the value of a topic, and the nodes left empty above it.
+         */
+        void evict(uint32_t id) {
+            struct node& entry = nodes[id];
+
+            bytes -= retained_size(entry.value);
+            release(entry.value);
+            entry.value = NULL;
+            unlink_value(id);
+
+            count--;
+            evictions++;
+
+            while (id != 0 && nodes[id].value == NULL && nodes[id].first_child == NONE) {
+                uint32_t parent = nodes[id].parent;
+
+                remove_node(id);
+                id = parent;
+            }
+        }
+
+        template <typename Visitor>
+        void report(uint32_t id, Visitor &visitor) {
+            struct node& entry = nodes[id];
+
+            if (entry.value != NULL && entry.mark != marks) {
+                entry.mark = marks;
+                visitor(entry.value);
+            }
+        }
+
+        template <typename Visitor>
+        void report_subtree(uint32_t id, Visitor &visitor) {
+            report(id, visitor);
+
+            for (uint32_t child = nodes[id].first_child; child != NONE; child = nodes[child].next_sibling) {
+                report_subtree(child, visitor);
+            }
+        }
+
+        template <typename Visitor>
+        void match_level(uint32_t id, const std::string_view *levels, int index, int count, Visitor &visitor) {
+            if (index == count) {
+                report(id, visitor);
+                return;
+            }
+
+            if (levels[index] == "+") {
+                for (uint32_t child = nodes[id].first_child; child != NONE; child = nodes[child].next_sibling) {
+                    match_level(child, levels, index + 1, count, visitor);
+                }
+
+                return;
+            }
+
+            if (levels[index] == "*") {
+                // '*' swallows at least one level; at the end of the pattern, every value below matches
+                for (uint32_t child = nodes[id].first_child; child != NONE; child = nodes[child].next_sibling) {
+                    if (index + 1 == count) {
+                        report_subtree(child, visitor);
+                    } else {
+                        match_star(child, levels, index + 1, count, visitor);
+                    }
+                }
+
+                return;
+            }
+
+            uint32_t child = find_child(id, levels[index]);
+
+            if (child != NONE) {
+                match_level(child, levels, index + 1, count, visitor);
+            }
+        }
+
+        /**
+         * Matches the rest of a pattern after a '*' that has swallowed the
+         * levels down to id, or more.
+         */
+        template <typename Visitor>
+        void match_star(uint32_t id, const std::string_view *levels, int index, int count, Visitor &visitor) {
+            match_level(id, levels, index, count, visitor);
+
+            for (uint32_t child = nodes[id].first_child; child != NONE; child = nodes[child].next_sibling) {
+                match_star(child, levels, index, count, visitor);
+            }
+        }
+    };
+}
+
+#endif
@@ -2,7 +2,22 @@
 #define SERVER_BACKEND_H
 
 #include "helpers.h"
+#include "server_config.h"
+#include "server_stats.h"
+#include "metrics_endpoint.h"
+#include "session_registry.h"
 #include "subscription_protocol.h"
+#include "uring_backend.h"
+
+#include <csignal>
+
+#define URING_UDP_GROUP 1
+#define URING_UDP_BUFFERS 256
+#define URING_UDP_BUFFER_SIZE 2048
+#define URING_STAGING_SIZE (64 << 10)     // the shared message plus a header per connection
+
+/* Client sockets are non-blocking: EPOLLOUT drains their output queues */
+#define CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
 
 using namespace subscription_protocol;
 
@@ -12,9 +27,10 @@ namespace server {
 	 *
 	 * @param domain
 	 * @param type
+	 * @param reuse_port let other sockets bind to the port as well (threaded ingest)
 	 * @return
 	 */
-	int open_passive_socket(int domain, int type, uint16_t PORT) {
+	int open_passive_socket(int domain, int type, uint16_t PORT, bool reuse_port = false) {
 		/* Create passive listening socket */
 		const int listen_fd = socket(domain, type, 0);
 		DIE(listen_fd < 0, "Passive socket error");
@@ -24,6 +40,10 @@ namespace server {
 		if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
 			perror("setsockopt(SO_REUSEADDR) failed");
 
+		/* Let the ingest threads bind their own UDP sockets to the port */
+		if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+			perror("setsockopt(SO_REUSEPORT) failed");
+
 		/* Bind socket to given port */
 		struct sockaddr_in server_addr = {};
 		memset(&server_addr, 0, sizeof(server_addr));
@@ -38,275 +58,2006 @@ namespace server {
 	}
 
 	/**
-	 * Accepts a new TCP client connection and adds the resulting socket to poll array.
-	 *
-	 * @param poll_fds
-	 * @param num_sockets
+	 * Control data of a received datagram (SO_RXQ_OVFL drop counter).
 	 */
-	void handle_tcp_connection(std::vector<struct pollfd>& poll_fds, int &num_sockets,
-			std::unordered_map<int, struct TCP_Client *>& tcp_clients) {
-		struct sockaddr_in client_addr = {};
-		socklen_t cli_len = sizeof(client_addr);
+	struct udp_control {
+		alignas(struct cmsghdr) char data[CMSG_SPACE(sizeof(uint32_t))];
+	};
 
-		const int connection_socket =
-				accept(poll_fds[1].fd, (struct sockaddr *)&client_addr, &cli_len);
-		DIE(connection_socket < 0, "Connection error");
+	/**
+	 * Preallocated recvmmsg() slots.
+	 */
+	struct udp_batch {
+		std::vector<struct udp_packet> slots;
+		std::vector<struct sockaddr_in> sources;
+		std::vector<struct udp_control> controls;
+		std::vector<struct iovec> iovecs;
+		std::vector<struct mmsghdr> messages;
+	};
 
-		/* Check if client has not logged in already
-		 * (client will send a confirmation ID for us to check) */
-		subscription_packet packet{};
+	struct shared_state;
 
-		size_t bytes_received = connection::receive_full_message(connection_socket, (void *)&packet, sizeof(packet));
-		DIE(bytes_received < 0, "Login confirmation for TCP client failed");
+	/**
+	 * State shared by the server's handlers.
+	 */
+	struct server_context {
+		struct server_config config;
+
+		int epoll_fd;
+		int stdin_fd = 0;
+		int tcp_listen_fd;
+		int udp_socket;
+
+		/* Trie of subscription patterns (topic levels -> subscribed TCP clients) */
+		topic_trie subscriptions;
+
+		/* Cache of per-topic fan-out lists */
+		fanout_cache fanout;
+
+		/* Logged-in sessions, by client ID and by socket */
+		session_registry sessions;
+
+		/* Allocator of TCP_Client structures (shared by the threads in threaded mode) */
+		struct session_pool *pool = NULL;
+
+		/* Batched UDP ingest */
+		struct udp_batch udp;
+		bool udp_pending = false;       // last batch was full; datagrams may be left on the socket
+
+		uint64_t udp_received = 0;
+		uint64_t udp_batches = 0;
+		uint32_t udp_drops = 0;         // datagrams dropped by the kernel (SO_RXQ_OVFL)
+
+		/* io_uring backend (--io=uring): multishot UDP receive + batched sends */
+		bool uring_enabled = false;
+		uring::ring udp_ring;
+		uring::buffer_ring udp_buffers;
+		struct msghdr udp_header = {};
+		uring::send_batch sends;
+
+		/* Threaded mode (server_threads.h): sessions and subscriptions shared by the threads */
+		struct shared_state *shared = NULL;
+
+		/* Last value of every topic (--retained-bytes), sent to new subscriptions; in threaded
+		 * mode, the store of shared_state is used instead */
+		retained_store retained;
+
+		/* Disk log of datagrams (--log-dir); offline SF sessions replay it */
+		message_log::segmented_log *log = NULL;
+		bool sessions_dirty = false;    // SF state of the sessions changed since it was handed to the log
+		int64_t sessions_saved = 0;     // when it was last handed over (milliseconds)
+
+		/* Write coalescing (--coalesce-bytes): clients whose output queue is corked in this pass */
+		std::vector<struct TCP_Client *> corked;
+		uint64_t corked_since = 0;      // monotonic microseconds when the first of them was corked
+		uint64_t coalesced = 0;         // notifications held back for coalescing
+		uint64_t coalesce_flushes = 0;  // flushes of corked queues
+
+		/* Hot path instrumentation of this thread, and the stats command / dump (--stats-file) */
+		server_stats::thread_stats stats;
+		server_stats::reporter *reporter = NULL;
+
+		/* Prometheus endpoint (--metrics-port) and the scrapes being served */
+		int metrics_fd = -1;
+		std::vector<metrics::scrape *> scrapes;
+	};
+
+	/* Threaded mode hooks, defined in server_threads.h */
+	struct TCP_Client *hand_off_login(struct server_context& ctx, struct TCP_Client *connection,
+										subscription_packet& packet);
+	void release_session(struct shared_state& shared, struct TCP_Client *client);
+	void update_subscription(struct shared_state& shared, struct TCP_Client *client, std::string& topic,
+								bool subscribe);
+	void append_shared_metrics(struct server_context& ctx, struct metrics::scrape& s);
+	void collect_shared_retained(struct shared_state& shared, std::string_view pattern, struct retained_cursor& cursor);
+
+	/* Forwarding of stored and retained messages, defined below */
+	bool forward_backlog(struct server_context& ctx, struct TCP_Client *client);
 
-		char *client_ID = (char *) calloc(MAX_ID_LEN, sizeof(char));
-		
-		strncpy(client_ID, packet.message, packet.length);
+	/**
+	 * Adds descriptor to the epoll interest list; data is handed back by
+	 * epoll_wait() (a TCP_Client for connections, a context member otherwise).
+	 *
+	 * @param ctx
+	 * @param fd
+	 * @param events
+	 * @param data
+	 */
+	void watch_descriptor(struct server_context& ctx, int fd, uint32_t events, void *data) {
+		struct epoll_event event = {};
 
-		int clientSocket = isRegistered(client_ID, tcp_clients);
+		event.events = events;
+		event.data.ptr = data;
 
-		if (clientSocket != -1) {
-			struct TCP_Client *client = tcp_clients[clientSocket];
+		int rc = epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		DIE(rc < 0, "epoll_ctl(ADD) failed");
+	}
 
-			if (client->isActive) {
-				/* Close connection */
-				fprintf(stdout, "Client %s already connected.\n", packet.message);
+	/**
+	 * Applies the per-client limits of the configuration (output queue,
+	 * store-and-forward backlog, resume history) to a new session.
+	 *
+	 * @param ctx
+	 * @param client
+	 */
+	void set_client_limits(struct server_context& ctx, struct TCP_Client *client) {
+		client->output.max_bytes = ctx.config.queue_limit;
+		client->backlog.max_messages = ctx.config.sf_max_messages;
+		client->backlog.max_bytes = ctx.config.sf_max_bytes;
+		client->history.limit = ctx.config.resume_history;
+	}
 
-				sprintf(packet.message, "Quit");
-				connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));    // Send close notification
+	/**
+	 * Accepts all pending TCP connections; clients stay in the epoll set
+	 * as not logged in until their login packet has been read.
+	 *
+	 * @param ctx
+	 */
+	void handle_tcp_connection(struct server_context& ctx) {
+		while (true) {
+			struct sockaddr_in client_addr = {};
+			socklen_t cli_len = sizeof(client_addr);
 
-				close(connection_socket);   // Close socket
+			const int connection_socket = accept4(ctx.tcp_listen_fd, (struct sockaddr *)&client_addr,
+													&cli_len, SOCK_NONBLOCK);
 
+			if (connection_socket < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 				return;
 			}
 
-			// Client has come back; reset socket
-			client->isActive = true;
-			client->socket = connection_socket;
+			DIE(connection_socket < 0, "Connection error");
 
-			// Update socket fd in tcp_clients
-			auto entry = tcp_clients.extract(clientSocket);
-			entry.key() = connection_socket;
-			
-			tcp_clients.insert(std::move(entry));
+			const int enable = 1;
+			if (setsockopt(connection_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0)
+				perror("setsockopt(TCP_NODELAY) failed");
 
-			/* Add connection socket to poll descriptor array */
-			poll_fds.push_back({connection_socket, POLLIN, 0});
-			
-			num_sockets++;
+			struct TCP_Client *new_client = ctx.pool->allocate();
 
-			sprintf(packet.message, "Success");
-			connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));
+			new_client->socket = connection_socket;
+			new_client->protocol_version = PROTOCOL_LEGACY;
+			sprintf(new_client->ip_addr, "%s", inet_ntoa(client_addr.sin_addr));
+			new_client->port = client_addr.sin_port;
 
-			fprintf(stdout, "New client %s connected from %s:%hu.\n",
-				client->ID, client->ip_addr, ntohs(client->port));
+			set_client_limits(ctx, new_client);
+
+			watch_descriptor(ctx, connection_socket, CLIENT_EVENTS, new_client);
+		}
+	}
+
+	/**
+	 * Closes the connection of given client; logged-in clients are kept
+	 * (inactive) so that they can come back.
+	 *
+	 * @param ctx
+	 * @param client
+	 */
+	void disconnect_client(struct server_context& ctx, struct TCP_Client *client) {
+		if (client->logged_in && !client->isActive) {   // Already disconnected
+			return;
+		}
+
+		// Closing the socket also removes it from the epoll set
+		close(client->socket);
 
+		if (!client->logged_in) {
+			ctx.pool->release(client);
 			return;
 		}
 
-		/* If client connection is new, notify client about success
-		 * and create a new TCP_Client instance and add it to our vector*/
-		struct TCP_Client *new_client = (struct TCP_Client *) malloc(sizeof(struct TCP_Client));
-		DIE(new_client == NULL, "Allocation error");
+		fprintf(stdout, "Client %s disconnected.\n", client->ID);
 
-		sprintf(new_client->ID, "%s", client_ID);
-		new_client->socket = connection_socket;
-		new_client->isActive = true;
-		sprintf(new_client->ip_addr, "%s", inet_ntoa(client_addr.sin_addr));
-		new_client->port = client_addr.sin_port;
+		// The descriptor may be reused by the next connection
+		ctx.sessions.unbind(client);
 
-		/* Add connection socket to poll descriptor array */
-		poll_fds.push_back({connection_socket, POLLIN, 0});
+		/* Queued messages reference this thread's buffers; let go of them
+		 * before another worker can pick up the session */
+		if (client->output.corked) {
+			std::erase(ctx.corked, client);
+		}
 
-		tcp_clients.insert({poll_fds[num_sockets].fd, new_client});
+		client->input.clear();
+		client->output.clear();
+		client->retained.clear();
 
-		num_sockets++;
+		// Turn client inactive
+		if (ctx.shared != NULL) {
+			release_session(*ctx.shared, client);
+		} else {
+			client->isActive = false;
+		}
+	}
 
-		sprintf(packet.message, "Success");
-		connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));
+	/**
+	 * Drops the connection of a client whose message could not be sent or
+	 * queued.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param status result of queueing the message
+	 * @return false if the client has been disconnected
+	 */
+	bool check_delivery(struct server_context& ctx, struct TCP_Client *client, enum connection::queue_status status) {
+		switch (status) {
+		case connection::QUEUE_OVERFLOW:
+			fprintf(stderr, "Client %s is too slow, dropping connection\n", client->ID);
+			disconnect_client(ctx, client);
+			return false;
+
+		case connection::QUEUE_ERROR:
+			disconnect_client(ctx, client);
+			return false;
+
+		default:
+			return true;
+		}
+	}
 
-		fprintf(stdout, "New client %s connected from %s:%hu.\n",
-				new_client->ID, new_client->ip_addr, ntohs(new_client->port));
+	/**
+	 * Sends a message to a client without blocking the server: what the
+	 * socket does not take is kept in the client's output queue, and a
+	 * full queue is handled according to the configured overflow policy.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param data
+	 * @param length
+	 */
+	void deliver(struct server_context& ctx, struct TCP_Client *client, const char *data, size_t length) {
+		check_delivery(ctx, client,
+			connection::queue_message(client->socket, client->output, data, length, ctx.config.overflow));
 	}
 
 	/**
-	 * Process UDP client message.
-	*/
-    void process_udp_message(std::vector<struct pollfd>& poll_fds,
-								std::unordered_map<std::string, std::vector<struct TCP_Client *>>& subscriptions) {
-        /* Get UDP packet */
-        struct udp_packet packet;
-		struct sockaddr_in from;
-		socklen_t addrlen = sizeof(struct sockaddr);
+	 * Writes out what the socket of a client takes from its output queue
+	 * (timed as the flush stage).
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the connection failed
+	 */
+	bool flush_output(struct server_context& ctx, struct TCP_Client *client) {
+		uint64_t start = server_stats::ticks();
+		bool sent = connection::flush_queue(client->socket, client->output);
 
-        connection::receive_full_message(poll_fds[2].fd,
-			(void *)&packet, sizeof(packet), true, (struct sockaddr *)&from, &addrlen);
+		ctx.stats.stages[server_stats::STAGE_FLUSH].record(server_stats::ticks() - start);
 
-		char *ip_udp_client = inet_ntoa(from.sin_addr);
-		uint16_t port_udp_client = ntohs(from.sin_port);
+		return sent;
+	}
 
-		char notification[MAX_NOTIFICATION_LEN];
+	/**
+	 * Microseconds on the monotonic clock.
+	 */
+	uint64_t monotonic_us() {
+		struct timespec now;
 
-		sprintf(notification, "%s", format_notification(ip_udp_client, port_udp_client, packet));
+		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		notify_subscribers(std::string{packet.topic}, notification, subscriptions);
-    }
+		return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	}
 
 	/**
-	 * Reads user input command and handles request.
+	 * Writes out what a corked client has queued (the queue stays corked
+	 * until the end of the pass).
 	 *
-	 * @param poll_fds
-	 * @param num_sockets
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
 	 */
-	int handle_stdin_command(std::vector<struct pollfd>& poll_fds, int &num_sockets) {
-		subscription_packet packet{};
+	bool flush_corked_client(struct server_context& ctx, struct TCP_Client *client) {
+		client->output.corked_bytes = 0;
+		ctx.coalesce_flushes++;
 
-		connection::receive_full_message(0, (void *)&packet, sizeof(packet));
+		if (!flush_output(ctx, client)) {
+			disconnect_client(ctx, client);
+			return false;
+		}
 
-		if (strcmp(connection::get_command(packet.message), "exit") == 0) {
-			close(poll_fds[1].fd); // close TCP listening socket
-			close(poll_fds[2].fd); // close UDP socket
+		return true;
+	}
 
-			/* Close TCP clients */
-			for (int index = 3; index < poll_fds.size(); index++) {
-				sprintf(packet.message, "Quit");
-				connection::send_full_message(poll_fds[index].fd, (void *)&packet, sizeof(packet));    // Send close notification
+	/**
+	 * Flushes and uncorks every corked client. Called at the end of each
+	 * pass of the event loop, and sooner once the first of them has been
+	 * held for coalesce_delay microseconds.
+	 *
+	 * @param ctx
+	 */
+	void flush_corked(struct server_context& ctx) {
+		std::vector<struct TCP_Client *> clients;
 
-				close(poll_fds[index].fd);   // Close socket
-			}
+		clients.swap(ctx.corked);
 
-			num_sockets = 0;
+		for (struct TCP_Client *client: clients) {
+			if (flush_corked_client(ctx, client)) {
+				client->output.corked = false;
 
-			exit(0);
+				/* A drained queue raises no EPOLLOUT; retained values held behind it go on here */
+				if (client->output.empty() && !client->retained.empty()) {
+					forward_backlog(ctx, client);
+				}
+			}
 		}
 
-		fprintf(stderr, "Unlisted command\n");
-		return 0;
+		/* Keep the allocation for the next pass */
+		clients.clear();
+		ctx.corked.swap(clients);
 	}
 
 	/**
-	 * Process TCP client requests regarding subscriptions (and not only).
-	*/
-    void process_client_request(std::vector<struct pollfd>& poll_fds, int index, int& num_sockets,
-									std::unordered_map<std::string, std::vector<struct TCP_Client *>>& subscriptions,
-										std::unordered_map<int, struct TCP_Client *>& tcp_clients) {
-        /* Get client request */
-		int socket = poll_fds[index].fd;
-        subscription_packet packet{};
+	 * Flushes the corked clients if the first of them has waited too long.
+	 *
+	 * @param ctx
+	 */
+	void check_coalesce_delay(struct server_context& ctx) {
+		if (!ctx.corked.empty() && monotonic_us() - ctx.corked_since >= (uint64_t)ctx.config.coalesce_delay) {
+			flush_corked(ctx);
+		}
+	}
 
-        connection::receive_full_message(socket, (void *)&packet, sizeof(packet));
+	/**
+	 * Sends a shared (pooled) message to a client; if it has to wait, the
+	 * client's output queue keeps a reference to it instead of a copy.
+	 *
+	 * With coalescing, a client with nothing pending is corked instead: its
+	 * notifications of the current pass are gathered in the queue and go
+	 * out together (see flush_corked()), or as soon as coalesce_bytes of
+	 * them are waiting.
+	 *
+	 * Sequenced sessions get the next number of the session with each
+	 * notification, which is also kept for a later resume; offline (or
+	 * still resuming) ones only keep it. Aliasing connections get the
+	 * alias of the topic instead of the topic (see queue_notification()).
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param message
+	 */
+	void deliver(struct server_context& ctx, struct TCP_Client *client, struct connection::message_buffer *message) {
+		uint64_t sequence = 0;
 
-		/* Check if client logged out */
-		if (strcmp(packet.message, "Quit") == 0) {
-			fprintf(stdout, "Client %s disconnected.\n", tcp_clients[socket]->ID);
+		if (client->sequenced) {
+			sequence = client->history.push(message);
 
-			// Turn client inactive
-			struct TCP_Client *client = tcp_clients[socket];
-			client->isActive = false;
+			/* Kept until the subscriber is back and caught up (resume_history()) */
+			if (!client->isActive || client->resume_next != 0) {
+				return;
+			}
+		}
 
-			// Close socket and remove descriptor from poll vector
-			close(socket);
-			poll_fds.erase(poll_fds.begin() + index);
+		if (ctx.config.coalesce_bytes > 0 && !client->output.corked && client->output.empty()) {
+			if (ctx.corked.empty()) {
+				ctx.corked_since = monotonic_us();
+			}
+
+			client->output.corked = true;
+			ctx.corked.push_back(client);
+		}
+
+		if (client->output.corked) {
+			ctx.coalesced++;
+		}
+
+		ctx.stats.notifications_out.add(1);
+		ctx.stats.bytes_out.add(message->length);
 
-			num_sockets--;
+		uint64_t dropped = client->output.dropped_messages;
+		enum connection::queue_status status = queue_notification(client, message, sequence, ctx.config.overflow);
+
+		if (status == connection::QUEUE_DROPPED) {
+			ctx.stats.drops.add(client->output.dropped_messages - dropped);
+		}
 
+		if (!check_delivery(ctx, client, status)) {
 			return;
 		}
 
-        if (strcmp(connection::get_command(packet.message), "subscribe") == 0) {
-            char *topic = connection::get_topic(packet.message);
+		if (client->output.corked && client->output.corked_bytes >= ctx.config.coalesce_bytes) {
+			flush_corked_client(ctx, client);
+		}
+	}
 
-			std::string topic_string(topic);
+	/**
+	 * Sends a control message (ACK, Quit) in the client's protocol version.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param type frame type
+	 */
+	void deliver_message(struct server_context& ctx, struct TCP_Client *client, uint8_t type) {
+		char buffer[sizeof(subscription_packet)];
 
-			/* Get client with specified socket */
-			struct TCP_Client *client = tcp_clients[socket];
+		deliver(ctx, client, buffer, encode_message(buffer, client->protocol_version, type, "", 0));
+	}
 
-			/* Subscribe to matching topics */
-			subscribe_to_topic(client, topic_string, subscriptions);
+	/**
+	 * Hands the store-and-forward state of the sessions (SF patterns and
+	 * pending replay position) to the log, whose flusher writes it next to
+	 * the segments, so that it survives a restart. Changes only mark the
+	 * state dirty; the event loop hands it over at most once per group
+	 * commit interval, so ingest never waits for the disk.
+	 *
+	 * @param ctx
+	 */
+	void save_log_sessions(struct server_context& ctx) {
+		std::string contents;
+		char line[MAX_ID_LEN + 32];
 
-			/* Send confirmation to client */
-			sprintf(packet.message, "Success");
-			connection::send_full_message(socket, (void *)&packet, sizeof(packet));
+		for (auto& entry: ctx.sessions.by_id) {
+			struct TCP_Client *client = entry.second;
 
-			return;
-        }
+			if (client->store_forward.empty() && !client->replay_pending) {
+				continue;
+			}
 
-        if (strcmp(connection::get_command(packet.message), "unsubscribe") == 0) {
-			char *topic = connection::get_topic(packet.message);
+			snprintf(line, sizeof(line), "%s %d %lu", client->ID, client->replay_pending, client->replay_from);
+			contents += line;
 
-			std::string topic_string(topic);
+			for (auto& pattern: client->store_forward) {
+				contents += ' ';
+				contents += pattern;
+			}
 
-			/* Get client with specified socket */
-			struct TCP_Client *client = tcp_clients[socket];
+			contents += '\n';
+		}
 
-			/* Unsubscribe from matching topics */
-			unsubscribe_from_topic(client, topic_string, subscriptions);
+		message_log::save_sessions(*ctx.log, std::move(contents));
 
-			/* Send confirmation to client */
-			sprintf(packet.message, "Success");
-			connection::send_full_message(socket, (void *)&packet, sizeof(packet));
+		ctx.sessions_dirty = false;
+		ctx.sessions_saved = message_log::current_time();
+	}
+
+	/**
+	 * Recreates the sessions saved by save_log_sessions() as disconnected
+	 * clients.
+	 *
+	 * @param ctx
+	 */
+	void restore_log_sessions(struct server_context& ctx) {
+		FILE *file = fopen((ctx.log->directory + "/sessions").c_str(), "r");
 
+		if (file == NULL) {
 			return;
-        }
-    }
+		}
+
+		char line[MAX_COMMAND_LEN * 16];
+
+		while (fgets(line, sizeof(line), file) != NULL) {
+			char *ID = strtok(line, " \n");
+			char *pending = strtok(NULL, " \n");
+			char *from = strtok(NULL, " \n");
+
+			if (ID == NULL || pending == NULL || from == NULL) {
+				continue;
+			}
+
+			struct TCP_Client *client = ctx.pool->allocate();
+
+			snprintf(client->ID, MAX_ID_LEN, "%s", ID);
+			client->socket = -1;
+			client->logged_in = true;
+			client->replay_pending = atoi(pending) != 0;
+			client->replay_from = strtoull(from, NULL, 10);
+
+			set_client_limits(ctx, client);
+
+			for (char *pattern = strtok(NULL, " \n"); pattern != NULL; pattern = strtok(NULL, " \n")) {
+				std::string topic(pattern);
+
+				subscribe_to_topic(client, topic, ctx.subscriptions);
+				set_store_forward(client, topic, true);
+			}
+
+			ctx.sessions.add(client);
+		}
+
+		fclose(file);
+	}
 
 	/**
-	 * Run server to handle multiple client connections simultaneously
-	 * using the poll() multiplexing mechanism
+	 * Notes that a store-and-forward subscriber has missed a logged
+	 * datagram: it replays the log from there once it can.
 	 *
-	 * @param tcp_listen_fd socket listening for tcp connections
+	 * @param ctx
+	 * @param client
+	 * @param packet
+	 * @param sequence log record of the datagram
+	 * @return true if the client will get the datagram from the log
 	 */
-	void run_server(int tcp_listen_fd, int udp_socket) {
-		/* Create vector of poll descriptors */
-		std::vector<struct pollfd> poll_fds;
-		int num_sockets = 3;
+	bool defer_to_log(struct server_context& ctx, struct TCP_Client *client, const struct udp_packet& packet,
+						uint64_t sequence) {
+		std::string_view topic{packet.topic, strnlen(packet.topic, MAX_TOPIC_SIZE)};
 
-		int rc = listen(tcp_listen_fd, MAX_POLL_FDS);
-		DIE(rc < 0, "Listening error");
+		if (!client->logged_in || !wants_store_forward(client, topic)) {
+			return false;
+		}
 
-		/* Add stdin descriptor */
-		poll_fds.push_back({0, POLLIN, 0});
+		if (!client->replay_pending) {
+			client->replay_pending = true;
+			client->replay_from = sequence;
 
-		/* Add TCP listening socket */
-		poll_fds.push_back({tcp_listen_fd, POLLIN, 0});
+			ctx.sessions_dirty = true;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Sends a batch of forwarded notifications with one writev(); those of
+	 * a sequenced session are numbered and kept like live ones instead, and
+	 * those of an aliasing connection go out one by one with their aliases.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param messages
+	 * @param topic_lengths of the datagrams the messages are about
+	 * @param count
+	 * @return false if the client has been disconnected
+	 */
+	bool forward_batch(struct server_context& ctx, struct TCP_Client *client, const struct iovec *messages,
+						const size_t *topic_lengths, int count) {
+		if (!client->sequenced && !client->aliases.enabled()) {
+			if (connection::queue_batch(client->socket, client->output, messages, count) == connection::QUEUE_ERROR) {
+				disconnect_client(ctx, client);
+				return false;
+			}
 
-		/* Add UDP socket */
-		poll_fds.push_back({udp_socket, POLLIN, 0});
+			return true;
+		}
 
-		/* Create mapping between topics and subscribed TCP clients */
-		std::unordered_map<std::string, std::vector<struct TCP_Client *>> subscriptions;
+		for (int index = 0; index < count; index++) {
+			if (messages[index].iov_len == 0) {     // Malformed datagram
+				continue;
+			}
 
-		/* Create Socket <-> TCP_Client map */
-		std::unordered_map<int, struct TCP_Client *> tcp_clients;
+			struct connection::message_buffer *message =
+				connection::copy_buffer((const char *)messages[index].iov_base, messages[index].iov_len);
 
-		while (true) {
-			rc = poll(&poll_fds[0], num_sockets, -1);
-			DIE (rc < 0, "Polling error");
-
-			for (int index = 0; index < poll_fds.size(); index++) {
-				/* Check if there's data to be read on one of the sockets */
-				if (poll_fds[index].revents & POLLIN) {
-					if (poll_fds[index].fd == tcp_listen_fd) { // TCP client-connection request
-						handle_tcp_connection(poll_fds, num_sockets, tcp_clients);
-						continue;
-					}
+			message->topic_length = topic_lengths[index];
 
-					if (poll_fds[index].fd == udp_socket) { // UDP client request
-						process_udp_message(poll_fds, subscriptions);
-						continue;
-					}
+			uint64_t sequence = client->sequenced ? client->history.push(message) : 0;
+			bool sent = check_delivery(ctx, client, queue_notification(client, message, sequence,
+																		ctx.config.overflow));
+
+			connection::release_buffer(message);
+
+			if (!sent) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Retransmits the kept notifications a resuming subscriber has asked
+	 * for, SF_FORWARD_BATCH at a time while its socket takes them; those
+	 * no longer kept are reported with a FRAME_GAP.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
+	 */
+	bool resume_history(struct server_context& ctx, struct TCP_Client *client) {
+		struct connection::message_history& history = client->history;
 
-					if (poll_fds[index].fd == 0) {  // STDIN command
-						if (handle_stdin_command(poll_fds, num_sockets) == 1) { // Exit command
-							return;
-						}
-						continue;
+		while (client->isActive && client->output.empty() && client->resume_next != 0) {
+			if (client->resume_next < history.first) {
+				char gap[sizeof(struct connection::frame_header) + 2 * sizeof(uint64_t)];
+
+				deliver(ctx, client, gap, encode_gap(gap, client->resume_next, history.first));
+				client->resume_next = history.first;
+
+				if (!client->isActive) {
+					return false;
+				}
+			}
+
+			uint64_t end = std::min(history.next, client->resume_next + SF_FORWARD_BATCH);
+
+			for (; client->resume_next < end; client->resume_next++) {
+				if (!check_delivery(ctx, client, queue_notification(client, history.at(client->resume_next),
+																	client->resume_next, ctx.config.overflow))) {
+					return false;
+				}
+			}
+
+			if (client->resume_next == history.next) {
+				client->resume_next = 0;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Replays the log for a client while its socket takes the messages,
+	 * reading the records straight from the mapped segments and sending
+	 * SF_FORWARD_BATCH notifications per writev().
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
+	 */
+	bool replay_log(struct server_context& ctx, struct TCP_Client *client) {
+		std::vector<char> scratch(SF_FORWARD_BATCH * sizeof(subscription_packet));
+
+		while (client->isActive && client->output.empty() && client->replay_pending) {
+			struct iovec messages[SF_FORWARD_BATCH];
+			size_t topic_lengths[SF_FORWARD_BATCH];
+			int count = 0;
+			size_t used = 0;
+
+			client->replay_from = message_log::replay(*ctx.log, client->replay_from,
+				[&](const struct message_log::record_header& header, const char *data) {
+					size_t packet_length = std::min((size_t)header.length, sizeof(struct udp_packet));
+					std::string_view topic{data, strnlen(data, std::min(packet_length, (size_t)MAX_TOPIC_SIZE))};
+
+					if (!wants_store_forward(client, topic)) {
+						return true;
 					}
 
-					/* One of the clients has sent new data to process */
-					process_client_request(poll_fds, index, num_sockets,
-												subscriptions, tcp_clients);
+					struct udp_packet packet{};
+					struct sockaddr_in from = {};
+
+					memcpy(&packet, data, packet_length);
+
+					from.sin_family = AF_INET;
+					from.sin_addr.s_addr = header.address;
+					from.sin_port = header.port;
+
+					size_t length = encode_notification(scratch.data() + used, client, packet, packet_length, from);
+
+					topic_lengths[count] = topic.size();
+					messages[count++] = {scratch.data() + used, length};
+					used += length;
+
+					return count < SF_FORWARD_BATCH;
+				});
+
+			if (client->replay_from >= ctx.log->next_sequence) {
+				client->replay_pending = false;
+				ctx.sessions_dirty = true;
+			}
+
+			if (count > 0 && !forward_batch(ctx, client, messages, topic_lengths, count)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Sends the retained values matching the new subscriptions of a client
+	 * while its socket takes them, SF_FORWARD_BATCH notifications per
+	 * writev(); the rest follows once the output queue has drained. A value
+	 * replaced since the subscription is skipped: the newer one has been
+	 * delivered live.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
+	 */
+	bool forward_retained(struct server_context& ctx, struct TCP_Client *client) {
+		std::vector<char> scratch;
+
+		while (client->isActive && client->output.empty() && !client->retained.empty()) {
+			scratch.resize(SF_FORWARD_BATCH * sizeof(subscription_packet));
+
+			struct iovec messages[SF_FORWARD_BATCH];
+			size_t topic_lengths[SF_FORWARD_BATCH];
+			int count = 0;
+			size_t used = 0;
+
+			while (count < SF_FORWARD_BATCH && !client->retained.empty()) {
+				struct retained_value *value = client->retained.pop();
+
+				if (!value->replaced.load(std::memory_order_acquire)) {
+					struct udp_packet packet{};
+					size_t packet_length = unpack_retained(value, &packet);
+
+					size_t length = encode_notification(scratch.data() + used, client, packet,
+														packet_length, value->from);
+
+					if (length > 0) {
+						topic_lengths[count] = strnlen(packet.topic, MAX_TOPIC_SIZE);
+						messages[count++] = {scratch.data() + used, length};
+						used += length;
+					}
 				}
+
+				release(value);
+			}
+
+			if (count > 0 && !forward_batch(ctx, client, messages, topic_lengths, count)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Queues the retained values matching a new subscription for a client.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param pattern
+	 */
+	void collect_retained(struct server_context& ctx, struct TCP_Client *client, std::string_view pattern) {
+		if (ctx.shared != NULL) {
+			collect_shared_retained(*ctx.shared, pattern, client->retained);
+			return;
+		}
+
+		if (ctx.retained.enabled()) {
+			ctx.retained.match(pattern, [&](struct retained_value *value) {
+				client->retained.push(value);
+			});
+		}
+	}
+
+	/**
+	 * Forwards the datagrams stored for a client while its socket takes
+	 * them, SF_FORWARD_BATCH notifications per writev(); the rest follows
+	 * once the output queue has drained. A resuming subscriber first gets
+	 * its retransmissions, and retained values come last.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
+	 */
+	bool forward_backlog(struct server_context& ctx, struct TCP_Client *client) {
+		/* Retransmissions to a resuming subscriber come first: they are older */
+		if (!resume_history(ctx, client)) {
+			return false;
+		}
+
+		if (client->resume_next != 0) {
+			return true;    // The rest once the output queue has drained
+		}
+
+		if (ctx.log != NULL) {
+			return replay_log(ctx, client) && forward_retained(ctx, client);
+		}
+
+		std::vector<char> scratch;
+
+		while (client->isActive && client->output.empty() && !client->backlog.empty()) {
+			scratch.resize(SF_FORWARD_BATCH * sizeof(subscription_packet));
+
+			struct iovec messages[SF_FORWARD_BATCH];
+			size_t topic_lengths[SF_FORWARD_BATCH];
+			int count = 0;
+			size_t used = 0;
+
+			while (count < SF_FORWARD_BATCH && !client->backlog.empty()) {
+				struct stored_datagram *datagram = client->backlog.front();
+				struct udp_packet packet{};
+
+				memcpy(&packet, datagram->data, datagram->length);
+
+				size_t length = encode_notification(scratch.data() + used, client, packet,
+													datagram->length, datagram->from);
+
+				topic_lengths[count] = strnlen(packet.topic, MAX_TOPIC_SIZE);
+				messages[count++] = {scratch.data() + used, length};
+				used += length;
+
+				client->backlog.pop();
+			}
+
+			if (!forward_batch(ctx, client, messages, topic_lengths, count)) {
+				return false;
+			}
+		}
+
+		return forward_retained(ctx, client);
+	}
+
+	/**
+	 * Drains the output queue of a client whose socket became writable,
+	 * then carries on with its stored datagrams.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @return false if the client has been disconnected
+	 */
+	bool handle_client_output(struct server_context& ctx, struct TCP_Client *client) {
+		if (!flush_output(ctx, client)) {
+			disconnect_client(ctx, client);
+			return false;
+		}
+
+		return forward_backlog(ctx, client);
+	}
+
+	/**
+	 * Parses a login packet: negotiates the protocol of the connection and
+	 * turns the packet into the (full-size) reply carrying the accepted version.
+	 *
+	 * @param packet login packet; overwritten with the reply
+	 * @param client_ID
+	 * @param connection
+	 * @param config
+	 */
+	void read_login(subscription_packet& packet, char *client_ID, struct TCP_Client *connection,
+					const struct server_config& config) {
+		size_t id_length = strnlen(packet.message, std::min(packet.length, (size_t)MAX_ID_LEN - 1));
+
+		memcpy(client_ID, packet.message, id_length);
+		client_ID[id_length] = '\0';
+
+		/* Pick the highest protocol version both ends understand */
+		uint8_t login_flags = 0;
+		uint64_t resume_from = 0;
+		uint16_t aliases = 0;
+		uint8_t protocol_version = std::min(get_login_version(packet, &login_flags, &resume_from, &aliases),
+											(uint8_t)PROTOCOL_FRAMED);
+
+		connection->protocol_version = protocol_version;
+		connection->raw_notifications = protocol_version >= PROTOCOL_FRAMED && (login_flags & LOGIN_FLAG_RAW);
+		connection->sequenced = protocol_version >= PROTOCOL_FRAMED && (login_flags & LOGIN_FLAG_SEQUENCED);
+		connection->resume_from = connection->sequenced ? resume_from : 0;
+
+		/* Aliases: as many as both ends allow (the subscriber's table, --topic-aliases) */
+		connection->aliases.reset(protocol_version >= PROTOCOL_FRAMED && (login_flags & LOGIN_FLAG_ALIASES)
+									? std::min((size_t)aliases, config.topic_aliases) : 0);
+
+		/* The reply is always a full packet; it carries the accepted version and options */
+		memset(&packet, 0, sizeof(packet));
+
+		if (protocol_version >= PROTOCOL_FRAMED) {
+			set_login_capabilities(packet, protocol_version,
+									(connection->raw_notifications ? LOGIN_FLAG_RAW : 0)
+									| (connection->sequenced ? LOGIN_FLAG_SEQUENCED : 0)
+									| (connection->aliases.enabled() ? LOGIN_FLAG_ALIASES : 0),
+									0, connection->aliases.limit);
+		}
+	}
+
+	/**
+	 * Moves a new connection (socket, negotiated protocol, unparsed input)
+	 * into the session of a returning client; a sequenced subscriber
+	 * resuming from a number the session has already given out gets the
+	 * notifications since then again (see resume_history()).
+	 *
+	 * @param client
+	 * @param connection
+	 */
+	void take_over_connection(struct TCP_Client *client, struct TCP_Client *connection) {
+		/* Kept notifications only serve a resume in the same format */
+		if (!connection->sequenced || connection->raw_notifications != client->raw_notifications) {
+			client->history.clear();
+		}
+
+		client->sequenced = connection->sequenced;
+		client->resume_next = connection->resume_from > 0 && connection->resume_from < client->history.next
+								? connection->resume_from : 0;
+
+		/* The subscriber starts the new connection without aliases */
+		client->aliases.reset(connection->aliases.limit);
+
+		client->socket = connection->socket;
+		client->protocol_version = connection->protocol_version;
+		client->raw_notifications = connection->raw_notifications;
+		sprintf(client->ip_addr, "%s", connection->ip_addr);
+		client->port = connection->port;
+		client->input = std::move(connection->input);
+		client->output.clear();
+		client->output.max_bytes = connection->output.max_bytes;
+	}
+
+	/**
+	 * Closes a connection whose client ID is already in use.
+	 *
+	 * @param ctx
+	 * @param connection
+	 * @param packet reply prepared by read_login()
+	 * @param client_ID
+	 */
+	void refuse_connection(struct server_context& ctx, struct TCP_Client *connection, subscription_packet& packet,
+							const char *client_ID) {
+		fprintf(stdout, "Client %s already connected.\n", client_ID);
+
+		sprintf(packet.message, "Quit");
+		connection::write_some(connection->socket, (char *)&packet, sizeof(packet));    // Send close notification (best effort)
+
+		close(connection->socket);   // Close socket
+		ctx.pool->release(connection);
+	}
+
+	/**
+	 * Processes the login packet of a new connection.
+	 *
+	 * @param ctx
+	 * @param connection client created on accept()
+	 * @param packet login packet
+	 * @return client owning the connection from now on, or NULL if the
+	 *         connection was refused
+	 */
+	struct TCP_Client *login_client(struct server_context& ctx, struct TCP_Client *connection,
+										subscription_packet& packet) {
+		const int connection_socket = connection->socket;
+
+		char client_ID[MAX_ID_LEN] = {};
+
+		read_login(packet, client_ID, connection, ctx.config);
+
+		struct TCP_Client *client = ctx.sessions.find(client_ID);
+
+		if (client != NULL) {
+			if (client->isActive) {
+				refuse_connection(ctx, connection, packet, client_ID);
+				return NULL;
+			}
+
+			// Client has come back; reset socket
+			client->isActive = true;
+			take_over_connection(client, connection);
+
+			// Index the session under its new socket
+			ctx.sessions.bind(client, connection_socket);
+
+			/* Hand the descriptor over to the registered client */
+			struct epoll_event event = {};
+
+			event.events = CLIENT_EVENTS;
+			event.data.ptr = client;
+
+			int rc = epoll_ctl(ctx.epoll_fd, EPOLL_CTL_MOD, connection_socket, &event);
+			DIE(rc < 0, "epoll_ctl(MOD) failed");
+
+			ctx.pool->release(connection);
+
+			fprintf(stdout, "New client %s connected from %s:%hu.\n",
+				client->ID, client->ip_addr, ntohs(client->port));
+
+			sprintf(packet.message, "Success");
+			deliver(ctx, client, (char *)&packet, sizeof(packet));
+
+			/* Send what has been stored while the client was away */
+			forward_backlog(ctx, client);
+
+			return client;
+		}
+
+		/* If client connection is new, notify client about success
+		 * and register the connection as a new TCP_Client */
+		struct TCP_Client *new_client = connection;
+
+		sprintf(new_client->ID, "%s", client_ID);
+		new_client->isActive = true;
+		new_client->logged_in = true;
+
+		ctx.sessions.add(new_client);
+
+		fprintf(stdout, "New client %s connected from %s:%hu.\n",
+				new_client->ID, new_client->ip_addr, ntohs(new_client->port));
+
+		sprintf(packet.message, "Success");
+		deliver(ctx, new_client, (char *)&packet, sizeof(packet));
+
+		return new_client;
+	}
+
+	/**
+	 * Keeps a datagram for a store-and-forward subscriber that cannot get
+	 * it right now; the datagram is copied once and shared by all of them.
+	 *
+	 * @param client
+	 * @param record shared copy of the datagram (created on first use)
+	 * @param packet
+	 * @param length datagram length
+	 * @param from publisher address
+	 * @return true if the datagram has been stored for the client
+	 */
+	bool store_for_client(struct TCP_Client *client, struct stored_datagram *&record,
+							const struct udp_packet& packet, size_t length, const struct sockaddr_in& from) {
+		std::string_view topic{packet.topic, strnlen(packet.topic, MAX_TOPIC_SIZE)};
+
+		if (!client->logged_in || !wants_store_forward(client, topic)) {
+			return false;
+		}
+
+		if (record == NULL) {
+			record = store_datagram(&packet, length, from);
+		}
+
+		client->backlog.push(record);
+
+		return true;
+	}
+
+	/**
+	 * Sends a datagram to its subscribers; with io_uring, all the sends
+	 * of the message go out with one submission.
+	 *
+	 * @param ctx
+	 * @param packet
+	 * @param length datagram length
+	 * @param from publisher address
+	 */
+	void publish(struct server_context& ctx, const struct udp_packet& packet, size_t length,
+					struct sockaddr_in& from) {
+		/* Copy shared by the store-and-forward subscribers that are offline */
+		struct stored_datagram *record = NULL;
+
+		/* With a disk log, they replay the logged datagram instead */
+		uint64_t sequence = ctx.log != NULL ? message_log::append(*ctx.log, &packet, length, from) : 0;
+
+		if (ctx.retained.enabled()) {
+			ctx.retained.store((const char *)&packet, length, from);
+		}
+
+		auto store = [&](struct TCP_Client *client) {
+			if (ctx.log != NULL) {
+				return defer_to_log(ctx, client, packet, sequence);
+			}
+
+			return store_for_client(client, record, packet, length, from);
+		};
+
+		if (!ctx.uring_enabled) {
+			notify_subscribers(packet, length, from, ctx.subscriptions, ctx.fanout,
+				[&](struct TCP_Client *client, struct connection::message_buffer *message) {
+					deliver(ctx, client, message);
+				}, store, &ctx.stats);
+
+			if (record != NULL) {
+				release(record);
+			}
+
+			return;
+		}
+
+		/* Each encoded format is staged once in the registered buffer */
+		const struct connection::message_buffer *sources[3];
+		ssize_t offsets[3];
+		int staged = 0;
+
+		notify_subscribers(packet, length, from, ctx.subscriptions, ctx.fanout,
+			[&](struct TCP_Client *client, struct connection::message_buffer *message) {
+				/* Keep ordering behind messages already waiting in the queue
+				 * (and history of sessions away or catching up) */
+				if (!client->output.empty() || !client->isActive || client->resume_next != 0) {
+					deliver(ctx, client, message);
+					return;
+				}
+
+				uint64_t client_sequence = client->sequenced ? client->history.push(message) : 0;
+
+				/* Sequence number and alias of the connection go in a header
+				 * segment of its own, linked to the write of the shared frame */
+				char header[MESSAGE_HEADER_MAX];
+				size_t skip;
+				ssize_t header_length = prepare_notification(client, message, client_sequence, header, &skip);
+
+				if (header_length < 0) {
+					disconnect_client(ctx, client);
+					return;
+				}
+
+				ctx.stats.notifications_out.add(1);
+				ctx.stats.bytes_out.add(message->length);
+
+				int index = 0;
+
+				while (index < staged && sources[index] != message) {
+					index++;
+				}
+
+				if (index == staged) {
+					sources[index] = message;
+					offsets[index] = uring::stage(ctx.sends, message->data, message->length);
+					staged++;
+				}
+
+				ssize_t header_offset = header_length > 0 ? uring::stage(ctx.sends, header, header_length) : 0;
+
+				/* Alias definition waiting in the queue, or no room left in the staging buffer */
+				if (!client->output.empty() || offsets[index] < 0 || header_offset < 0) {
+					check_delivery(ctx, client, connection::queue_message(client->socket, client->output,
+						message->data + skip, message->length - skip, ctx.config.overflow, message,
+						header, header_length));
+					return;
+				}
+
+				if (header_length > 0) {
+					uring::queue_write(ctx.sends, client->socket, header_offset, header_length, true);
+				}
+
+				uring::queue_write(ctx.sends, client->socket, offsets[index] + skip, message->length - skip);
+			}, store, &ctx.stats);
+
+		if (record != NULL) {
+			release(record);
+		}
+
+		uring::flush(ctx.sends, [&](int fd, const char *data, size_t data_length, int error) {
+			struct TCP_Client *client = ctx.sessions.at_socket(fd);
+
+			if (client == NULL) {
+				return;
+			}
+
+			/* Canceled: the header linked to it was not written in full */
+			if (error != 0 && error != EAGAIN && error != ECANCELED) {
+				disconnect_client(ctx, client);
+				return;
+			}
+
+			deliver(ctx, client, data, data_length);
+		});
+	}
+
+	/**
+	 * Preallocates a recvmmsg() batch.
+	 *
+	 * @param batch
+	 * @param size number of datagrams
+	 */
+	void setup_udp_batch(struct udp_batch& batch, size_t size) {
+		batch.slots.resize(size);
+		batch.sources.resize(size);
+		batch.controls.resize(size);
+		batch.iovecs.resize(size);
+		batch.messages.resize(size);
+
+		for (size_t index = 0; index < size; index++) {
+			batch.iovecs[index] = {&batch.slots[index], sizeof(struct udp_packet)};
+
+			struct msghdr& header = batch.messages[index].msg_hdr;
+
+			header = {};
+			header.msg_name = &batch.sources[index];
+			header.msg_iov = &batch.iovecs[index];
+			header.msg_iovlen = 1;
+			header.msg_control = batch.controls[index].data;
+		}
+	}
+
+	/**
+	 * Reads a batch of datagrams with a single recvmmsg().
+	 *
+	 * @param socket
+	 * @param batch
+	 * @param flags recvmmsg() flags
+	 * @return number of datagrams read, or -1 (errno set)
+	 */
+	int receive_udp_batch(int socket, struct udp_batch& batch, int flags) {
+		for (auto& message: batch.messages) {
+			message.msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			message.msg_hdr.msg_controllen = sizeof(struct udp_control);
+		}
+
+		int count = recvmmsg(socket, batch.messages.data(), batch.messages.size(), flags, NULL);
+
+		/* Slots are reused: clear what is left of the previous datagram */
+		for (int index = 0; index < count; index++) {
+			size_t length = batch.messages[index].msg_len;
+
+			memset((char *)&batch.slots[index] + length, 0, sizeof(struct udp_packet) - length);
+		}
+
+		return count;
+	}
+
+	/**
+	 * Enables the kernel drop counter (SO_RXQ_OVFL) on a UDP socket.
+	 *
+	 * @param socket
+	 */
+	void enable_drop_counter(int socket) {
+		const int enable = 1;
+		if (setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(int)) < 0)
+			perror("setsockopt(SO_RXQ_OVFL) failed");
+	}
+
+	/**
+	 * Gets the kernel drop counter carried by a datagram.
+	 *
+	 * @param header
+	 * @return datagrams dropped so far on the socket (0 if not reported)
+	 */
+	uint32_t get_udp_drops(struct msghdr *header) {
+		uint32_t drops = 0;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != NULL; cmsg = CMSG_NXTHDR(header, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+				memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			}
+		}
+
+		return drops;
+	}
+
+	/**
+	 * Sets up the io_uring backend: a ring with a multishot recvmsg() on
+	 * the UDP socket and a ring for batched fan-out writes.
+	 *
+	 * @param ctx
+	 * @return false if the kernel lacks the needed io_uring features
+	 */
+	bool setup_uring(struct server_context& ctx) {
+		if (!uring::setup_ring(ctx.udp_ring, URING_ENTRIES)) {
+			return false;
+		}
+
+		if (!uring::setup_buffer_ring(ctx.udp_ring, ctx.udp_buffers, URING_UDP_BUFFERS,
+										URING_UDP_BUFFER_SIZE, URING_UDP_GROUP)) {
+			uring::close_ring(ctx.udp_ring);
+			return false;
+		}
+
+		if (!uring::setup_send_batch(ctx.sends, URING_STAGING_SIZE)) {
+			uring::close_ring(ctx.udp_ring);
+			uring::free_buffer_ring(ctx.udp_buffers);
+			return false;
+		}
+
+		ctx.udp_header.msg_namelen = sizeof(struct sockaddr_in);
+		ctx.udp_header.msg_controllen = sizeof(struct udp_control);
+
+		uring::arm_recvmsg_multishot(ctx.udp_ring, ctx.udp_socket, &ctx.udp_header, URING_UDP_GROUP, 0);
+
+		if (uring::submit(ctx.udp_ring) != 1) {
+			uring::close_ring(ctx.udp_ring);
+			uring::free_buffer_ring(ctx.udp_buffers);
+			uring::free_send_batch(ctx.sends);
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Process UDP client messages: reads up to a batch of datagrams with a
+	 * single recvmmsg() and publishes them. A full batch leaves the socket
+	 * pending, so that other descriptors are served before the next one.
+	 *
+	 * @param ctx
+	*/
+    void process_udp_message(struct server_context& ctx) {
+		uint64_t start = server_stats::ticks();
+		int count = receive_udp_batch(ctx.udp_socket, ctx.udp, MSG_DONTWAIT);
+
+		if (count < 0) {
+			DIE(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR, "Receive bytes error");
+
+			ctx.udp_pending = errno == EINTR;
+			return;
+		}
+
+		ctx.stats.stages[server_stats::STAGE_RECEIVE].record(server_stats::ticks() - start);
+
+		ctx.udp_pending = count == (int)ctx.udp.messages.size();
+		ctx.udp_received += count;
+		ctx.udp_batches++;
+
+		ctx.stats.datagrams_in.add(count);
+
+		for (int index = 0; index < count; index++) {
+			struct mmsghdr& message = ctx.udp.messages[index];
+
+			ctx.udp_drops = std::max(ctx.udp_drops, get_udp_drops(&message.msg_hdr));
+			ctx.stats.bytes_in.add(message.msg_len);
+
+			publish(ctx, ctx.udp.slots[index], message.msg_len, ctx.udp.sources[index]);
+			check_coalesce_delay(ctx);
+		}
+    }
+
+	/**
+	 * Processes datagrams completed by the multishot receive.
+	 *
+	 * @param ctx
+	 */
+	void process_uring_datagrams(struct server_context& ctx) {
+		bool rearm = false;
+		bool unsupported = false;
+
+		uring::reap(ctx.udp_ring, [&](const struct io_uring_cqe& cqe) {
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				rearm = true;
+			}
+
+			if (cqe.res == -EINVAL) {   // Kernel without multishot recvmsg
+				unsupported = true;
+				return;
+			}
+
+			if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+				return;
+			}
+
+			uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			char *buffer = uring::get_buffer(ctx.udp_buffers, id);
+
+			if (cqe.res > 0) {
+				/* Buffer layout: recvmsg_out header, source address, control data, payload */
+				struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+				char *name = buffer + sizeof(struct io_uring_recvmsg_out);
+				char *payload = name + ctx.udp_header.msg_namelen + ctx.udp_header.msg_controllen;
+
+				size_t length = std::min((size_t)out->payloadlen,
+											(size_t)(buffer + cqe.res - payload));
+
+				struct udp_packet packet{};
+				struct sockaddr_in from = {};
+
+				memcpy(&packet, payload, std::min(length, sizeof(packet)));
+				memcpy(&from, name, std::min((size_t)out->namelen, sizeof(from)));
+
+				struct msghdr control = {};
+
+				control.msg_control = name + ctx.udp_header.msg_namelen;
+				control.msg_controllen = out->controllen;
+
+				ctx.udp_drops = std::max(ctx.udp_drops, get_udp_drops(&control));
+				ctx.udp_received++;
+
+				ctx.stats.datagrams_in.add(1);
+				ctx.stats.bytes_in.add(length);
+
+				publish(ctx, packet, std::min(length, sizeof(packet)), from);
+			}
+
+			uring::provide_buffer(ctx.udp_buffers, id);
+		});
+
+		if (unsupported) {
+			fprintf(stderr, "io_uring multishot receive unsupported, using epoll for UDP\n");
+
+			ctx.uring_enabled = false;
+			watch_descriptor(ctx, ctx.udp_socket, EPOLLIN | EPOLLET, &ctx.udp_socket);
+			process_udp_message(ctx);
+
+			return;
+		}
+
+		if (rearm) {
+			uring::arm_recvmsg_multishot(ctx.udp_ring, ctx.udp_socket, &ctx.udp_header, URING_UDP_GROUP, 0);
+			uring::submit(ctx.udp_ring);
+		}
+	}
+
+	/**
+	 * Accepts the connections of scrapers on the metrics listener.
+	 *
+	 * @param ctx
+	 */
+	void handle_metrics_connection(struct server_context& ctx) {
+		while (true) {
+			const int fd = accept4(ctx.metrics_fd, NULL, NULL, SOCK_NONBLOCK);
+
+			if (fd < 0) {
+				DIE(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED,
+					"Metrics accept error");
+
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+
+				return;
+			}
+
+			struct metrics::scrape *s = new metrics::scrape();
+
+			s->fd = fd;
+			ctx.scrapes.push_back(s);
+
+			watch_descriptor(ctx, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, s);
+		}
+	}
+
+	void close_scrape(struct server_context& ctx, struct metrics::scrape *s) {
+		close(s->fd);   // also removes it from the epoll set
+
+		std::erase(ctx.scrapes, s);
+		delete s;
+	}
+
+	/**
+	 * Answers a complete request: the server-wide series are formatted
+	 * now, the sessions by continue_scrapes() on the following passes.
+	 *
+	 * @param ctx
+	 * @param s
+	 */
+	void start_scrape(struct server_context& ctx, struct metrics::scrape& s) {
+		const char *error = metrics::check_request(s);
+
+		if (error != NULL) {
+			metrics::set_response(s, error, "");
+			return;
+		}
+
+		struct server_stats::snapshot totals;
+		server_stats::take_snapshot(totals, ctx.reporter->sources);
+
+		metrics::append_stats(s.body, totals);
+
+		if (ctx.shared != NULL) {
+			append_shared_metrics(ctx, s);
+		} else {
+			metrics::append_family(s.body, "pubsub_subscription_patterns", "gauge",
+									"Distinct subscription patterns.");
+			metrics::append_sample(s.body, "pubsub_subscription_patterns", NULL, ctx.subscriptions.pattern_count);
+
+			metrics::append_family(s.body, "pubsub_udp_kernel_drops_total", "counter",
+									"Datagrams dropped by the kernel before being read.");
+			metrics::append_sample(s.body, "pubsub_udp_kernel_drops_total", NULL, ctx.udp_drops);
+
+			s.clients.reserve(ctx.sessions.by_id.size());
+
+			for (auto& entry: ctx.sessions.by_id) {
+				s.clients.push_back(entry.second);
+			}
+		}
+
+		s.state = metrics::SCRAPE_BUILDING;
+	}
+
+	/**
+	 * Serves an event on the connection of a scraper.
+	 *
+	 * @param ctx
+	 * @param s
+	 * @param events
+	 */
+	void handle_scrape_event(struct server_context& ctx, struct metrics::scrape *s, uint32_t events) {
+		if (s->state == metrics::SCRAPE_READING) {
+			/* A scraper may shut its side down right after the request */
+			if (!metrics::read_request(*s) && !metrics::request_complete(*s)) {
+				close_scrape(ctx, s);
+				return;
+			}
+
+			if (!metrics::request_complete(*s)) {
+				if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					close_scrape(ctx, s);
+				}
+
+				return;
+			}
+
+			start_scrape(ctx, *s);
+		}
+
+		if (s->state == metrics::SCRAPE_SENDING && metrics::send_response(*s)) {
+			close_scrape(ctx, s);
+		}
+	}
+
+	/**
+	 * Formats the next chunk of sessions of each scrape in progress, and
+	 * sends the responses that are complete. Called once per pass.
+	 *
+	 * @param ctx
+	 */
+	void continue_scrapes(struct server_context& ctx) {
+		std::vector<struct metrics::scrape *> building;
+
+		for (struct metrics::scrape *s: ctx.scrapes) {
+			if (s->state == metrics::SCRAPE_BUILDING) {
+				building.push_back(s);
+			}
+		}
+
+		for (struct metrics::scrape *s: building) {
+			if (!metrics::append_clients(*s)) {
+				continue;
+			}
+
+			metrics::append_sessions(*s);
+			metrics::set_response(*s, "200 OK", s->body);
+
+			if (metrics::send_response(*s)) {
+				close_scrape(ctx, s);
+			}
+		}
+	}
+
+	/**
+	 * @return true if a scrape waits for the next pass of the event loop
+	 */
+	bool scrapes_building(const struct server_context& ctx) {
+		for (const struct metrics::scrape *s: ctx.scrapes) {
+			if (s->state == metrics::SCRAPE_BUILDING) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Serves the metrics listener or a scraper.
+	 *
+	 * @param ctx
+	 * @param source epoll data of the event
+	 * @param events
+	 * @return false if the event is not for the metrics endpoint
+	 */
+	bool handle_metrics_event(struct server_context& ctx, void *source, uint32_t events) {
+		if (source == &ctx.metrics_fd) {
+			handle_metrics_connection(ctx);
+			return true;
+		}
+
+		for (struct metrics::scrape *s: ctx.scrapes) {
+			if (s == source) {
+				handle_scrape_event(ctx, s, events);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Starts the metrics endpoint (--metrics-port) in the epoll set of ctx.
+	 *
+	 * @param ctx
+	 */
+	void setup_metrics(struct server_context& ctx) {
+		if (ctx.config.metrics_port == 0) {
+			return;
+		}
+
+		ctx.metrics_fd = metrics::open_listener(ctx.config.metrics_port);
+		watch_descriptor(ctx, ctx.metrics_fd, EPOLLIN | EPOLLET, &ctx.metrics_fd);
+	}
+
+	/**
+	 * Reads user input command and handles request.
+	 *
+	 * @param ctx
+	 */
+	int handle_stdin_command(struct server_context& ctx) {
+		subscription_packet packet{};
+
+		connection::receive_full_message(0, (void *)&packet, sizeof(packet));
+
+		if (strcmp(connection::get_command(packet.message), "exit") == 0) {
+			close(ctx.tcp_listen_fd); // close TCP listening socket
+			close(ctx.udp_socket); // close UDP socket
+
+			/* Notifications held for coalescing go out before the Quit */
+			flush_corked(ctx);
+
+			/* Close TCP clients */
+			for (auto& entry: ctx.sessions.by_id) {
+				struct TCP_Client *client = entry.second;
+
+				if (!client->isActive) {
+					continue;
+				}
+
+				deliver_message(ctx, client, FRAME_QUIT);    // Send close notification (best effort)
+
+				close(client->socket);   // Close socket
+			}
+
+			close(ctx.epoll_fd);
+
+			server_stats::stop_reporter(*ctx.reporter);
+
+			/* Last group commit; sessions resume from the log after a restart */
+			if (ctx.log != NULL) {
+				save_log_sessions(ctx);
+				message_log::close_log(*ctx.log);
+			}
+
+			exit(0);
+		}
+
+		if (strcmp(connection::get_command(packet.message), "queues") == 0) {
+			/* Output queue depth and drops of every connected client */
+			for (auto& entry: ctx.sessions.by_id) {
+				struct TCP_Client *client = entry.second;
+
+				if (!client->isActive) {
+					continue;
+				}
+
+				fprintf(stdout, "%s: queued %zu bytes (%zu messages), peak %zu, dropped %lu messages (%lu bytes)\n",
+						client->ID, client->output.queued_bytes, client->output.messages.size(),
+						client->output.peak_bytes, client->output.dropped_messages, client->output.dropped_bytes);
+			}
+
+			/* Store-and-forward backlogs, including offline clients */
+			for (auto& entry: ctx.sessions.by_id) {
+				struct TCP_Client *client = entry.second;
+
+				if (client->backlog.stored == 0) {
+					continue;
+				}
+
+				fprintf(stdout, "%s: stored %zu datagrams (%zu bytes), evicted %lu\n",
+						client->ID, client->backlog.count, client->backlog.bytes, client->backlog.evicted);
+			}
+
+			/* Conflated subscriptions: notifications replaced by a newer one of the same topic */
+			for (auto& entry: ctx.sessions.by_id) {
+				struct TCP_Client *client = entry.second;
+
+				if (client->output.replaced_messages > 0) {
+					fprintf(stdout, "%s: conflated %lu notifications\n", client->ID, client->output.replaced_messages);
+				}
+			}
+
+			/* Sessions with logged datagrams still to replay */
+			for (auto& entry: ctx.sessions.by_id) {
+				struct TCP_Client *client = entry.second;
+
+				if (client->replay_pending) {
+					fprintf(stdout, "%s: replaying log from sequence %lu\n", client->ID, client->replay_from);
+				}
+			}
+
+			return 0;
+		}
+
+		if (strcmp(connection::get_command(packet.message), "stats") == 0) {
+			fprintf(stdout, "UDP: %lu datagrams in %lu batches, %u dropped by the kernel\n",
+					ctx.udp_received, ctx.udp_batches, ctx.udp_drops);
+			fprintf(stdout, "Fan-out cache: %zu hits, %zu misses, %zu evictions\n",
+					ctx.fanout.hits, ctx.fanout.misses, ctx.fanout.evictions);
+			fprintf(stdout, "Topics: %zu interned, %zu evicted in %zu sweeps\n",
+					ctx.fanout.topics.count, ctx.fanout.topics.evictions, ctx.fanout.topics.sweeps);
+			fprintf(stdout, "Coalescing: %lu notifications held, %lu flushes\n",
+					ctx.coalesced, ctx.coalesce_flushes);
+
+			if (ctx.retained.enabled()) {
+				fprintf(stdout, "Retained: %zu topics (%zu bytes), %zu evicted\n",
+						ctx.retained.count, ctx.retained.bytes, ctx.retained.evictions);
+			}
+
+			if (ctx.log != NULL) {
+				fprintf(stdout, "Log: %lu appended, next sequence %lu, %zu segments (%zu bytes), %lu deleted, %lu syncs\n",
+						ctx.log->appended, ctx.log->next_sequence, ctx.log->segments.size(), ctx.log->bytes,
+						ctx.log->deleted_segments, ctx.log->syncs.load());
+			}
+
+			/* Traffic and stage latencies since the previous stats command */
+			server_stats::print_stats(*ctx.reporter, stdout);
+
+			return 0;
+		}
+
+		fprintf(stderr, "Unlisted command\n");
+		return 0;
+	}
+
+	/**
+	 * Process TCP client requests regarding subscriptions (and not only).
+	 *
+	 * @return false if the client has been disconnected
+	*/
+    bool process_client_request(struct server_context& ctx, struct TCP_Client *client,
+									uint8_t type, char *message) {
+		/* Check if client logged out */
+		if (type == FRAME_QUIT) {
+			disconnect_client(ctx, client);
+			return false;
+		}
+
+        if (strcmp(connection::get_command(message), "subscribe") == 0) {
+            char *topic = connection::get_topic(message);
+
+			std::string topic_string(topic);
+
+			/* Subscribe to matching topics */
+			if (ctx.shared != NULL) {
+				update_subscription(*ctx.shared, client, topic_string, true);
+			} else {
+				subscribe_to_topic(client, topic_string, ctx.subscriptions);
+			}
+
+			/*
+			 * "subscribe <topic> 1": keep notifications while the client is offline;
+			 * "subscribe <topic> [SF] conflate": only the latest of each topic while the client is backed up
+			 */
+			bool store_forward = false, conflate = false;
+
+			for (int index = 0; index < 2; index++) {
+				char *option = connection::get_argument(message, index);
+
+				if (option != NULL) {
+					store_forward |= strcmp(option, "1") == 0;
+					conflate |= strcmp(option, "conflate") == 0;
+				}
+			}
+
+			set_conflation(client, topic_string, conflate);
+
+			bool changed = set_store_forward(client, topic_string, store_forward);
+
+			if (changed && ctx.log != NULL) {
+				ctx.sessions_dirty = true;
+			}
+
+			/* Send confirmation to client */
+			deliver_message(ctx, client, FRAME_ACK);
+
+			/* Then the retained values of the matching topics */
+			collect_retained(ctx, client, topic_string);
+
+			return client->isActive && forward_backlog(ctx, client);
+        }
+
+        if (strcmp(connection::get_command(message), "unsubscribe") == 0) {
+			char *topic = connection::get_topic(message);
+
+			std::string topic_string(topic);
+
+			/* Unsubscribe from matching topics */
+			if (ctx.shared != NULL) {
+				update_subscription(*ctx.shared, client, topic_string, false);
+			} else {
+				unsubscribe_from_topic(client, topic_string, ctx.subscriptions);
+			}
+
+			set_conflation(client, topic_string, false);
+
+			if (set_store_forward(client, topic_string, false) && ctx.log != NULL) {
+				ctx.sessions_dirty = true;
+			}
+
+			/* Send confirmation to client */
+			deliver_message(ctx, client, FRAME_ACK);
+
+			return client->isActive;
+        }
+
+		return true;
+    }
+
+	/**
+	 * Reads everything available on a client connection (edge-triggered)
+	 * and processes every complete message.
+	 *
+	 * @param ctx
+	 * @param client
+	 */
+	void handle_client_input(struct server_context& ctx, struct TCP_Client *client) {
+		bool closed = false;
+
+		while (true) {
+			size_t used = client->input.size();
+			client->input.resize(used + sizeof(subscription_packet));
+
+			ssize_t rc = recv(client->socket, client->input.data() + used, sizeof(subscription_packet), 0);
+
+			client->input.resize(used + std::max(rc, (ssize_t)0));
+
+			if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+
+			if (rc <= 0) {  // Peer closed the connection (or reset it)
+				closed = true;
+				break;
+			}
+		}
+
+		size_t offset = 0;
+
+		while (true) {
+			const char *data = client->input.data() + offset;
+			size_t available = client->input.size() - offset;
+
+			/* Login packets always have the legacy (fixed) size */
+			ssize_t size = get_message_size(client->logged_in ? client->protocol_version : PROTOCOL_LEGACY,
+												data, available);
+
+			if (size < 0) {     // Malformed frame; drop the connection
+				closed = true;
+				break;
+			}
+
+			if (size == 0 || (size_t)size > available) {
+				break;
+			}
+
+			offset += size;
+
+			if (!client->logged_in) {
+				subscription_packet packet;
+				memcpy(&packet, data, sizeof(packet));
+
+				/* Keep bytes following the login packet for the client owning the connection */
+				client->input.erase(client->input.begin(), client->input.begin() + offset);
+				offset = 0;
+
+				/* In threaded mode the session moves to its worker thread */
+				client = ctx.shared != NULL ? hand_off_login(ctx, client, packet) : login_client(ctx, client, packet);
+
+				if (client == NULL || !client->isActive) {
+					return;
+				}
+
+				continue;
+			}
+
+			char message[MAX_NOTIFICATION_LEN + 1];
+			uint8_t type;
+
+			decode_message(client->protocol_version, data, &type, message, FRAME_COMMAND);
+
+			if (!process_client_request(ctx, client, type, message)) {
+				return;
+			}
+		}
+
+		if (closed) {
+			disconnect_client(ctx, client);
+			return;
+		}
+
+		client->input.erase(client->input.begin(), client->input.begin() + offset);
+	}
+
+	/**
+	 * Handles an epoll event of a client connection.
+	 *
+	 * @param ctx
+	 * @param client
+	 * @param events
+	 */
+	void handle_client_event(struct server_context& ctx, struct TCP_Client *client, uint32_t events) {
+		/* Skip events of connections closed earlier in this batch */
+		if (client->logged_in && !client->isActive) {
+			return;
+		}
+
+		/* Socket drained; send what has been queued for the client */
+		if ((events & EPOLLOUT) && !handle_client_output(ctx, client)) {
+			return;
+		}
+
+		/* One of the clients has sent new data to process */
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			handle_client_input(ctx, client);
+		}
+	}
+
+	/**
+	 * Run server to handle multiple client connections simultaneously
+	 * using an edge-triggered epoll reactor; each wakeup only visits
+	 * the descriptors that are ready.
+	 *
+	 * @param tcp_listen_fd socket listening for tcp connections
+	 * @param udp_socket
+	 * @param config
+	 */
+	void run_server(int tcp_listen_fd, int udp_socket, const struct server_config& config) {
+		struct server_context ctx;
+
+		ctx.config = config;
+		ctx.pool = new session_pool();
+		ctx.retained.max_bytes = config.retained_bytes;
+		ctx.tcp_listen_fd = tcp_listen_fd;
+		ctx.udp_socket = udp_socket;
+
+		/* Vanished subscribers surface as send errors, not as SIGPIPE */
+		signal(SIGPIPE, SIG_IGN);
+
+		int rc = listen(tcp_listen_fd, config.backlog);
+		DIE(rc < 0, "Listening error");
+
+		connection::set_non_blocking(tcp_listen_fd);
+		connection::set_non_blocking(udp_socket);
+
+		setup_udp_batch(ctx.udp, config.udp_batch);
+		enable_drop_counter(udp_socket);
+
+		ctx.reporter = new server_stats::reporter();
+		ctx.reporter->sources.push_back(&ctx.stats);
+		server_stats::start_reporter(*ctx.reporter, config.stats_file, config.stats_interval);
+
+		if (config.log_dir != NULL) {
+			ctx.log = new message_log::segmented_log{};
+
+			ctx.log->segment_size = config.log_segment_size;
+			ctx.log->retention_bytes = config.log_retention_bytes;
+			ctx.log->retention_age = config.log_retention_age;
+			ctx.log->sync_interval = config.log_sync_interval;
+
+			message_log::open_log(*ctx.log, config.log_dir);
+			restore_log_sessions(ctx);
+		}
+
+		ctx.epoll_fd = epoll_create1(0);
+		DIE(ctx.epoll_fd < 0, "epoll_create1 failed");
+
+		/* Add stdin descriptor (level-triggered, read line by line) */
+		watch_descriptor(ctx, ctx.stdin_fd, EPOLLIN, &ctx.stdin_fd);
+
+		/* Add TCP listening socket */
+		watch_descriptor(ctx, tcp_listen_fd, EPOLLIN | EPOLLET, &ctx.tcp_listen_fd);
+
+		/* Add the metrics listener (--metrics-port) */
+		setup_metrics(ctx);
+
+		/* Add UDP socket (or the ring its receives complete on) */
+		if (config.use_uring) {
+			ctx.uring_enabled = setup_uring(ctx);
+
+			if (!ctx.uring_enabled) {
+				fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+			}
+		}
+
+		if (ctx.uring_enabled) {
+			watch_descriptor(ctx, ctx.udp_ring.fd, EPOLLIN, &ctx.udp_ring);
+		} else {
+			watch_descriptor(ctx, udp_socket, EPOLLIN | EPOLLET, &ctx.udp_socket);
+		}
+
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+
+		while (true) {
+			/* Don't sleep while a burst is still being drained (or a scrape being built) */
+			bool busy = ctx.udp_pending || (!ctx.scrapes.empty() && scrapes_building(ctx));
+			int count = epoll_wait(ctx.epoll_fd, events, MAX_EPOLL_EVENTS,
+									busy ? 0 : ctx.sessions_dirty ? ctx.log->sync_interval : -1);
+
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+
+			DIE (count < 0, "Polling error");
+
+			for (int index = 0; index < count; index++) {
+				void *source = events[index].data.ptr;
+
+				if (source == &ctx.tcp_listen_fd) { // TCP client-connection request
+					handle_tcp_connection(ctx);
+					continue;
+				}
+
+				if (source == &ctx.udp_socket) { // UDP client request
+					process_udp_message(ctx);
+					continue;
+				}
+
+				if (source == &ctx.udp_ring) {  // UDP datagrams received through io_uring
+					process_uring_datagrams(ctx);
+					continue;
+				}
+
+				if (source == &ctx.stdin_fd) {  // STDIN command
+					if (handle_stdin_command(ctx) == 1) { // Exit command
+						return;
+					}
+					continue;
+				}
+
+				if (ctx.metrics_fd >= 0 && handle_metrics_event(ctx, source, events[index].events)) {
+					continue;
+				}
+
+				handle_client_event(ctx, (struct TCP_Client *)source, events[index].events);
+			}
+
+			/* Datagrams left over by the batch limit */
+			if (ctx.udp_pending) {
+				process_udp_message(ctx);
+			}
+
+			flush_corked(ctx);
+
+			/* SF state of the sessions changed: handed to the log once per group commit */
+			if (ctx.sessions_dirty && message_log::current_time() - ctx.sessions_saved >= ctx.log->sync_interval) {
+				save_log_sessions(ctx);
+			}
+
+			/* Sessions of the metrics being scraped, a chunk per pass */
+			if (!ctx.scrapes.empty()) {
+				continue_scrapes(ctx);
 			}
 		}
 
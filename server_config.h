@@ -0,0 +1,199 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include "helpers.h"
+#include "output_queue.h"
+#include "store_forward.h"
+#include "message_log.h"
+#include "server_stats.h"
+#include "topic_alias.h"
+
+#define UDP_BATCH_SIZE 64
+
+#define COALESCE_MAX_BYTES (64 << 10)   // notifications held for one subscriber before an early flush
+#define COALESCE_MAX_DELAY 500          // microseconds a notification may be held for coalescing
+
+namespace server {
+    /**
+     * Tunables given as optional "--name=value" arguments after the port.
+     */
+    struct server_config {
+        int backlog = SOMAXCONN;    // pending TCP connections accepted by listen()
+        bool use_uring = false;     // io_uring for UDP receive and fan-out sends (--io=uring)
+        int udp_batch = UDP_BATCH_SIZE; // datagrams read per recvmmsg() call (--udp-batch=N)
+
+        /* Threaded mode (--threads=N): N session workers plus UDP ingest threads */
+        int workers = 0;            // 0: single-threaded reactor
+        int ingest_threads = 1;     // --ingest-threads=N
+
+        /* Slow consumers: per-client output queue bound and what happens once it is full */
+        size_t queue_limit = OUTPUT_QUEUE_MAX_BYTES;                         // --queue-limit=BYTES
+        connection::overflow_policy overflow = connection::DROP_NEWEST;     // --overflow=drop-newest|drop-oldest|disconnect
+
+        /* Write coalescing: notifications for a subscriber are gathered during a pass of the
+         * event loop and written with one sendmsg() (0 bytes: every notification is sent at once) */
+        size_t coalesce_bytes = COALESCE_MAX_BYTES;     // --coalesce-bytes=BYTES
+        int coalesce_delay = COALESCE_MAX_DELAY;        // --coalesce-delay=MICROSECONDS
+
+        /* Store-and-forward: what a disconnected session may keep (oldest datagrams are evicted first) */
+        size_t sf_max_messages = SF_MAX_MESSAGES;   // --sf-max-messages=N
+        size_t sf_max_bytes = SF_MAX_BYTES;         // --sf-max-bytes=BYTES
+
+        /* Sequenced sessions: notifications kept for retransmission when the subscriber resumes */
+        size_t resume_history = RESUME_HISTORY;     // --resume-history=N
+
+        /* Topic aliases: most a connection may be given (0: topics always go out by name) */
+        size_t topic_aliases = TOPIC_ALIASES_MAX;   // --topic-aliases=N
+
+        /* Retained values: last datagram of each topic, sent to new subscriptions (0: nothing retained) */
+        size_t retained_bytes = 0;                  // --retained-bytes=BYTES
+
+        /* Disk log of datagrams (--log-dir=PATH): store-and-forward across restarts */
+        const char *log_dir = NULL;
+        size_t log_segment_size = LOG_SEGMENT_SIZE;         // --log-segment-size=BYTES
+        size_t log_retention_bytes = LOG_RETENTION_BYTES;   // --log-retention-bytes=BYTES
+        int64_t log_retention_age = LOG_RETENTION_AGE;      // --log-retention-age=SECONDS
+        int log_sync_interval = LOG_SYNC_INTERVAL;          // --log-sync-interval=MS
+
+        /* Periodic dump of the stats (one JSON line per interval) */
+        const char *stats_file = NULL;                  // --stats-file=PATH
+        int stats_interval = STATS_DUMP_INTERVAL;       // --stats-interval=MS
+
+        /* Prometheus text endpoint on the loopback interface (0: disabled) */
+        uint16_t metrics_port = 0;                      // --metrics-port=PORT
+    };
+
+    /**
+     * Parses optional server arguments.
+     *
+     * @param argc
+     * @param argv
+     * @param config
+     */
+    void parse_server_options(const int argc, const char *argv[], struct server_config& config) {
+        for (int index = 2; index < argc; index++) {
+            char value[32];
+
+            if (sscanf(argv[index], "--backlog=%d", &config.backlog) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--io=%31s", value) == 1) {
+                DIE(strcmp(value, "uring") != 0 && strcmp(value, "epoll") != 0, "Unknown I/O backend");
+
+                config.use_uring = strcmp(value, "uring") == 0;
+                continue;
+            }
+
+            if (sscanf(argv[index], "--udp-batch=%d", &config.udp_batch) == 1) {
+                DIE(config.udp_batch < 1, "Invalid UDP batch size");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--threads=%d", &config.workers) == 1) {
+                DIE(config.workers < 0, "Invalid number of worker threads");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--ingest-threads=%d", &config.ingest_threads) == 1) {
+                DIE(config.ingest_threads < 1, "Invalid number of ingest threads");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--queue-limit=%zu", &config.queue_limit) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--sf-max-messages=%zu", &config.sf_max_messages) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--sf-max-bytes=%zu", &config.sf_max_bytes) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--resume-history=%zu", &config.resume_history) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--topic-aliases=%zu", &config.topic_aliases) == 1) {
+                DIE(config.topic_aliases > UINT16_MAX, "Too many topic aliases");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--retained-bytes=%zu", &config.retained_bytes) == 1) {
+                continue;
+            }
+
+            if (strncmp(argv[index], "--log-dir=", strlen("--log-dir=")) == 0) {
+                config.log_dir = argv[index] + strlen("--log-dir=");
+                DIE(config.log_dir[0] == '\0', "Invalid log directory");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--log-segment-size=%zu", &config.log_segment_size) == 1) {
+                DIE(config.log_segment_size < LOG_MIN_SEGMENT_SIZE, "Log segments must be at least 64 KiB");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--log-retention-bytes=%zu", &config.log_retention_bytes) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--log-retention-age=%ld", &config.log_retention_age) == 1) {
+                DIE(config.log_retention_age < 0, "Invalid log retention age");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--log-sync-interval=%d", &config.log_sync_interval) == 1) {
+                DIE(config.log_sync_interval < 1, "Invalid log sync interval");
+                continue;
+            }
+
+            if (strncmp(argv[index], "--stats-file=", strlen("--stats-file=")) == 0) {
+                config.stats_file = argv[index] + strlen("--stats-file=");
+                DIE(config.stats_file[0] == '\0', "Invalid stats file");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--stats-interval=%d", &config.stats_interval) == 1) {
+                DIE(config.stats_interval < 1, "Invalid stats interval");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--metrics-port=%hu", &config.metrics_port) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--coalesce-bytes=%zu", &config.coalesce_bytes) == 1) {
+                continue;
+            }
+
+            if (sscanf(argv[index], "--coalesce-delay=%d", &config.coalesce_delay) == 1) {
+                DIE(config.coalesce_delay < 0, "Invalid coalescing delay");
+                continue;
+            }
+
+            if (sscanf(argv[index], "--overflow=%31s", value) == 1) {
+                if (strcmp(value, "drop-newest") == 0) {
+                    config.overflow = connection::DROP_NEWEST;
+                } else if (strcmp(value, "drop-oldest") == 0) {
+                    config.overflow = connection::DROP_OLDEST;
+                } else {
+                    DIE(strcmp(value, "disconnect") != 0, "Unknown overflow policy");
+
+                    config.overflow = connection::DISCONNECT;
+                }
+
+                continue;
+            }
+
+            DIE(true, "Unknown option");
+        }
+
+        /* Appends happen on the reactor thread; ingest threads do not log */
+        DIE(config.log_dir != NULL && config.workers > 0, "--log-dir is not supported with --threads");
+    }
+}
+
+#endif
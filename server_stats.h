@@ -0,0 +1,435 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include "helpers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define HISTOGRAM_SUB_BITS 3    // 8 buckets per power of two: values are known within 12.5%
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+#define STATS_DUMP_INTERVAL 10000   // milliseconds between two lines of the stats file
+
+namespace server_stats {
+    /**
+     * Hot path stages timed by the server.
+     */
+    enum stage {
+        STAGE_RECEIVE,      // recvmmsg() of a batch of datagrams
+        STAGE_MATCH,        // fan-out list of a datagram's topic
+        STAGE_ENCODE,       // wire formats of a notification
+        STAGE_ENQUEUE,      // handing a notification to its subscribers' queues
+        STAGE_FLUSH,        // writing out an output queue
+        STAGE_COUNT
+    };
+
+    const char *STAGE_NAMES[STAGE_COUNT] = {"receive", "match", "encode", "enqueue", "flush"};
+
+    /**
+     * Cheap timestamp: the TSC on x86 (constant rate on any CPU still in
+     * use), nanoseconds of the monotonic clock elsewhere.
+     */
+    inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+    }
+
+    uint64_t monotonic_ns() {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    double ticks_per_ns = 1;
+
+    /**
+     * Measures the tick rate against the monotonic clock (10 ms, once at
+     * startup).
+     */
+    void calibrate_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t start_ns = monotonic_ns();
+        uint64_t start = ticks();
+
+        struct timespec pause = {0, 10000000};
+        nanosleep(&pause, NULL);
+
+        uint64_t elapsed_ns = monotonic_ns() - start_ns;
+        uint64_t elapsed = ticks() - start;
+
+        if (elapsed_ns > 0 && elapsed > 0) {
+            ticks_per_ns = (double)elapsed / elapsed_ns;
+        }
+#endif
+    }
+
+    /**
+     * Counter written by a single thread and read by any: relaxed load
+     * and store instead of a locked increment.
+     */
+    struct counter {
+        std::atomic<uint64_t> value{0};
+
+        void add(uint64_t amount) {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * Bucket of a value in a log-linear histogram: values below
+     * HISTOGRAM_SUB_BUCKETS have their own bucket, every power of two
+     * above is split in HISTOGRAM_SUB_BUCKETS equal parts.
+     */
+    inline size_t bucket_index(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return value;
+        }
+
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+
+        return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+
+    /**
+     * Highest value that falls in a bucket.
+     */
+    uint64_t bucket_limit(size_t index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+
+        int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+        uint64_t base = (HISTOGRAM_SUB_BUCKETS + (index & (HISTOGRAM_SUB_BUCKETS - 1))) << shift;
+
+        return base + ((1ULL << shift) - 1);
+    }
+
+    /**
+     * Histogram filled by a single thread (ticks, or plain values).
+     */
+    struct histogram {
+        std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+        std::atomic<uint64_t> max{0};
+        std::atomic<uint64_t> sum{0};
+
+        void record(uint64_t value) {
+            std::atomic<uint64_t>& count = counts[bucket_index(value)];
+
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+
+            if (value > max.load(std::memory_order_relaxed)) {
+                max.store(value, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    /**
+     * Instrumentation of one thread: per-stage latencies (in ticks),
+     * subscribers matched per datagram and traffic counters.
+     */
+    struct thread_stats {
+        struct histogram stages[STAGE_COUNT];
+        struct histogram matches;
+
+        struct counter datagrams_in;
+        struct counter bytes_in;
+        struct counter notifications_out;   // notifications handed to output queues
+        struct counter bytes_out;
+        struct counter drops;               // notifications dropped by the overflow policy
+    };
+
+    /**
+     * Plain copy of histograms, merged over threads.
+     */
+    struct histogram_counts {
+        uint64_t counts[HISTOGRAM_BUCKETS] = {};
+        uint64_t max = 0;
+        uint64_t sum = 0;
+
+        void add(const struct histogram& source) {
+            for (size_t index = 0; index < HISTOGRAM_BUCKETS; index++) {
+                counts[index] += source.counts[index].load(std::memory_order_relaxed);
+            }
+
+            max = std::max(max, source.max.load(std::memory_order_relaxed));
+            sum += source.sum.load(std::memory_order_relaxed);
+        }
+
+        uint64_t total() const {
+            uint64_t sum = 0;
+
+            for (uint64_t count: counts) {
+                sum += count;
+            }
+
+            return sum;
+        }
+
+        /**
+         * Value under which a fraction of the recorded values fall (the
+         * upper limit of its bucket, never above the maximum).
+         */
+        uint64_t percentile(double fraction) const {
+            uint64_t rank = (uint64_t)(fraction * total() + 0.5);
+            uint64_t seen = 0;
+
+            for (size_t index = 0; index < HISTOGRAM_BUCKETS; index++) {
+                seen += counts[index];
+
+                if (counts[index] > 0 && seen >= std::max(rank, (uint64_t)1)) {
+                    return std::min(bucket_limit(index), max);
+                }
+            }
+
+            return 0;
+        }
+    };
+
+    /**
+     * Totals of every thread at some point in time.
+     */
+    struct snapshot {
+        uint64_t time = 0;  // monotonic nanoseconds
+
+        struct histogram_counts stages[STAGE_COUNT];
+        struct histogram_counts matches;
+
+        uint64_t datagrams_in = 0;
+        uint64_t bytes_in = 0;
+        uint64_t notifications_out = 0;
+        uint64_t bytes_out = 0;
+        uint64_t drops = 0;
+    };
+
+    void take_snapshot(struct snapshot& result, const std::vector<const struct thread_stats *>& sources) {
+        result = {};
+        result.time = monotonic_ns();
+
+        for (const struct thread_stats *source: sources) {
+            for (int stage = 0; stage < STAGE_COUNT; stage++) {
+                result.stages[stage].add(source->stages[stage]);
+            }
+
+            result.matches.add(source->matches);
+
+            result.datagrams_in += source->datagrams_in.load();
+            result.bytes_in += source->bytes_in.load();
+            result.notifications_out += source->notifications_out.load();
+            result.bytes_out += source->bytes_out.load();
+            result.drops += source->drops.load();
+        }
+    }
+
+    /**
+     * What has been recorded between two snapshots. Maxima are not kept
+     * per interval: the top non-empty bucket stands for them.
+     */
+    void interval_between(struct snapshot& result, const struct snapshot& now, const struct snapshot& before) {
+        auto subtract = [](struct histogram_counts& out, const struct histogram_counts& later,
+                            const struct histogram_counts& earlier) {
+            out.max = 0;
+            out.sum = later.sum - earlier.sum;
+
+            for (size_t index = 0; index < HISTOGRAM_BUCKETS; index++) {
+                out.counts[index] = later.counts[index] - earlier.counts[index];
+
+                if (out.counts[index] > 0) {
+                    out.max = std::min(bucket_limit(index), later.max);
+                }
+            }
+        };
+
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            subtract(result.stages[stage], now.stages[stage], before.stages[stage]);
+        }
+
+        subtract(result.matches, now.matches, before.matches);
+
+        result.time = now.time - before.time;
+        result.datagrams_in = now.datagrams_in - before.datagrams_in;
+        result.bytes_in = now.bytes_in - before.bytes_in;
+        result.notifications_out = now.notifications_out - before.notifications_out;
+        result.bytes_out = now.bytes_out - before.bytes_out;
+        result.drops = now.drops - before.drops;
+    }
+
+    uint64_t to_ns(uint64_t value) {
+        return (uint64_t)(value / ticks_per_ns);
+    }
+
+    double per_second(uint64_t count, uint64_t elapsed_ns) {
+        return elapsed_ns > 0 ? count * 1e9 / elapsed_ns : 0;
+    }
+
+    /**
+     * Prints an interval for the stats command.
+     *
+     * @param out
+     * @param delta see interval_between()
+     */
+    void print_interval(FILE *out, const struct snapshot& delta) {
+        fprintf(out, "Traffic (last %.1f s): %lu datagrams in (%lu bytes, %.0f/s), "
+                        "%lu notifications out (%lu bytes, %.0f/s), %lu dropped\n",
+                delta.time / 1e9, delta.datagrams_in, delta.bytes_in, per_second(delta.datagrams_in, delta.time),
+                delta.notifications_out, delta.bytes_out, per_second(delta.notifications_out, delta.time),
+                delta.drops);
+
+        fprintf(out, "Matches per datagram: p50 %lu, p99 %lu, max %lu\n",
+                delta.matches.percentile(0.5), delta.matches.percentile(0.99), delta.matches.max);
+
+        fprintf(out, "%-8s %10s %10s %10s %10s %10s\n", "Stage", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            const struct histogram_counts& latency = delta.stages[stage];
+
+            fprintf(out, "%-8s %10lu %10lu %10lu %10lu %10lu\n", STAGE_NAMES[stage], latency.total(),
+                    to_ns(latency.percentile(0.5)), to_ns(latency.percentile(0.99)),
+                    to_ns(latency.percentile(0.999)), to_ns(latency.max));
+        }
+    }
+
+    /**
+     * Writes an interval as one JSON line (stats file).
+     */
+    void write_interval(FILE *out, const struct snapshot& delta) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        fprintf(out, "{\"time\":%ld.%03ld,\"interval_ms\":%lu,\"datagrams_in\":%lu,\"bytes_in\":%lu,"
+                        "\"notifications_out\":%lu,\"bytes_out\":%lu,\"drops\":%lu,"
+                        "\"datagrams_per_sec\":%.1f,\"notifications_per_sec\":%.1f,"
+                        "\"matches\":{\"p50\":%lu,\"p99\":%lu,\"max\":%lu}",
+                now.tv_sec, now.tv_nsec / 1000000, delta.time / 1000000, delta.datagrams_in, delta.bytes_in,
+                delta.notifications_out, delta.bytes_out, delta.drops,
+                per_second(delta.datagrams_in, delta.time), per_second(delta.notifications_out, delta.time),
+                delta.matches.percentile(0.5), delta.matches.percentile(0.99), delta.matches.max);
+
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            const struct histogram_counts& latency = delta.stages[stage];
+
+            fprintf(out, ",\"%s_ns\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+                    STAGE_NAMES[stage], latency.total(), to_ns(latency.percentile(0.5)),
+                    to_ns(latency.percentile(0.99)), to_ns(latency.percentile(0.999)), to_ns(latency.max));
+        }
+
+        fprintf(out, "}\n");
+    }
+
+    /**
+     * Collects the statistics of the server threads, for the stats command
+     * and the periodic dump to a file (--stats-file).
+     */
+    struct reporter {
+        std::vector<const struct thread_stats *> sources;   // registered before the threads start
+        struct snapshot last_printed;                       // previous stats command
+
+        /* Dump thread */
+        FILE *file = NULL;
+        int interval = STATS_DUMP_INTERVAL;     // milliseconds
+        std::mutex lock;
+        std::condition_variable wakeup;
+        bool stopping = false;
+        std::thread dumper;
+    };
+
+    /**
+     * Prints what has been recorded since the previous call.
+     */
+    void print_stats(struct reporter& stats, FILE *out) {
+        struct snapshot now, delta;
+
+        take_snapshot(now, stats.sources);
+        interval_between(delta, now, stats.last_printed);
+
+        print_interval(out, delta);
+
+        stats.last_printed = now;
+    }
+
+    void run_dumper(struct reporter& stats) {
+        struct snapshot before, now, delta;
+
+        take_snapshot(before, stats.sources);
+        before.time = stats.last_printed.time;     // first interval starts with the server
+
+        std::unique_lock<std::mutex> guard(stats.lock);
+
+        while (!stats.stopping) {
+            stats.wakeup.wait_for(guard, std::chrono::milliseconds(stats.interval));
+
+            take_snapshot(now, stats.sources);
+            interval_between(delta, now, before);
+
+            write_interval(stats.file, delta);
+            fflush(stats.file);
+
+            before = now;
+        }
+    }
+
+    /**
+     * Starts counting (and dumping to path every interval milliseconds,
+     * if path is not NULL); the sources must be registered.
+     */
+    void start_reporter(struct reporter& stats, const char *path, int interval) {
+        calibrate_ticks();
+
+        stats.last_printed = {};
+        stats.last_printed.time = monotonic_ns();
+
+        if (path == NULL) {
+            return;
+        }
+
+        stats.file = fopen(path, "a");
+        DIE(stats.file == NULL, "Cannot open stats file");
+
+        stats.interval = interval;
+        stats.dumper = std::thread(run_dumper, std::ref(stats));
+    }
+
+    /**
+     * Writes the last interval and stops the dump thread.
+     */
+    void stop_reporter(struct reporter& stats) {
+        if (stats.file == NULL) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(stats.lock);
+            stats.stopping = true;
+        }
+
+        stats.wakeup.notify_one();
+        stats.dumper.join();
+
+        fclose(stats.file);
+        stats.file = NULL;
+    }
+}
+
+#endif
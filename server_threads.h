@@ -0,0 +1,749 @@
+#ifndef SERVER_THREADS_H
+#define SERVER_THREADS_H
+
+#include "server_backend.h"
+#include "spsc_queue.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <sys/eventfd.h>
+
+#define DELIVERY_QUEUE_SIZE 4096
+
+namespace server {
+	/**
+	 * Datagram matched by an ingest thread, with the subscribers one
+	 * worker has to notify.
+	 */
+	struct delivery {
+		struct udp_packet packet;
+		size_t length;
+		struct sockaddr_in from;
+		std::vector<struct TCP_Client *> targets;
+	};
+
+	/**
+	 * Session handed over by the accepting thread to its worker.
+	 */
+	struct handoff {
+		struct TCP_Client *client;          // registered session
+		struct TCP_Client *connection;      // new connection of a returning client (NULL for new ones)
+		subscription_packet reply;          // login confirmation
+	};
+
+	/**
+	 * I/O worker: owns a shard of the sessions (sockets, queues, state)
+	 * and delivers the notifications ingest threads matched for them.
+	 */
+	struct worker {
+		struct server_context ctx;          // epoll set and sockets of the shard
+		int event_fd;                       // signalled on new deliveries/handoffs
+		std::thread thread;
+
+		/* One single-producer queue per ingest thread */
+		std::vector<std::unique_ptr<spsc_queue<struct delivery *, DELIVERY_QUEUE_SIZE>>> inbox;
+
+		std::mutex handoff_lock;
+		std::vector<struct handoff *> handoffs;
+		bool stopping = false;              // guarded by handoff_lock
+	};
+
+	/**
+	 * UDP ingest thread reading its own SO_REUSEPORT socket.
+	 */
+	struct ingest_thread {
+		int index;
+		int socket;
+		std::thread thread;
+		std::atomic<bool> stopping{false};
+
+		std::atomic<uint64_t> received{0};
+		std::atomic<uint64_t> batches{0};
+		std::atomic<uint32_t> drops{0};
+
+		server_stats::thread_stats stats;   // receive and match stages
+	};
+
+	/**
+	 * State shared by the threads of the threaded server.
+	 *
+	 * Subscriptions are changed under the lock and published as immutable
+	 * trie snapshots (copy, then atomic pointer swap); ingest threads only
+	 * ever read the current snapshot, which stays alive while in use.
+	 */
+	struct shared_state {
+		std::mutex lock;    // guards the members below and the isActive flag of sessions
+
+		topic_trie subscriptions;
+		std::atomic<std::shared_ptr<const topic_trie>> snapshot;
+
+		std::unordered_map<std::string, struct TCP_Client *, level_hasher, std::equal_to<>> sessions;  // by client ID
+		std::unordered_set<struct TCP_Client *> joining;    // handed over, not adopted by their worker yet
+		int next_worker = 0;
+
+		/* Last value of every topic (--retained-bytes); stored by the ingest threads */
+		std::mutex retained_lock;
+		retained_store retained;
+
+		std::vector<std::unique_ptr<struct worker>> workers;
+		std::vector<std::unique_ptr<struct ingest_thread>> ingest;
+
+		struct session_pool pool;   // connections are allocated here and released by any thread
+	};
+
+	/**
+	 * Wakes a worker up.
+	 */
+	void signal_worker(struct worker& w) {
+		uint64_t one = 1;
+
+		ssize_t rc = write(w.event_fd, &one, sizeof(one));
+		DIE(rc < 0 && errno != EAGAIN, "eventfd write failed");
+	}
+
+	/**
+	 * Processes a login in threaded mode: registers the session and hands
+	 * the connection over to the worker owning it.
+	 *
+	 * @param ctx context of the accepting thread
+	 * @param connection
+	 * @param packet login packet
+	 * @return NULL (the connection is no longer served by this thread)
+	 */
+	struct TCP_Client *hand_off_login(struct server_context& ctx, struct TCP_Client *connection,
+										subscription_packet& packet) {
+		struct shared_state& shared = *ctx.shared;
+
+		char client_ID[MAX_ID_LEN] = {};
+
+		read_login(packet, client_ID, connection, ctx.config);
+
+		struct handoff *transfer = new handoff{};
+
+		std::unique_lock<std::mutex> guard(shared.lock);
+
+		auto entry = shared.sessions.find(client_ID);
+
+		if (entry != shared.sessions.end()
+				&& (entry->second->isActive || shared.joining.count(entry->second) > 0)) {
+			guard.unlock();
+
+			refuse_connection(ctx, connection, packet, client_ID);
+			delete transfer;
+
+			return NULL;
+		}
+
+		if (entry == shared.sessions.end()) {
+			/* New session; sessions keep their worker across reconnects */
+			sprintf(connection->ID, "%s", client_ID);
+			connection->logged_in = true;
+			connection->worker = shared.next_worker++ % shared.workers.size();
+
+			shared.sessions.emplace(client_ID, connection);
+
+			transfer->client = connection;
+		} else {
+			transfer->client = entry->second;
+			transfer->connection = connection;
+		}
+
+		shared.joining.insert(transfer->client);
+
+		guard.unlock();
+
+		int rc = epoll_ctl(ctx.epoll_fd, EPOLL_CTL_DEL, connection->socket, NULL);
+		DIE(rc < 0, "epoll_ctl(DEL) failed");
+
+		fprintf(stdout, "New client %s connected from %s:%hu.\n",
+				client_ID, connection->ip_addr, ntohs(connection->port));
+
+		sprintf(packet.message, "Success");
+		transfer->reply = packet;
+
+		struct worker& w = *shared.workers[transfer->client->worker];
+
+		{
+			std::lock_guard<std::mutex> handoff_guard(w.handoff_lock);
+			w.handoffs.push_back(transfer);
+		}
+
+		signal_worker(w);
+
+		return NULL;
+	}
+
+	/**
+	 * Marks a session as disconnected (called by its worker).
+	 */
+	void release_session(struct shared_state& shared, struct TCP_Client *client) {
+		std::lock_guard<std::mutex> guard(shared.lock);
+
+		client->isActive = false;
+	}
+
+	/**
+	 * Changes a subscription and publishes a new snapshot of the trie.
+	 *
+	 * @param shared
+	 * @param client
+	 * @param topic
+	 * @param subscribe
+	 */
+	void update_subscription(struct shared_state& shared, struct TCP_Client *client, std::string& topic,
+								bool subscribe) {
+		std::lock_guard<std::mutex> guard(shared.lock);
+
+		if (subscribe) {
+			subscribe_to_topic(client, topic, shared.subscriptions);
+		} else {
+			unsubscribe_from_topic(client, topic, shared.subscriptions);
+		}
+
+		shared.snapshot.store(std::make_shared<const topic_trie>(shared.subscriptions));
+	}
+
+	/**
+	 * Queues the retained values matching a new subscription for a client.
+	 *
+	 * @param shared
+	 * @param pattern
+	 * @param cursor retained values the client still has to be sent
+	 */
+	void collect_shared_retained(struct shared_state& shared, std::string_view pattern,
+									struct retained_cursor& cursor) {
+		if (!shared.retained.enabled()) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> guard(shared.retained_lock);
+
+		shared.retained.match(pattern, [&](struct retained_value *value) {
+			cursor.push(value);
+		});
+	}
+
+	/**
+	 * Server-wide series of the threaded mode. Sessions and subscriptions
+	 * are read under the lock; output queues belong to the workers and are
+	 * not exported per client.
+	 *
+	 * @param ctx context of the accepting thread
+	 * @param s
+	 */
+	void append_shared_metrics(struct server_context& ctx, struct metrics::scrape& s) {
+		struct shared_state& shared = *ctx.shared;
+		size_t patterns;
+
+		{
+			std::lock_guard<std::mutex> guard(shared.lock);
+
+			patterns = shared.subscriptions.pattern_count;
+
+			for (auto& entry: shared.sessions) {
+				if (entry.second->isActive) {
+					s.active++;
+				} else {
+					s.inactive++;
+				}
+			}
+		}
+
+		uint64_t drops = 0;
+
+		for (auto& in: shared.ingest) {
+			drops += in->drops;
+		}
+
+		metrics::append_family(s.body, "pubsub_subscription_patterns", "gauge", "Distinct subscription patterns.");
+		metrics::append_sample(s.body, "pubsub_subscription_patterns", NULL, patterns);
+
+		metrics::append_family(s.body, "pubsub_udp_kernel_drops_total", "counter",
+								"Datagrams dropped by the kernel before being read.");
+		metrics::append_sample(s.body, "pubsub_udp_kernel_drops_total", NULL, drops);
+	}
+
+	/**
+	 * Adopts the sessions handed over to a worker.
+	 *
+	 * @param shared
+	 * @param w
+	 * @return false if the worker has to stop
+	 */
+	bool adopt_sessions(struct shared_state& shared, struct worker& w) {
+		std::vector<struct handoff *> handoffs;
+		bool stopping;
+
+		{
+			std::lock_guard<std::mutex> guard(w.handoff_lock);
+
+			handoffs.swap(w.handoffs);
+			stopping = w.stopping;
+		}
+
+		for (struct handoff *transfer: handoffs) {
+			struct TCP_Client *client = transfer->client;
+
+			if (transfer->connection != NULL) {
+				/* Returning client: its previous socket was unbound on disconnect */
+				take_over_connection(client, transfer->connection);
+				w.ctx.pool->release(transfer->connection);
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(shared.lock);
+
+				client->isActive = true;
+				shared.joining.erase(client);
+			}
+
+			if (w.ctx.sessions.find(client->ID) == NULL) {
+				w.ctx.sessions.add(client);
+			} else {
+				w.ctx.sessions.bind(client, client->socket);
+			}
+			watch_descriptor(w.ctx, client->socket, CLIENT_EVENTS, client);
+
+			deliver(w.ctx, client, (char *)&transfer->reply, sizeof(transfer->reply));
+
+			/* Send what has been stored while the client was away */
+			forward_backlog(w.ctx, client);
+
+			/* Commands sent right after the login are already buffered */
+			if (client->isActive && !client->input.empty()) {
+				handle_client_input(w.ctx, client);
+			}
+
+			delete transfer;
+		}
+
+		return !stopping;
+	}
+
+	/**
+	 * Sends the notifications queued for a worker by the ingest threads.
+	 *
+	 * @param w
+	 */
+	void deliver_notifications(struct worker& w) {
+		for (auto& queue: w.inbox) {
+			struct delivery *message;
+
+			while (queue->pop(message)) {
+				struct stored_datagram *record = NULL;
+
+				notify_clients(message->packet, message->length, message->from, message->targets,
+					[&](struct TCP_Client *client, struct connection::message_buffer *notification) {
+						deliver(w.ctx, client, notification);
+					},
+					[&](struct TCP_Client *client) {
+						return store_for_client(client, record, message->packet, message->length, message->from);
+					}, &w.ctx.stats);
+
+				if (record != NULL) {
+					release(record);
+				}
+
+				delete message;
+
+				check_coalesce_delay(w.ctx);
+			}
+		}
+	}
+
+	/**
+	 * Event loop of a worker: client commands, output queues and deliveries.
+	 *
+	 * @param shared
+	 * @param w
+	 */
+	void run_worker(struct shared_state& shared, struct worker& w) {
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+
+		while (true) {
+			int count = epoll_wait(w.ctx.epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+
+			DIE(count < 0, "Polling error");
+
+			for (int index = 0; index < count; index++) {
+				void *source = events[index].data.ptr;
+
+				if (source != &w.event_fd) {
+					handle_client_event(w.ctx, (struct TCP_Client *)source, events[index].events);
+					continue;
+				}
+
+				uint64_t signals;
+
+				if (read(w.event_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN) {
+					DIE(true, "eventfd read failed");
+				}
+
+				if (!adopt_sessions(shared, w)) {
+					/* Server is shutting down; close the shard */
+					flush_corked(w.ctx);
+
+					for (auto& entry: w.ctx.sessions.by_id) {
+						struct TCP_Client *client = entry.second;
+
+						if (!client->isActive) {
+							continue;
+						}
+
+						deliver_message(w.ctx, client, FRAME_QUIT);    // Send close notification (best effort)
+
+						if (client->isActive) {
+							close(client->socket);
+						}
+					}
+
+					return;
+				}
+
+				deliver_notifications(w);
+			}
+
+			flush_corked(w.ctx);
+		}
+	}
+
+	/**
+	 * Ingest thread: reads datagram batches, matches their topics against
+	 * the current subscription snapshot and queues one delivery per
+	 * worker with subscribers to notify.
+	 *
+	 * @param shared
+	 * @param in
+	 * @param batch_size
+	 */
+	void run_ingest(struct shared_state& shared, struct ingest_thread& in, size_t batch_size) {
+		struct udp_batch batch;
+		setup_udp_batch(batch, batch_size);
+
+		std::shared_ptr<const topic_trie> snapshot;
+		fanout_cache fanout;
+
+		size_t worker_count = shared.workers.size();
+		std::vector<struct delivery *> pending(worker_count, NULL);
+		std::vector<bool> touched(worker_count, false);
+
+		while (true) {
+			/* Only reads that find datagrams waiting are timed, not the wait for them */
+			uint64_t start = server_stats::ticks();
+			int count = receive_udp_batch(in.socket, batch, MSG_DONTWAIT);
+
+			if (count > 0) {
+				in.stats.stages[server_stats::STAGE_RECEIVE].record(server_stats::ticks() - start);
+			} else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				/* Block for the first datagram, then take whatever else is queued */
+				count = receive_udp_batch(in.socket, batch, MSG_WAITFORONE);
+			}
+
+			/* Woken up by shutdown() at exit: what was read is not delivered */
+			if (in.stopping) {
+				return;
+			}
+
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+
+			DIE(count < 0, "Receive bytes error");
+
+			in.received += count;
+			in.batches++;
+
+			in.stats.datagrams_in.add(count);
+
+			/* Retained values are stored before the snapshot is taken: a subscription missing
+			 * from it has been made (and its retained values gathered) after they were */
+			if (shared.retained.enabled()) {
+				std::lock_guard<std::mutex> guard(shared.retained_lock);
+
+				for (int index = 0; index < count; index++) {
+					shared.retained.store((const char *)&batch.slots[index], batch.messages[index].msg_len,
+											batch.sources[index]);
+				}
+			}
+
+			/* Cached fan-out lists computed on an older snapshot are stale by its generation */
+			snapshot = shared.snapshot.load();
+
+			for (int index = 0; index < count; index++) {
+				struct mmsghdr& message = batch.messages[index];
+				struct udp_packet& packet = batch.slots[index];
+
+				in.drops = std::max(in.drops.load(), get_udp_drops(&message.msg_hdr));
+				in.stats.bytes_in.add(message.msg_len);
+
+				std::string_view topic{packet.topic, strnlen(packet.topic, MAX_TOPIC_SIZE)};
+
+				uint64_t match_start = server_stats::ticks();
+				const std::vector<struct TCP_Client *>& clients = fanout.lookup(topic, *snapshot);
+
+				in.stats.stages[server_stats::STAGE_MATCH].record(server_stats::ticks() - match_start);
+				in.stats.matches.record(clients.size());
+
+				for (struct TCP_Client *client: clients) {
+					struct delivery *&message_for_worker = pending[client->worker];
+
+					if (message_for_worker == NULL) {
+						message_for_worker = new delivery{packet, message.msg_len, batch.sources[index], {}};
+					}
+
+					message_for_worker->targets.push_back(client);
+				}
+
+				for (size_t id = 0; id < worker_count; id++) {
+					if (pending[id] == NULL) {
+						continue;
+					}
+
+					/* A full queue means the worker is behind; wait instead of dropping */
+					while (!shared.workers[id]->inbox[in.index]->push(pending[id])) {
+						signal_worker(*shared.workers[id]);
+						std::this_thread::yield();
+					}
+
+					pending[id] = NULL;
+					touched[id] = true;
+				}
+			}
+
+			/* One wakeup per worker and batch */
+			for (size_t id = 0; id < worker_count; id++) {
+				if (touched[id]) {
+					signal_worker(*shared.workers[id]);
+					touched[id] = false;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Reads a user command in threaded mode.
+	 *
+	 * @param ctx
+	 */
+	void handle_threaded_command(struct server_context& ctx) {
+		struct shared_state& shared = *ctx.shared;
+		subscription_packet packet{};
+
+		connection::receive_full_message(0, (void *)&packet, sizeof(packet));
+
+		if (strcmp(connection::get_command(packet.message), "exit") == 0) {
+			close(ctx.tcp_listen_fd); // close TCP listening socket
+
+			/* Ingest threads go first: they wait on workers whose queues are full.
+			 * shutdown() wakes up a thread blocked in recvmmsg() */
+			for (auto& in: shared.ingest) {
+				in->stopping = true;
+				shutdown(in->socket, SHUT_RD);
+			}
+
+			for (auto& in: shared.ingest) {
+				in->thread.join();
+				close(in->socket);
+			}
+
+			/* Workers close their clients */
+			for (auto& w: shared.workers) {
+				{
+					std::lock_guard<std::mutex> guard(w->handoff_lock);
+					w->stopping = true;
+				}
+
+				signal_worker(*w);
+				w->thread.join();
+			}
+
+			close(ctx.epoll_fd);
+
+			server_stats::stop_reporter(*ctx.reporter);
+
+			exit(0);
+		}
+
+		if (strcmp(connection::get_command(packet.message), "stats") == 0) {
+			uint64_t received = 0, batches = 0, drops = 0;
+
+			for (auto& in: shared.ingest) {
+				received += in->received;
+				batches += in->batches;
+				drops += in->drops;
+			}
+
+			fprintf(stdout, "UDP: %lu datagrams in %lu batches, %lu dropped by the kernel\n",
+					received, batches, drops);
+			fprintf(stdout, "Threads: %zu ingest, %zu workers\n", shared.ingest.size(), shared.workers.size());
+
+			if (shared.retained.enabled()) {
+				std::lock_guard<std::mutex> guard(shared.retained_lock);
+
+				fprintf(stdout, "Retained: %zu topics (%zu bytes), %zu evicted\n",
+						shared.retained.count, shared.retained.bytes, shared.retained.evictions);
+			}
+
+			/* Traffic and stage latencies of all threads since the previous stats command */
+			server_stats::print_stats(*ctx.reporter, stdout);
+
+			return;
+		}
+
+		fprintf(stderr, "Unlisted command\n");
+	}
+
+	/**
+	 * Runs the threaded server: this thread accepts connections and logs
+	 * clients in, ingest threads read datagrams from SO_REUSEPORT sockets
+	 * and match them, and each worker serves a shard of the sessions.
+	 *
+	 * @param tcp_listen_fd
+	 * @param udp_socket socket of the first ingest thread
+	 * @param config
+	 */
+	void run_threaded_server(int tcp_listen_fd, int udp_socket, const struct server_config& config) {
+		struct shared_state shared;
+		struct server_context ctx;
+
+		ctx.config = config;
+		ctx.pool = &shared.pool;
+		ctx.tcp_listen_fd = tcp_listen_fd;
+		ctx.udp_socket = udp_socket;
+		ctx.shared = &shared;
+
+		shared.retained.max_bytes = config.retained_bytes;
+		shared.snapshot.store(std::make_shared<const topic_trie>());
+
+		/* Vanished subscribers surface as send errors, not as SIGPIPE */
+		signal(SIGPIPE, SIG_IGN);
+
+		int rc = listen(tcp_listen_fd, config.backlog);
+		DIE(rc < 0, "Listening error");
+
+		connection::set_non_blocking(tcp_listen_fd);
+
+		if (config.use_uring) {
+			fprintf(stderr, "io_uring is not used in threaded mode\n");
+		}
+
+		/* Ingest sockets: the one given, plus one per extra thread on the same port */
+		struct sockaddr_in udp_addr = {};
+		socklen_t addrlen = sizeof(udp_addr);
+
+		rc = getsockname(udp_socket, (struct sockaddr *)&udp_addr, &addrlen);
+		DIE(rc < 0, "getsockname failed");
+
+		for (int index = 0; index < config.ingest_threads; index++) {
+			auto in = std::make_unique<struct ingest_thread>();
+
+			in->index = index;
+			in->socket = index == 0 ? udp_socket : open_passive_socket(PF_INET, SOCK_DGRAM, ntohs(udp_addr.sin_port), true);
+
+			enable_drop_counter(in->socket);
+
+			shared.ingest.push_back(std::move(in));
+		}
+
+		for (int index = 0; index < config.workers; index++) {
+			auto w = std::make_unique<struct worker>();
+
+			w->ctx.config = config;
+			w->ctx.pool = &shared.pool;
+			w->ctx.shared = &shared;
+
+			w->ctx.epoll_fd = epoll_create1(0);
+			DIE(w->ctx.epoll_fd < 0, "epoll_create1 failed");
+
+			w->event_fd = eventfd(0, EFD_NONBLOCK);
+			DIE(w->event_fd < 0, "eventfd failed");
+
+			watch_descriptor(w->ctx, w->event_fd, EPOLLIN, &w->event_fd);
+
+			for (int in = 0; in < config.ingest_threads; in++) {
+				w->inbox.push_back(std::make_unique<spsc_queue<struct delivery *, DELIVERY_QUEUE_SIZE>>());
+			}
+
+			shared.workers.push_back(std::move(w));
+		}
+
+		/* Every thread records into its own stats; the reporter sums them up */
+		ctx.reporter = new server_stats::reporter();
+
+		for (auto& w: shared.workers) {
+			ctx.reporter->sources.push_back(&w->ctx.stats);
+		}
+
+		for (auto& in: shared.ingest) {
+			ctx.reporter->sources.push_back(&in->stats);
+		}
+
+		server_stats::start_reporter(*ctx.reporter, config.stats_file, config.stats_interval);
+
+		for (auto& w: shared.workers) {
+			struct worker *current = w.get();
+			w->thread = std::thread([&shared, current] { run_worker(shared, *current); });
+		}
+
+		for (auto& in: shared.ingest) {
+			struct ingest_thread *current = in.get();
+			in->thread = std::thread([&shared, current, &config] { run_ingest(shared, *current, config.udp_batch); });
+		}
+
+		/* Accepting thread: new connections, logins and STDIN */
+		ctx.epoll_fd = epoll_create1(0);
+		DIE(ctx.epoll_fd < 0, "epoll_create1 failed");
+
+		watch_descriptor(ctx, ctx.stdin_fd, EPOLLIN, &ctx.stdin_fd);
+		watch_descriptor(ctx, tcp_listen_fd, EPOLLIN | EPOLLET, &ctx.tcp_listen_fd);
+
+		setup_metrics(ctx);
+
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+
+		while (true) {
+			int count = epoll_wait(ctx.epoll_fd, events, MAX_EPOLL_EVENTS,
+									!ctx.scrapes.empty() && scrapes_building(ctx) ? 0 : -1);
+
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+
+			DIE(count < 0, "Polling error");
+
+			for (int index = 0; index < count; index++) {
+				void *source = events[index].data.ptr;
+
+				if (source == &ctx.tcp_listen_fd) {
+					handle_tcp_connection(ctx);
+					continue;
+				}
+
+				if (source == &ctx.stdin_fd) {
+					handle_threaded_command(ctx);
+					continue;
+				}
+
+				if (ctx.metrics_fd >= 0 && handle_metrics_event(ctx, source, events[index].events)) {
+					continue;
+				}
+
+				/* Connection that has not logged in yet */
+				handle_client_event(ctx, (struct TCP_Client *)source, events[index].events);
+			}
+
+			if (!ctx.scrapes.empty()) {
+				continue_scrapes(ctx);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+
+#include "subscription_protocol.h"
+
+#include <mutex>
+#include <new>
+
+#define SESSION_SLAB_SIZE 256   // sessions allocated at once by the pool
+
+namespace subscription_protocol {
+    /**
+     * Slab allocator for TCP_Client structures: slots are carved out of
+     * SESSION_SLAB_SIZE-sized blocks and recycled through a free list, so
+     * accepting a connection does not go to the general allocator.
+     *
+     * In threaded mode connections are allocated by the accepting thread
+     * and may be released by workers, hence the lock.
+     */
+    struct session_pool {
+        std::mutex lock;
+        std::vector<void *> slabs;
+        std::vector<void *> free_slots;
+
+        size_t allocated = 0;   // sessions in use
+
+        ~session_pool() {
+            for (void *slab: slabs) {
+                free(slab);
+            }
+        }
+
+        struct TCP_Client *allocate() {
+            void *slot;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                if (free_slots.empty()) {
+                    char *slab = (char *)malloc(SESSION_SLAB_SIZE * sizeof(struct TCP_Client));
+                    DIE(slab == NULL, "Allocation error");
+
+                    slabs.push_back(slab);
+
+                    for (int index = SESSION_SLAB_SIZE - 1; index >= 0; index--) {
+                        free_slots.push_back(slab + index * sizeof(struct TCP_Client));
+                    }
+                }
+
+                slot = free_slots.back();
+                free_slots.pop_back();
+                allocated++;
+            }
+
+            return new (slot) TCP_Client{};
+        }
+
+        void release(struct TCP_Client *client) {
+            client->~TCP_Client();
+
+            std::lock_guard<std::mutex> guard(lock);
+
+            free_slots.push_back(client);
+            allocated--;
+        }
+    };
+
+    /**
+     * Logged-in sessions, indexed by client ID and by the socket of their
+     * current connection.
+     *
+     * The socket index is a table indexed by descriptor: when a client
+     * comes back, its entry moves to the new descriptor in place, while
+     * the ID index (pointing at the session itself) is left untouched.
+     */
+    struct session_registry {
+        std::unordered_map<std::string, struct TCP_Client *, level_hasher, std::equal_to<>> by_id;
+        std::vector<struct TCP_Client *> by_socket;
+
+        /**
+         * Gets the session of a client ID.
+         *
+         * @param ID
+         * @return NULL if the ID has never logged in
+         */
+        struct TCP_Client *find(std::string_view ID) const {
+            auto iter = by_id.find(ID);
+
+            return iter != by_id.end() ? iter->second : NULL;
+        }
+
+        /**
+         * Gets the session currently connected through a socket.
+         *
+         * @param socket
+         * @return NULL if no logged-in session uses the socket
+         */
+        struct TCP_Client *at_socket(int socket) const {
+            if (socket < 0 || (size_t)socket >= by_socket.size()) {
+                return NULL;
+            }
+
+            return by_socket[socket];
+        }
+
+        /**
+         * Registers a new session (and its socket, if connected).
+         */
+        void add(struct TCP_Client *client) {
+            by_id.emplace(client->ID, client);
+
+            if (client->socket >= 0) {
+                bind(client, client->socket);
+            }
+        }
+
+        /**
+         * Points the socket index at a session for its new connection.
+         *
+         * @param client
+         * @param socket
+         */
+        void bind(struct TCP_Client *client, int socket) {
+            if ((size_t)socket >= by_socket.size()) {
+                by_socket.resize(std::max((size_t)socket + 1, 2 * by_socket.size()), NULL);
+            }
+
+            by_socket[socket] = client;
+            client->socket = socket;
+        }
+
+        /**
+         * Drops the socket of a disconnected session from the index (the
+         * descriptor may be reused by another connection).
+         */
+        void unbind(struct TCP_Client *client) {
+            if (at_socket(client->socket) == client) {
+                by_socket[client->socket] = NULL;
+            }
+        }
+
+        size_t size() const {
+            return by_id.size();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+namespace server {
+    /**
+     * Bounded lock-free queue with a single producer and a single consumer.
+     *
+     * Head and tail only ever grow; slots are addressed modulo the
+     * capacity (a power of two). Each index sits on its own cache line so
+     * that the two threads do not keep stealing it from each other.
+     */
+    template <typename T, size_t Capacity>
+    struct spsc_queue {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+        alignas(64) std::atomic<size_t> head{0};    // next slot to read (consumer)
+        alignas(64) std::atomic<size_t> tail{0};    // next slot to write (producer)
+
+        T slots[Capacity];
+
+        /**
+         * Producer side.
+         *
+         * @return false if the queue is full
+         */
+        bool push(const T& value) {
+            size_t current = tail.load(std::memory_order_relaxed);
+
+            if (current - head.load(std::memory_order_acquire) == Capacity) {
+                return false;
+            }
+
+            slots[current & (Capacity - 1)] = value;
+            tail.store(current + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        /**
+         * Consumer side.
+         *
+         * @return false if the queue is empty
+         */
+        bool pop(T& value) {
+            size_t current = head.load(std::memory_order_relaxed);
+
+            if (current == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            value = slots[current & (Capacity - 1)];
+            head.store(current + 1, std::memory_order_release);
+
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef STORE_FORWARD_H
+#define STORE_FORWARD_H
+
+#include "helpers.h"
+
+#include <atomic>
+#include <new>
+
+#define SF_MAX_MESSAGES 1024
+#define SF_MAX_BYTES (1 << 20)
+#define SF_FORWARD_BATCH 64     // messages encoded per writev() when forwarding
+
+namespace subscription_protocol {
+    /**
+     * Datagram kept for offline store-and-forward subscribers.
+     *
+     * One copy is shared (reference counted) by every session storing
+     * it; it is encoded in the format of a session only when forwarded.
+     */
+    struct stored_datagram {
+        std::atomic<uint32_t> references;
+        uint32_t length;
+        struct sockaddr_in from;
+        char data[];    // datagram bytes (a prefix of udp_packet)
+    };
+
+    /**
+     * Copies a datagram into a new stored_datagram (one reference, owned
+     * by the caller).
+     *
+     * @param data
+     * @param length
+     * @param from publisher address
+     * @return
+     */
+    struct stored_datagram *store_datagram(const void *data, size_t length, const struct sockaddr_in& from) {
+        void *memory = malloc(sizeof(struct stored_datagram) + length);
+        DIE(memory == NULL, "Allocation error");
+
+        struct stored_datagram *datagram = new (memory) stored_datagram;
+
+        datagram->references.store(1, std::memory_order_relaxed);
+        datagram->length = length;
+        datagram->from = from;
+        memcpy(datagram->data, data, length);
+
+        return datagram;
+    }
+
+    void retain(struct stored_datagram *datagram) {
+        datagram->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(struct stored_datagram *datagram) {
+        if (datagram->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            datagram->~stored_datagram();
+            free(datagram);
+        }
+    }
+
+    /**
+     * Memory charged to a session for storing a datagram.
+     */
+    size_t stored_size(const struct stored_datagram *datagram) {
+        return sizeof(struct stored_datagram) + datagram->length;
+    }
+
+    /**
+     * Datagrams stored for a session, oldest first: a ring that grows up to
+     * max_messages entries. Once a limit (count or bytes) is reached the
+     * oldest datagrams are evicted.
+     */
+    struct session_backlog {
+        std::vector<struct stored_datagram *> slots;
+        size_t head = 0;
+        size_t count = 0;
+        size_t bytes = 0;
+
+        size_t max_messages = SF_MAX_MESSAGES;
+        size_t max_bytes = SF_MAX_BYTES;
+
+        uint64_t stored = 0;
+        uint64_t evicted = 0;
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        struct stored_datagram *front() const {
+            return slots[head];
+        }
+
+        void pop() {
+            bytes -= stored_size(slots[head]);
+            release(slots[head]);
+
+            head = (head + 1) % slots.size();
+            count--;
+        }
+
+        /**
+         * Adds a reference to datagram at the end of the backlog.
+         */
+        void push(struct stored_datagram *datagram) {
+            size_t size = stored_size(datagram);
+
+            if (size > max_bytes || max_messages == 0) {
+                evicted++;
+                return;
+            }
+
+            while (count > 0 && (count == max_messages || bytes + size > max_bytes)) {
+                pop();
+                evicted++;
+            }
+
+            if (count == slots.size()) {
+                grow();
+            }
+
+            retain(datagram);
+
+            slots[(head + count) % slots.size()] = datagram;
+            count++;
+            bytes += size;
+            stored++;
+        }
+
+        void clear() {
+            while (count > 0) {
+                pop();
+            }
+        }
+
+    private:
+        void grow() {
+            std::vector<struct stored_datagram *> larger(std::min(std::max(2 * slots.size(), (size_t)16), max_messages));
+
+            for (size_t index = 0; index < count; index++) {
+                larger[index] = slots[(head + index) % slots.size()];
+            }
+
+            slots.swap(larger);
+            head = 0;
+        }
+    };
+}
+
+#endif
@@ -1,7 +1,7 @@
 #include "subscriber_backend.h"
 
 int main(const int argc, const char *argv[]) {
-    DIE(argc != 4, "Incorrect usage\n");
+    DIE(argc < 4, "Incorrect usage\n");
 
     // Disable buffering
     setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
@@ -20,7 +20,59 @@ int main(const int argc, const char *argv[]) {
     sscanf(argv[3], "%hu", &PORT_SERVER);
     DIE(rc != 1, "Invalid server PORT");
 
-    subscriber::login_subscriber(client_id, inet_addr(ip_server), PORT_SERVER);
+    /* Parse optional flags */
+    uint8_t protocol_version = PROTOCOL_FRAMED;
+    uint8_t login_flags = LOGIN_FLAG_SEQUENCED | LOGIN_FLAG_ALIASES;
+    uint16_t aliases = TOPIC_ALIASES_MAX;
+    bool line_buffered = false;
+    int flush_interval = 0;
+    uint64_t resume_from = 0;
+    bool reconnect = false;
+
+    for (int index = 4; index < argc; index++) {
+        if (strcmp(argv[index], "--legacy") == 0) {     // fixed-size packets only
+            protocol_version = PROTOCOL_LEGACY;
+            continue;
+        }
+
+        if (strcmp(argv[index], "--raw") == 0) {        // format notifications locally
+            login_flags |= LOGIN_FLAG_RAW;
+            continue;
+        }
+
+        if (strcmp(argv[index], "--line-buffered") == 0) {  // print every notification at once
+            line_buffered = true;
+            continue;
+        }
+
+        if (sscanf(argv[index], "--flush-interval=%d", &flush_interval) == 1) {    // hold output up to N ms
+            DIE(flush_interval < 0, "Invalid flush interval");
+            continue;
+        }
+
+        if (sscanf(argv[index], "--resume=%lu", &resume_from) == 1) {   // ask for notifications from N again
+            DIE(resume_from == 0, "Sequence numbers start at 1");
+            continue;
+        }
+
+        if (sscanf(argv[index], "--aliases=%hu", &aliases) == 1) {     // topic alias table size (0: none)
+            if (aliases == 0) {
+                login_flags &= ~LOGIN_FLAG_ALIASES;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[index], "--reconnect") == 0) {  // connect again (and resume) if the connection drops
+            reconnect = true;
+            continue;
+        }
+
+        DIE(true, "Unknown option");
+    }
+
+    subscriber::login_subscriber(client_id, inet_addr(ip_server), PORT_SERVER, protocol_version, login_flags,
+                                    line_buffered, flush_interval, resume_from, reconnect, aliases);
 
     return 0;
 }
\ No newline at end of file
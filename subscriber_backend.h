@@ -5,15 +5,277 @@
 
 using namespace subscription_protocol;
 
+#define SUBSCRIBER_RECEIVE_SIZE (256 << 10)     // bytes read from the server per wakeup (at most)
+#define SUBSCRIBER_OUTPUT_SIZE (256 << 10)      // notifications printed per write() (at most)
+
+#define RECONNECT_MIN_DELAY 10      // milliseconds before the second reconnection attempt (--reconnect)
+#define RECONNECT_MAX_DELAY 1000    // the delay doubles up to this between later attempts
+
 namespace subscriber {
     /**
-     * Opens new socket and connects the subscriber to the server.
+     * Bytes received from the server and not parsed yet: [head, tail).
+     * A partial message left at the end is moved to the front once the
+     * space after it runs short.
+     */
+    struct receive_buffer {
+        std::vector<char> data = std::vector<char>(SUBSCRIBER_RECEIVE_SIZE);
+        size_t head = 0;
+        size_t tail = 0;
+    };
+
+    /**
+     * Output written to STDOUT in large chunks: at the end of each batch
+     * of notifications, every flush_interval milliseconds, or after each
+     * line (line_buffered, for interactive use).
+     */
+    struct output_buffer {
+        std::vector<char> data = std::vector<char>(SUBSCRIBER_OUTPUT_SIZE);
+        size_t used = 0;
+
+        bool line_buffered = false;
+        int flush_interval = 0;     // milliseconds; 0: flush after each batch
+        int64_t first_line = 0;     // monotonic milliseconds when the oldest line still held was added
+    };
+
+    /**
+     * Connection of the subscriber to the server.
+     */
+    struct session {
+        int socket;
+        uint8_t protocol_version;
+
+        struct receive_buffer input;
+        struct output_buffer output;
+
+        /* Sequenced session (LOGIN_FLAG_SEQUENCED): the numbers tell what has been missed */
+        uint64_t last_sequence = 0;     // number of the last notification received (0: none yet)
+        uint64_t gaps = 0;
+        uint64_t missed = 0;            // notifications lost in those gaps
+
+        /* Topic aliases of the connection (LOGIN_FLAG_ALIASES), as many as agreed at login */
+        std::vector<std::string> aliases;
+    };
+
+    int64_t monotonic_ms() {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    /**
+     * Writes what the output buffer holds to STDOUT.
+     */
+    void flush_output(struct output_buffer& output) {
+        size_t written = 0;
+
+        while (written < output.used) {
+            ssize_t rc = write(STDOUT_FILENO, output.data.data() + written, output.used - written);
+
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (rc < 0) {   // STDOUT is gone; nothing else to do with the output
+                break;
+            }
+
+            written += rc;
+        }
+
+        output.used = 0;
+    }
+
+    /**
+     * Makes room for a line of at most length bytes (newline included).
+     *
+     * @return where the line goes
+     */
+    char *reserve_line(struct output_buffer& output, size_t length) {
+        if (output.used + length > output.data.size()) {
+            flush_output(output);
+        }
+
+        if (output.used == 0) {
+            output.first_line = output.flush_interval > 0 ? monotonic_ms() : 0;
+        }
+
+        return output.data.data() + output.used;
+    }
+
+    /**
+     * Adds a line written in the space given by reserve_line().
+     *
+     * @param output
+     * @param length line length, newline excluded
+     */
+    void commit_line(struct output_buffer& output, size_t length) {
+        output.data[output.used + length] = '\n';
+        output.used += length + 1;
+
+        if (output.line_buffered) {
+            flush_output(output);
+        }
+    }
+
+    /**
+     * Flushes the output at the end of a batch of notifications, unless it
+     * may still be held for a while (flush_interval).
+     *
+     * @param output
+     * @return poll() timeout until the next flush is due (-1: none)
+     */
+    int end_batch(struct output_buffer& output) {
+        if (output.used == 0) {
+            return -1;
+        }
+
+        int64_t held = output.flush_interval > 0 ? monotonic_ms() - output.first_line : 0;
+
+        if (held >= output.flush_interval) {
+            flush_output(output);
+            return -1;
+        }
+
+        return output.flush_interval - held;
+    }
+
+    /**
+     * Reads what the server has sent, up to the free space of the buffer
+     * (one recv() call).
+     *
+     * @param socket
+     * @param input
+     * @return bytes read, 0 if the server closed the connection, or -1
+     */
+    ssize_t fill_buffer(int socket, struct receive_buffer& input) {
+        /* A message is never longer than a legacy packet */
+        if (input.data.size() - input.tail < sizeof(subscription_packet)) {
+            memmove(input.data.data(), input.data.data() + input.head, input.tail - input.head);
+            input.tail -= input.head;
+            input.head = 0;
+        }
+
+        ssize_t rc;
+
+        do {
+            rc = recv(socket, input.data.data() + input.tail, input.data.size() - input.tail, 0);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc > 0) {
+            input.tail += rc;
+        }
+
+        return rc;
+    }
+
+    /**
+     * Defines (or redefines) a topic alias of the connection.
+     *
+     * @param s
+     * @param message FRAME_ALIAS payload: the alias, then the topic
+     * @param length
+     */
+    void define_alias(struct session& s, const char *message, size_t length) {
+        uint16_t alias;
+
+        if (length < sizeof(alias) || length - sizeof(alias) > MAX_TOPIC_SIZE) {
+            fprintf(stderr, "Malformed topic alias\n");
+            return;
+        }
+
+        memcpy(&alias, message, sizeof(alias));
+        alias = ntohs(alias);
+
+        if (alias >= s.aliases.size()) {
+            fprintf(stderr, "Topic alias %hu out of range\n", alias);
+            return;
+        }
+
+        s.aliases[alias].assign(message + sizeof(alias), length - sizeof(alias));
+    }
+
+    /**
+     * Takes the next complete message out of the receive buffer. Alias
+     * definitions are taken in on the way, and aliased notifications get
+     * their topic back.
+     *
+     * @param s
+     * @param type frame type
+     * @param message output buffer, at least MAX_NOTIFICATION_LEN + 1 bytes
+     * @param sequence number of a sequenced notification (0 otherwise)
+     * @return message length, or -1 if no complete message is buffered
+     */
+    ssize_t next_message(struct session& s, uint8_t *type, char *message, uint64_t *sequence) {
+        struct receive_buffer& input = s.input;
+
+        while (true) {
+            const char *data = input.data.data() + input.head;
+            size_t available = input.tail - input.head;
+
+            ssize_t size = get_message_size(s.protocol_version, data, available);
+            DIE(size < 0, "Malformed message");
+
+            if (size == 0 || (size_t)size > available) {
+                return -1;
+            }
+
+            int alias;
+            size_t length = decode_message(s.protocol_version, data, type, message, FRAME_NOTIFICATION, sequence,
+                                            &alias);
+
+            input.head += size;
+
+            if (input.head == input.tail) {
+                input.head = input.tail = 0;
+            }
+
+            if (*type == FRAME_ALIAS) {
+                define_alias(s, message, length);
+                continue;
+            }
+
+            if (alias < 0) {
+                return length;
+            }
+
+            if ((size_t)alias >= s.aliases.size() || s.aliases[alias].empty()
+                || (length = restore_topic(*type, message, length, s.aliases[alias])) == 0) {
+                fprintf(stderr, "Unknown topic alias %d\n", alias);
+                continue;
+            }
+
+            return length;
+        }
+    }
+
+    /**
+     * Receives the next message, reading from the server until one is
+     * complete.
+     *
+     * @return message length, or -1 if the connection was closed
+     */
+    ssize_t receive_buffered(struct session& s, uint8_t *type, char *message, uint64_t *sequence) {
+        ssize_t length;
+
+        while ((length = next_message(s, type, message, sequence)) < 0) {
+            if (fill_buffer(s.socket, s.input) <= 0) {
+                return -1;
+            }
+        }
+
+        return length;
+    }
+
+    /**
+     * Opens new socket and connects it to the server.
      *
      * @param ip_server
      * @param PORT
-     * @return
+     * @return socket, or -1 if the server could not be reached
      */
-    int connect_to_server(uint32_t ip_server, const uint16_t PORT, char *client_ID) {
+    int open_connection(uint32_t ip_server, const uint16_t PORT) {
         /* Create new TCP socket */
         const int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
         DIE(socket_fd < 0, "Subscriber socket error");
@@ -35,18 +297,79 @@ namespace subscriber {
 
         /* Attempt server connection */
         int rc = connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
-        DIE (rc < 0, "Connection to server failed");
 
+        if (rc < 0) {
+            int error = errno;
+
+            close(socket_fd);
+            errno = error;
+
+            return -1;
+        }
+
+        return socket_fd;
+    }
+
+    /**
+     * Logs the subscriber in on a new connection.
+     *
+     * @param socket_fd
+     * @param client_ID
+     * @param protocol_version requested version; updated with the one accepted by the server
+     * @param login_flags requested LOGIN_FLAG_* options; updated with the accepted ones
+     * @param resume_from sequenced sessions: first notification wanted again (0: none)
+     * @param aliases LOGIN_FLAG_ALIASES: size of the alias table; updated with the one accepted
+     * @return true if the server has accepted the login
+     */
+    bool log_in(int socket_fd, char *client_ID, uint8_t &protocol_version, uint8_t &login_flags,
+                uint64_t resume_from, uint16_t &aliases) {
         /* Send confirmation ID to server */
         subscription_packet packet{};
         sprintf(packet.message, "%s", client_ID);
         packet.length = strlen(client_ID);
+
+        if (protocol_version >= PROTOCOL_FRAMED) {
+            set_login_capabilities(packet, protocol_version, login_flags, resume_from, aliases);
+        }
+
         connection::send_full_message(socket_fd, (void *)&packet, sizeof(packet));
 
-        /* Await server confirmation */
+        /* Await server confirmation (older servers do not echo capabilities) */
+        memset(&packet, 0, sizeof(packet));
         connection::receive_full_message(socket_fd, (void *)&packet, sizeof(packet));
 
         if (strcmp(packet.message, "Success") == 0) {
+            uint8_t accepted_flags = 0;
+            uint16_t accepted_aliases = 0;
+
+            protocol_version = std::min(protocol_version, get_login_version(packet, &accepted_flags, NULL,
+                                                                            &accepted_aliases));
+            login_flags = protocol_version >= PROTOCOL_FRAMED ? (login_flags & accepted_flags) : 0;
+            aliases = (login_flags & LOGIN_FLAG_ALIASES) ? std::min(aliases, accepted_aliases) : 0;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Opens new socket and connects the subscriber to the server.
+     *
+     * @param ip_server
+     * @param PORT
+     * @param protocol_version requested version; updated with the one accepted by the server
+     * @param login_flags requested LOGIN_FLAG_* options; updated with the accepted ones
+     * @param aliases LOGIN_FLAG_ALIASES: size of the alias table; updated with the one accepted
+     * @param resume_from sequenced sessions: first notification wanted again (0: none)
+     * @return
+     */
+    int connect_to_server(uint32_t ip_server, const uint16_t PORT, char *client_ID, uint8_t &protocol_version,
+                            uint8_t &login_flags, uint16_t &aliases, uint64_t resume_from = 0) {
+        const int socket_fd = open_connection(ip_server, PORT);
+        DIE (socket_fd < 0, "Connection to server failed");
+
+        if (log_in(socket_fd, client_ID, protocol_version, login_flags, resume_from, aliases)) {
             return socket_fd;
         }
 
@@ -54,7 +377,231 @@ namespace subscriber {
         return -1;
     }
 
-    int parse_user_command(int connection_socket) {
+    /**
+     * Connects again once the connection to the server has dropped: right
+     * away, then after RECONNECT_MIN_DELAY milliseconds, doubling up to
+     * RECONNECT_MAX_DELAY, until the server takes the session back (it
+     * refuses it while the old connection is not closed on its side).
+     *
+     * @param ip_server
+     * @param PORT
+     * @param client_ID
+     * @param protocol_version version accepted at the first login
+     * @param login_flags options accepted at the first login
+     * @param aliases alias table size requested at the first login; updated with the one accepted
+     * @param resume_from sequenced sessions: first notification wanted again (0: none)
+     * @return socket
+     */
+    int reconnect_to_server(uint32_t ip_server, const uint16_t PORT, char *client_ID, uint8_t protocol_version,
+                            uint8_t login_flags, uint16_t &aliases, uint64_t resume_from) {
+        int delay = RECONNECT_MIN_DELAY;
+
+        while (true) {
+            int socket_fd = open_connection(ip_server, PORT);
+
+            if (socket_fd >= 0) {
+                uint8_t version = protocol_version;
+                uint8_t flags = login_flags;
+                uint16_t accepted = aliases;
+
+                if (log_in(socket_fd, client_ID, version, flags, resume_from, accepted) && version == protocol_version) {
+                    aliases = accepted;
+                    return socket_fd;
+                }
+
+                close(socket_fd);
+            }
+
+            usleep(delay * 1000);
+            delay = std::min(delay * 2, RECONNECT_MAX_DELAY);
+        }
+    }
+
+    /**
+     * Prints a notification received from the server; raw notifications
+     * are formatted locally.
+     *
+     * @param type frame type
+     * @param message
+     * @param length
+     */
+    void print_notification(uint8_t type, char *message, size_t length) {
+        if (type == FRAME_NOTIFICATION) {
+            fprintf(stdout, "%s\n", message);
+            return;
+        }
+
+        struct udp_packet packet;
+        size_t packet_length;
+        struct sockaddr_in from = {};
+
+        char notification[MAX_NOTIFICATION_LEN];
+
+        if (!decode_raw_notification(message, length, packet, packet_length, from)
+            || format_notification(notification, packet, packet_length) == 0) {
+            fprintf(stderr, "Malformed notification\n");
+            return;
+        }
+
+        fprintf(stdout, "%s\n", notification);
+    }
+
+    /**
+     * Adds a notification to the output buffer; raw notifications are
+     * formatted in place.
+     *
+     * @param output
+     * @param type frame type
+     * @param message
+     * @param length
+     */
+    void print_notification(struct output_buffer& output, uint8_t type, char *message, size_t length) {
+        char *line = reserve_line(output, std::max(length, (size_t)MAX_NOTIFICATION_LEN) + 1);
+
+        if (type == FRAME_NOTIFICATION) {
+            memcpy(line, message, length);
+            commit_line(output, length);
+            return;
+        }
+
+        struct udp_packet packet;
+        size_t packet_length;
+        struct sockaddr_in from = {};
+
+        size_t line_length;
+
+        if (!decode_raw_notification(message, length, packet, packet_length, from)
+            || (line_length = format_notification(line, packet, packet_length)) == 0) {
+            fprintf(stderr, "Malformed notification\n");
+            return;
+        }
+
+        commit_line(output, line_length);
+    }
+
+    /**
+     * Notes notifications [first, end) as lost; each gap is reported on STDERR.
+     */
+    void record_gap(struct session& s, uint64_t first, uint64_t end) {
+        s.gaps++;
+        s.missed += end - first;
+
+        fprintf(stderr, "Missed notifications %lu to %lu\n", first, end - 1);
+    }
+
+    /**
+     * Handles a notification (numbered ones are checked for a gap) or a
+     * gap reported by the server.
+     *
+     * @param s
+     * @param type frame type
+     * @param message
+     * @param length
+     * @param sequence number of the notification (0: not sequenced)
+     * @return false if the message is neither (a reply, or Quit)
+     */
+    bool handle_message(struct session& s, uint8_t type, char *message, size_t length, uint64_t sequence) {
+        if (type == FRAME_GAP) {
+            uint64_t range[2];
+
+            if (length == sizeof(range)) {
+                memcpy(range, message, sizeof(range));
+
+                uint64_t first = be64toh(range[0]), end = be64toh(range[1]);
+
+                if (end > first) {
+                    record_gap(s, first, end);
+                    s.last_sequence = std::max(s.last_sequence, end - 1);
+                }
+            }
+
+            return true;
+        }
+
+        if (type != FRAME_NOTIFICATION && type != FRAME_RAW_NOTIFICATION) {
+            return false;
+        }
+
+        if (sequence != 0) {
+            /* A lower number means the server has started the session over */
+            if (s.last_sequence != 0 && sequence > s.last_sequence + 1) {
+                record_gap(s, s.last_sequence + 1, sequence);
+            }
+
+            s.last_sequence = sequence;
+        }
+
+        print_notification(s.output, type, message, length);
+
+        return true;
+    }
+
+    /**
+     * Waits for the server to acknowledge the last command; notifications
+     * arriving in the meantime are printed.
+     *
+     * @param connection_socket
+     * @param protocol_version
+     * @return true if the command was acknowledged
+     */
+    bool await_confirmation(int connection_socket, uint8_t protocol_version) {
+        char message[MAX_NOTIFICATION_LEN + 1];
+        uint8_t type;
+
+        ssize_t length;
+
+        while ((length = receive_message(connection_socket, protocol_version, &type, message, FRAME_NOTIFICATION)) >= 0) {
+            if (type == FRAME_NOTIFICATION || type == FRAME_RAW_NOTIFICATION) {
+                print_notification(type, message, length);
+                continue;
+            }
+
+            return type == FRAME_ACK;
+        }
+
+        return false;
+    }
+
+    /**
+     * Same as above, for the buffered session of login_subscriber(): the
+     * messages already read from the server come first.
+     *
+     * @param s
+     * @return true if the command was acknowledged
+     */
+    bool await_confirmation(struct session& s) {
+        char message[MAX_NOTIFICATION_LEN + 1];
+        uint8_t type;
+        uint64_t sequence;
+
+        ssize_t length;
+
+        while ((length = receive_buffered(s, &type, message, &sequence)) >= 0) {
+            if (handle_message(s, type, message, length, sequence)) {
+                continue;
+            }
+
+            /* Notifications that came before the reply are printed before it */
+            flush_output(s.output);
+
+            return type == FRAME_ACK;
+        }
+
+        flush_output(s.output);
+
+        return false;
+    }
+
+    /**
+     * Reports on STDERR how much a sequenced session has missed, if anything.
+     */
+    void report_gaps(const struct session& s) {
+        if (s.gaps > 0) {
+            fprintf(stderr, "%lu gaps, %lu notifications missed\n", s.gaps, s.missed);
+        }
+    }
+
+    int parse_user_command(struct session& s) {
         char input[MAX_COMMAND_LEN];
         fgets(input, MAX_COMMAND_LEN, stdin);
 
@@ -63,32 +610,23 @@ namespace subscriber {
         }
 
         if (strcmp(input, "exit") == 0) {
-            // Notify server
-            subscription_packet packet{};
+            flush_output(s.output);
 
-            sprintf(packet.message, "Quit");
-            packet.length = strlen(packet.message);
-
-            connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));
+            // Notify server
+            send_message(s.socket, s.protocol_version, FRAME_QUIT);
 
-            close(connection_socket);   // close socket
+            close(s.socket);   // close socket
 
+            report_gaps(s);
             exit(0);
         }
 
         if (strcmp(connection::get_command(input), "subscribe") == 0) {
             /* Send request to server */
-            subscription_packet packet{};
-
-            packet.length = strlen(input);
-            strncpy(packet.message, input, packet.length);
-
-            connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));
+            send_message(s.socket, s.protocol_version, FRAME_COMMAND, input, strlen(input));
 
             /* Await confirmation */
-            connection::receive_full_message(connection_socket, (void *)&packet, sizeof(packet));
-
-            if (strcmp(packet.message, "Success") == 0) {
+            if (await_confirmation(s)) {
                 fprintf(stdout, "Subscribed to topic %s\n", connection::get_topic(input));
                 return 0;
             }
@@ -98,17 +636,10 @@ namespace subscriber {
 
         if (strcmp(connection::get_command(input), "unsubscribe") == 0) {
             /* Send request to server */
-            subscription_packet packet{};
-
-            packet.length = strlen(input);
-            strncpy(packet.message, input, packet.length);
-
-            connection::send_full_message(connection_socket, (void *)&packet, sizeof(packet));
+            send_message(s.socket, s.protocol_version, FRAME_COMMAND, input, strlen(input));
 
             /* Await confirmation */
-            connection::receive_full_message(connection_socket, (void *)&packet, sizeof(packet));
-
-            if (strcmp(packet.message, "Success") == 0) {
+            if (await_confirmation(s)) {
                 fprintf(stdout, "Unsubscribed from topic %s\n", connection::get_topic(input));
                 return 0;
             }
@@ -118,60 +649,113 @@ namespace subscriber {
         }
 
         /* Unlisted command */
-        fprintf(stderr, "Unlisted command; usage = subscribe <TOPIC> / unsubscribe <TOPIC>.\n");
+        fprintf(stderr, "Unlisted command; usage = subscribe <TOPIC> [SF] [conflate] / unsubscribe <TOPIC>.\n");
         return 0;
     }
 
     /**
      * Connects subscriber to server and parse given commands to send.
      *
+     * Each time the server connection is readable, one recv() takes up to
+     * SUBSCRIBER_RECEIVE_SIZE bytes and every complete message is handled;
+     * the notifications are printed with one write() per batch.
+     *
+     * With reconnect, a dropped connection is opened again (a sequenced
+     * session resumes after the last notification received); only a Quit
+     * from the server ends the subscriber.
+     *
      * @param client_id
      * @param ip_server
      * @param PORT
+     * @param protocol_version highest protocol version to request at login
+     * @param login_flags LOGIN_FLAG_* options to request at login
+     * @param line_buffered print each notification as soon as it arrives
+     * @param flush_interval milliseconds notifications may be held to gather larger writes
+     * @param resume_from sequenced sessions: first notification wanted again (0: none)
+     * @param reconnect connect again when the connection drops
+     * @param aliases LOGIN_FLAG_ALIASES: size of the alias table to offer
      */
-    void login_subscriber(char *client_ID, uint32_t ip_server, const uint16_t PORT) {
+    void login_subscriber(char *client_ID, uint32_t ip_server, const uint16_t PORT,
+                            uint8_t protocol_version = PROTOCOL_FRAMED, uint8_t login_flags = 0,
+                            bool line_buffered = false, int flush_interval = 0, uint64_t resume_from = 0,
+                            bool reconnect = false, uint16_t aliases = 0) {
+        struct session s;
+        uint16_t requested_aliases = aliases;
+
         /* Connect to server */
-        int socket_fd = connect_to_server(ip_server, PORT, client_ID);
-        DIE(socket_fd < 0, "Client was already logged in");
+        s.socket = connect_to_server(ip_server, PORT, client_ID, protocol_version, login_flags, aliases, resume_from);
+        DIE(s.socket < 0, "Client was already logged in");
 
-        /* Create poll array for server connections and STDIN commands */
-        std::vector<struct pollfd> poll_fds;
-        int num_sockets = 2;
+        s.aliases.resize(aliases);
 
-        /* Add STDIN */
-        poll_fds.push_back({0, POLLIN});
+        s.protocol_version = protocol_version;
+        s.output.line_buffered = line_buffered;
+        s.output.flush_interval = flush_interval;
 
-        /* Add server-connection socket */
-        poll_fds.push_back({socket_fd, POLLIN});
+        /* STDIN commands and the server connection */
+        struct pollfd poll_fds[2] = {{STDIN_FILENO, POLLIN, 0}, {s.socket, POLLIN, 0}};
+        int timeout = -1;
 
         while (true) {
-            int rc = poll(&poll_fds[0], num_sockets, -1);
+            int rc = poll(poll_fds, 2, timeout);
+
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+
             DIE (rc < 0, "Polling error");
 
-            for (int index = 0; index < poll_fds.size(); index++) {
-                /* Check if there's data to be read on one of the sockets */
-                if (poll_fds[index].revents & POLLIN) {
-                    if (poll_fds[index].fd == 0) {  // STDIN command
-                        if (parse_user_command(socket_fd) == 1) {   // Exit command
-                            return;
-                        }
-                        continue;
-                    }
+            if (poll_fds[0].revents & POLLIN) {
+                if (parse_user_command(s) == 1) {   // Exit command
+                    return;
+                }
+            }
 
-                    // Received message from server
-                    subscription_packet packet;
+            /*
+             * Every complete message of the batch; a command's reply may have
+             * brought in messages behind it, which are handled even if the
+             * socket has nothing more to read
+             */
+            bool closed = (poll_fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+                            && fill_buffer(s.socket, s.input) <= 0;
+            bool quit = false;
+
+            char message[MAX_NOTIFICATION_LEN + 1];
+            uint8_t type;
+            uint64_t sequence;
+            ssize_t length;
+
+            while ((length = next_message(s, &type, message, &sequence)) >= 0) {
+                if (type == FRAME_QUIT) {
+                    closed = quit = true;
+                    break;
+                }
 
-                    connection::receive_full_message(socket_fd, (void *)&packet, sizeof(packet));
+                handle_message(s, type, message, length, sequence);
+            }
 
-                    if (strcmp(packet.message, "Quit") == 0) {
-                        close(poll_fds[index].fd);
-                        return;
-                    }
+            if (closed) {
+                flush_output(s.output);
+                close(s.socket);
 
-                    fprintf(stdout, "%s\n", packet.message);    // Print message
+                if (quit || !reconnect) {
+                    report_gaps(s);
+                    return;
                 }
 
+                /* Whatever was left of a message is lost with the connection */
+                s.input.head = s.input.tail = 0;
+
+                aliases = requested_aliases;
+                s.socket = reconnect_to_server(ip_server, PORT, client_ID, protocol_version, login_flags, aliases,
+                                                s.last_sequence > 0 ? s.last_sequence + 1 : resume_from);
+                poll_fds[1].fd = s.socket;
+
+                /* The new connection starts without aliases */
+                s.aliases.assign(aliases, std::string());
             }
+
+            timeout = end_batch(s.output);
         }
     }
 }
@@ -2,10 +2,42 @@
 #define SUBSCRIPTION_PROTOCOL_H
 
 #include "helpers.h"
+#include "output_queue.h"
+
+#include <charconv>
+#include <endian.h>
+#include "store_forward.h"
 #include "tcp_client.h"
+#include "fanout_cache.h"
+#include "topic_alias.h"
+#include "retained_store.h"
+#include "server_stats.h"
+
+/* Protocol versions negotiated at login */
+#define PROTOCOL_LEGACY 1   // fixed-size subscription_packet for every message
+#define PROTOCOL_FRAMED 2   // length-prefixed frames (connection::frame_header)
+
+/* Frame types */
+#define FRAME_NOTIFICATION 1
+#define FRAME_COMMAND 2
+#define FRAME_ACK 3
+#define FRAME_QUIT 4
+#define FRAME_RAW_NOTIFICATION 5   // typed UDP payload, formatted by the subscriber
+#define FRAME_GAP 6                 // notifications [first, end) of a sequenced session are lost
+#define FRAME_ALIAS 7               // defines a topic alias of the connection (replacing its old topic)
+
+/* Frame flags */
+#define FRAME_FLAG_SEQUENCE 0x01    // payload starts with the session's sequence number (8 bytes)
+#define FRAME_FLAG_ALIAS 0x02       // topic cut out of the payload, alias (2 bytes) in front of it
 
-#define MAX_TOPIC_SIZE 50
-#define MAX_UDP_PAYLOAD_SIZE 1500
+/* Login flags */
+#define LOGIN_FLAG_RAW 0x01         // subscriber formats notifications itself
+#define LOGIN_FLAG_SEQUENCED 0x02   // notifications are numbered; the session can be resumed
+#define LOGIN_FLAG_ALIASES 0x04     // topics may be replaced by aliases of the connection
+
+/* Capabilities block placed after the client ID in the login packet */
+#define LOGIN_CAPS_OFFSET 64
+#define LOGIN_MAGIC "PCOMv2"
 
 namespace subscription_protocol {
     /**
@@ -25,6 +57,362 @@ namespace subscription_protocol {
         size_t length;
     };
 
+    static_assert(sizeof(struct subscription_packet) <= MESSAGE_BUFFER_SIZE &&
+                    sizeof(struct connection::frame_header) + MAX_FRAME_PAYLOAD <= MESSAGE_BUFFER_SIZE,
+                    "Notifications must fit in a pooled message buffer");
+
+    /**
+     * Header of a FRAME_RAW_NOTIFICATION payload; followed by the topic
+     * and by the value bytes of the original datagram.
+     */
+    struct __attribute__((packed)) raw_notification_header {
+        uint32_t ip;            // publisher address, network byte order
+        uint16_t port;          // publisher port, network byte order
+        uint8_t data_type;
+        uint8_t topic_length;
+    };
+
+    /**
+     * Gets the number of meaningful value bytes in a datagram.
+     *
+     * @param packet
+     * @param length datagram length
+     * @return
+     */
+    size_t get_value_length(const struct udp_packet& packet, size_t length) {
+        size_t available = length > offsetof(struct udp_packet, payload)
+                            ? length - offsetof(struct udp_packet, payload) : 0;
+
+        switch (packet.data_type) {
+            case 0: return std::min(available, (size_t)(1 + sizeof(uint32_t)));
+            case 1: return std::min(available, sizeof(uint16_t));
+            case 2: return std::min(available, (size_t)(1 + sizeof(uint32_t) + 1));
+            default: return strnlen(packet.payload, available);
+        }
+    }
+
+    /**
+     * Encodes a datagram as a FRAME_RAW_NOTIFICATION payload.
+     *
+     * @param buffer output buffer, at least MAX_FRAME_PAYLOAD bytes
+     * @param packet
+     * @param length datagram length
+     * @param from publisher address
+     * @return payload length
+     */
+    size_t encode_raw_notification(char *buffer, const struct udp_packet& packet, size_t length,
+                                    const struct sockaddr_in& from) {
+        struct raw_notification_header *header = (struct raw_notification_header *)buffer;
+
+        size_t topic_length = strnlen(packet.topic, MAX_TOPIC_SIZE);
+        size_t value_length = get_value_length(packet, length);
+
+        header->ip = from.sin_addr.s_addr;
+        header->port = from.sin_port;
+        header->data_type = packet.data_type;
+        header->topic_length = topic_length;
+
+        char *p = buffer + sizeof(struct raw_notification_header);
+
+        memcpy(p, packet.topic, topic_length);
+        memcpy(p + topic_length, packet.payload, value_length);
+
+        return sizeof(struct raw_notification_header) + topic_length + value_length;
+    }
+
+    /**
+     * Decodes a FRAME_RAW_NOTIFICATION payload back into a datagram.
+     *
+     * @param buffer
+     * @param length payload length
+     * @param packet output packet
+     * @param packet_length length of the datagram rebuilt in packet
+     * @param from publisher address
+     * @return false if the payload is malformed
+     */
+    bool decode_raw_notification(const char *buffer, size_t length, struct udp_packet& packet,
+                                    size_t& packet_length, struct sockaddr_in& from) {
+        if (length < sizeof(struct raw_notification_header)) {
+            return false;
+        }
+
+        const struct raw_notification_header *header = (const struct raw_notification_header *)buffer;
+        size_t value_length = length - sizeof(struct raw_notification_header) - header->topic_length;
+
+        if (header->topic_length > MAX_TOPIC_SIZE
+            || length < sizeof(struct raw_notification_header) + header->topic_length
+            || value_length > MAX_UDP_PAYLOAD_SIZE) {
+            return false;
+        }
+
+        memset(&packet, 0, sizeof(packet));
+
+        const char *p = buffer + sizeof(struct raw_notification_header);
+
+        memcpy(packet.topic, p, header->topic_length);
+        memcpy(packet.payload, p + header->topic_length, value_length);
+        packet.data_type = header->data_type;
+        packet_length = offsetof(struct udp_packet, payload) + value_length;
+
+        from.sin_family = AF_INET;
+        from.sin_addr.s_addr = header->ip;
+        from.sin_port = header->port;
+
+        return true;
+    }
+
+    /**
+     * Capabilities advertised in the login packet (and echoed in the reply).
+     * Legacy peers leave this area zeroed, so the magic is missing.
+     */
+    struct login_capabilities {
+        char magic[sizeof(LOGIN_MAGIC)];
+        uint8_t version;
+        uint8_t flags;
+        uint16_t aliases;       // LOGIN_FLAG_ALIASES: size of the subscriber's alias table, big-endian
+        uint64_t resume_from;   // sequenced sessions: first notification wanted again (0: none), big-endian
+    };
+
+    /**
+     * Fills in the capabilities block of a login packet.
+     *
+     * @param packet
+     * @param version
+     * @param flags
+     * @param resume_from sequence number to resume from (0: none)
+     * @param aliases size of the alias table (LOGIN_FLAG_ALIASES)
+     */
+    void set_login_capabilities(subscription_packet& packet, uint8_t version, uint8_t flags = 0,
+                                uint64_t resume_from = 0, uint16_t aliases = 0) {
+        struct login_capabilities *caps = (struct login_capabilities *)(packet.message + LOGIN_CAPS_OFFSET);
+
+        memcpy(caps->magic, LOGIN_MAGIC, sizeof(LOGIN_MAGIC));
+        caps->version = version;
+        caps->flags = flags;
+        caps->aliases = htons(aliases);
+        caps->resume_from = htobe64(resume_from);
+    }
+
+    /**
+     * Gets the protocol version advertised in a login packet.
+     *
+     * @param packet
+     * @param flags advertised flags (optional)
+     * @param resume_from sequence number to resume from (optional)
+     * @param aliases size of the alias table (optional)
+     * @return
+     */
+    uint8_t get_login_version(const subscription_packet& packet, uint8_t *flags = NULL, uint64_t *resume_from = NULL,
+                                uint16_t *aliases = NULL) {
+        const struct login_capabilities *caps =
+                (const struct login_capabilities *)(packet.message + LOGIN_CAPS_OFFSET);
+
+        if (memcmp(caps->magic, LOGIN_MAGIC, sizeof(LOGIN_MAGIC)) != 0 || caps->version < PROTOCOL_FRAMED) {
+            return PROTOCOL_LEGACY;
+        }
+
+        if (flags != NULL) {
+            *flags = caps->flags;
+        }
+
+        if (resume_from != NULL) {
+            *resume_from = be64toh(caps->resume_from);
+        }
+
+        if (aliases != NULL) {
+            *aliases = ntohs(caps->aliases);
+        }
+
+        return caps->version;
+    }
+
+    /**
+     * Encodes a message for given protocol version.
+     * Legacy peers only understand full subscription_packets, with
+     * acknowledgements and logouts spelled as "Success" and "Quit".
+     *
+     * @param buffer output buffer, at least sizeof(subscription_packet) bytes
+     * @param version
+     * @param type frame type
+     * @param message
+     * @param length
+     * @return encoded length
+     */
+    size_t encode_message(char *buffer, uint8_t version, uint8_t type, const char *message, size_t length) {
+        if (version >= PROTOCOL_FRAMED) {
+            return connection::encode_frame(buffer, type, 0, message, length);
+        }
+
+        subscription_packet *packet = (subscription_packet *)buffer;
+
+        memset(packet, 0, sizeof(subscription_packet));
+
+        if (type == FRAME_ACK) {
+            length = sprintf(packet->message, "Success");
+        } else if (type == FRAME_QUIT) {
+            length = sprintf(packet->message, "Quit");
+        } else {
+            length = std::min(length, (size_t)MAX_NOTIFICATION_LEN - 1);
+            memcpy(packet->message, message, length);
+        }
+
+        packet->length = length;
+
+        return sizeof(subscription_packet);
+    }
+
+    /**
+     * Sends a message using the protocol version of the connection.
+     *
+     * @param socket
+     * @param version
+     * @param type frame type
+     * @param message
+     * @param length
+     */
+    void send_message(int socket, uint8_t version, uint8_t type, const char *message = "", size_t length = 0) {
+        char buffer[sizeof(subscription_packet)];
+
+        connection::send_full_message(socket, buffer, encode_message(buffer, version, type, message, length));
+    }
+
+    /**
+     * Gets the size of the message at the start of a receive buffer.
+     *
+     * @param version
+     * @param data
+     * @param available number of bytes in the buffer
+     * @return message size (may exceed available), 0 if the size is not
+     *         known yet, or -1 if the message is malformed
+     */
+    ssize_t get_message_size(uint8_t version, const char *data, size_t available) {
+        if (version < PROTOCOL_FRAMED) {
+            return sizeof(subscription_packet);
+        }
+
+        if (available < sizeof(struct connection::frame_header)) {
+            return 0;
+        }
+
+        const struct connection::frame_header *header = (const struct connection::frame_header *)data;
+        size_t length = ntohs(header->length);
+
+        if (length > MAX_FRAME_PAYLOAD) {
+            return -1;
+        }
+
+        return sizeof(struct connection::frame_header) + length;
+    }
+
+    /**
+     * Decodes a complete message (see get_message_size()).
+     *
+     * @param version
+     * @param data
+     * @param type frame type (legacy packets other than "Success"/"Quit"
+     *             are reported as legacy_type)
+     * @param message output buffer, at least MAX_NOTIFICATION_LEN + 1 bytes;
+     *                null-terminated on return
+     * @param legacy_type
+     * @param sequence sequence number of a numbered frame, taken off the
+     *                 message (0 for other messages; optional)
+     * @param alias topic alias of an aliased frame, taken off the message
+     *              (-1 for other messages; optional)
+     * @return message length
+     */
+    size_t decode_message(uint8_t version, const char *data, uint8_t *type, char *message, uint8_t legacy_type,
+                            uint64_t *sequence = NULL, int *alias = NULL) {
+        if (sequence != NULL) {
+            *sequence = 0;
+        }
+
+        if (alias != NULL) {
+            *alias = -1;
+        }
+
+        if (version >= PROTOCOL_FRAMED) {
+            const struct connection::frame_header *header = (const struct connection::frame_header *)data;
+            const char *payload = data + sizeof(struct connection::frame_header);
+            size_t length = ntohs(header->length);
+
+            if ((header->flags & FRAME_FLAG_SEQUENCE) && length >= sizeof(uint64_t)) {
+                uint64_t number;
+
+                memcpy(&number, payload, sizeof(number));
+                payload += sizeof(number);
+                length -= sizeof(number);
+
+                if (sequence != NULL) {
+                    *sequence = be64toh(number);
+                }
+            }
+
+            if ((header->flags & FRAME_FLAG_ALIAS) && length >= sizeof(uint16_t)) {
+                uint16_t number;
+
+                memcpy(&number, payload, sizeof(number));
+                payload += sizeof(number);
+                length -= sizeof(number);
+
+                if (alias != NULL) {
+                    *alias = ntohs(number);
+                }
+            }
+
+            memcpy(message, payload, length);
+            message[length] = '\0';
+            *type = header->type;
+
+            return length;
+        }
+
+        const subscription_packet *packet = (const subscription_packet *)data;
+
+        size_t length = strnlen(packet->message, MAX_NOTIFICATION_LEN - 1);
+        memcpy(message, packet->message, length);
+        message[length] = '\0';
+
+        if (strcmp(message, "Success") == 0) {
+            *type = FRAME_ACK;
+        } else if (strcmp(message, "Quit") == 0) {
+            *type = FRAME_QUIT;
+        } else {
+            *type = legacy_type;
+        }
+
+        return length;
+    }
+
+    /**
+     * Receives a message using the protocol version of the connection.
+     *
+     * @param socket
+     * @param version
+     * @param type frame type
+     * @param message output buffer, at least MAX_NOTIFICATION_LEN + 1 bytes
+     * @param legacy_type
+     * @return message length, or -1 if the connection was closed
+     */
+    ssize_t receive_message(int socket, uint8_t version, uint8_t *type, char *message, uint8_t legacy_type) {
+        char buffer[sizeof(subscription_packet)];
+        size_t received = version >= PROTOCOL_FRAMED ? sizeof(struct connection::frame_header)
+                                                       : sizeof(subscription_packet);
+
+        if (connection::receive_full_message(socket, buffer, received) != received) {
+            return -1;
+        }
+
+        ssize_t size = get_message_size(version, buffer, received);
+        DIE(size < 0, "Malformed message");
+
+        if ((size_t)size > received
+            && connection::receive_full_message(socket, buffer + received, size - received) != size - received) {
+            return -1;
+        }
+
+        return decode_message(version, buffer, type, message, legacy_type);
+    }
+
     /**
      * Description of a TCP Client.
      */
@@ -32,10 +420,33 @@ namespace subscription_protocol {
         char ID[MAX_ID_LEN];
         int socket;
         bool isActive;
+        uint8_t protocol_version;
+        bool raw_notifications;
         char ip_addr[MAX_IP_LEN];
         uint16_t port;
         std::vector<char *> followed_topics;
 
+        bool logged_in;             // false until the login packet has been processed
+        std::vector<char> input;    // bytes received but not yet parsed
+        connection::output_queue output;    // bytes the socket has not accepted yet
+        int worker;                 // worker thread owning the session (threaded mode)
+
+        std::vector<std::string> store_forward;     // patterns subscribed with SF=1
+        std::vector<std::string> conflate;          // patterns subscribed with "conflate" (latest value only)
+        session_backlog backlog;    // datagrams stored while offline, not forwarded yet
+        bool replay_pending;        // disk log (--log-dir): records from replay_from are still due
+        uint64_t replay_from;
+
+        /* Sequenced sessions (LOGIN_FLAG_SEQUENCED): notifications are numbered and the last ones kept */
+        bool sequenced;
+        uint64_t resume_from;       // asked for at login (0: nothing to retransmit)
+        uint64_t resume_next;       // next kept notification to retransmit (0: none pending)
+        connection::message_history history;
+
+        alias_table aliases;        // LOGIN_FLAG_ALIASES: topic aliases of the current connection
+
+        retained_cursor retained;   // retained values matching new subscriptions, still to send
+
         bool operator==(const struct TCP_Client &other){
             if(strcmp(ID, other.ID) == 0) {
                 return true;
@@ -52,209 +463,830 @@ namespace subscription_protocol {
         }
     };
 
-    /**
-     * Checks if client with designated ID has already logged in.
-     *
-     * @param ID
-     * @param registered_clients
-     * @return socket
-     */
-    int isRegistered(char *ID, std::unordered_map<int, struct TCP_Client *> registered_clients) {
-        for (auto& iter: registered_clients) {
-            struct TCP_Client *client = iter.second;
-            
-            if (strcmp(client->ID, ID) == 0) {
-                return iter.first;
-            }
-        }
-
-        return -1;
-    }
-
     /**
 	 * Subscribes TCP-Client to given topic.
 	 *
 	 * @param topic
      * @param subscriptions
 	 */
-	void subscribe_to_topic(struct TCP_Client *client, std::string topic,
-							std::unordered_map<std::string, std::vector<struct TCP_Client *>>& subscriptions) {
-		// Check if given topic has already been added to subscription map
-		auto iter = subscriptions.find(topic);
-
-		if (iter != subscriptions.end()) {
-			// Check if client is already subscribed to topic
-			if (std::find(subscriptions[topic].begin(), subscriptions[topic].end(), client) != subscriptions[topic].end()) {
-				fprintf(stderr, "Client is already subscribed to %s", topic.c_str());
-				return;
-			}
-
-			// Otherwise, add the client to the subscriber set
-			iter->second.push_back(client);
-			return;
+	void subscribe_to_topic(struct TCP_Client *client, std::string topic, topic_trie& subscriptions) {
+		// Add client to the subscriber list of the pattern node
+		if (!subscriptions.insert(topic, client)) {
+			fprintf(stderr, "Client is already subscribed to %s", topic.c_str());
 		}
-
-		// Add topic to map; create new set of subscribers
-		subscriptions.emplace(topic, std::vector<struct TCP_Client *>{client});
-
-		return;
 	}
 
     /**
-	 * Unsubscribes TCP-Client from topics that match given parameter.
+	 * Unsubscribes TCP-Client from the pattern given as parameter (strict
+	 * matching: wildcards are not expanded).
 	 *
 	 * @param topic_wildcard
      * @param subscriptions
 	 */
-	void unsubscribe_from_topic(struct TCP_Client *client, std::string topic_wildcard,
-							std::unordered_map<std::string, std::vector<struct TCP_Client *>>& subscriptions) {    
-        // Escape '*' and '+' characters from wildcard
-        if (topic_wildcard != std::string{".*"}) {
-            topic_wildcard = std::regex_replace(topic_wildcard, std::regex("\\*"), "\\*");
-        }
-        topic_wildcard = std::regex_replace(topic_wildcard, std::regex("\\+"), "\\+");
-            
-        // Search topics that match given wildcard and unsubscribe from them
-		for (auto& entry: subscriptions) {
-            if (std::regex_match(entry.first.c_str(), std::regex(topic_wildcard))) {
-                // Unsubscribe (remove from vector of clients)
-                auto iter = std::find(entry.second.begin(), entry.second.end(), client);
-
-                if (iter != entry.second.end()) {   // If we found the client
-                    entry.second.erase(iter);
-                }
+	void unsubscribe_from_topic(struct TCP_Client *client, std::string topic_wildcard, topic_trie& subscriptions) {
+        subscriptions.remove(topic_wildcard, client);
+    }
+
+    /**
+     * Adds a subscription pattern to (or removes it from) the patterns
+     * having an option turned on.
+     *
+     * @param patterns
+     * @param pattern
+     * @param enabled
+     * @return true if the setting has changed
+     */
+    bool set_pattern_option(std::vector<std::string>& patterns, const std::string& pattern, bool enabled) {
+        auto iter = std::find(patterns.begin(), patterns.end(), pattern);
+
+        if (enabled && iter == patterns.end()) {
+            patterns.push_back(pattern);
+            return true;
+        }
+
+        if (!enabled && iter != patterns.end()) {
+            patterns.erase(iter);
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * @param patterns
+     * @param topic
+     * @return true if one of the patterns matches topic
+     */
+    bool matches_any(const std::vector<std::string>& patterns, std::string_view topic) {
+        for (auto& pattern: patterns) {
+            if (topic_matches(pattern, topic)) {
+                return true;
             }
         }
+
+        return false;
     }
 
     /**
-     * Gets notification string.
-    */
-    char *format_notification(char *ip, uint16_t port, struct udp_packet packet) {
-        std::string notification;
+     * Turns store-and-forward on or off for a subscription pattern.
+     *
+     * @param client
+     * @param pattern
+     * @param enabled
+     * @return true if the setting has changed
+     */
+    bool set_store_forward(struct TCP_Client *client, const std::string& pattern, bool enabled) {
+        return set_pattern_option(client->store_forward, pattern, enabled);
+    }
+
+    /**
+     * Checks if client has a store-and-forward subscription matching topic.
+     *
+     * @param client
+     * @param topic
+     * @return
+     */
+    bool wants_store_forward(const struct TCP_Client *client, std::string_view topic) {
+        return matches_any(client->store_forward, topic);
+    }
+
+    /**
+     * Turns conflation (latest-value delivery) on or off for a subscription
+     * pattern.
+     *
+     * @param client
+     * @param pattern
+     * @param enabled
+     * @return true if the setting has changed
+     */
+    bool set_conflation(struct TCP_Client *client, const std::string& pattern, bool enabled) {
+        return set_pattern_option(client->conflate, pattern, enabled);
+    }
+
+    /**
+     * Checks if client has a conflated subscription matching topic.
+     *
+     * @param client
+     * @param topic
+     * @return
+     */
+    bool wants_conflation(const struct TCP_Client *client, std::string_view topic) {
+        return matches_any(client->conflate, topic);
+    }
+
+    /* Powers of ten for FLOAT values; 10^19 is the largest that fits in 64 bits */
+    constexpr uint64_t POWERS_OF_TEN[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL, 10000000000000000000ULL,
+    };
+
+    /**
+     * Appends text to the notification being built.
+     */
+    char *append_text(char *out, const char *text, size_t length) {
+        memcpy(out, text, length);
+
+        return out + length;
+    }
+
+    /**
+     * Appends an unsigned number, zero-padded to width digits.
+     */
+    char *append_number(char *out, uint64_t value, int width = 0) {
+        char digits[20];
+        int length = std::to_chars(digits, digits + sizeof(digits), value).ptr - digits;
+
+        for (; width > length; width--) {
+            *out++ = '0';
+        }
+
+        return append_text(out, digits, length);
+    }
+
+    /* INT: sign byte, then a uint32_t in network byte order */
+    char *format_int(char *out, const char *value) {
+        uint32_t number;
+        memcpy(&number, value + 1, sizeof(number));
+        number = ntohl(number);
+
+        if (number != 0 && value[0] == 1) {
+            *out++ = '-';
+        }
+
+        return append_number(out, number);
+    }
+
+    /* SHORT_REAL: uint16_t (network byte order) holding the value times 100 */
+    char *format_short_real(char *out, const char *value) {
+        uint16_t number;
+        memcpy(&number, value, sizeof(number));
+        number = ntohs(number);
+
+        out = append_number(out, number / 100);
+        *out++ = '.';
+
+        return append_number(out, number % 100, 2);
+    }
+
+    /* FLOAT: sign byte, uint32_t digits (network byte order), then the number of decimals */
+    char *format_float(char *out, const char *value) {
+        uint32_t number;
+        memcpy(&number, value + 1, sizeof(number));
+        number = ntohl(number);
+
+        uint8_t power = value[1 + sizeof(number)];
+
+        if (value[0] == 1) {
+            *out++ = '-';
+        }
+
+        /* Beyond 10^19 the whole number is in the decimals */
+        if (power >= std::size(POWERS_OF_TEN)) {
+            out = append_text(out, "0.", 2);
+
+            return append_number(out, number, power);
+        }
+
+        out = append_number(out, number / POWERS_OF_TEN[power]);
 
-        notification.append(packet.topic)
-                    .append(" - ");
+        if (power == 0) {
+            return out;
+        }
 
-        // Extract data type identifier and interpret payload value
-        char data_type[MAX_COMMAND_LEN];
-        char *payload;
+        *out++ = '.';
+
+        return append_number(out, number % POWERS_OF_TEN[power], power);
+    }
+
+    /**
+     * Formats the notification about a datagram ("<topic> - <type> - <value>")
+     * straight into buffer, without allocating.
+     *
+     * @param buffer at least MAX_NOTIFICATION_LEN bytes; the text is NUL-terminated
+     * @param packet
+     * @param length datagram length
+     * @return text length, or 0 if the datagram is malformed (unknown type,
+     *         value cut short)
+     */
+    size_t format_notification(char *buffer, const struct udp_packet& packet, size_t length) {
+        size_t available = length > offsetof(struct udp_packet, payload)
+                            ? length - offsetof(struct udp_packet, payload) : 0;
+
+        char *out = append_text(buffer, packet.topic, strnlen(packet.topic, MAX_TOPIC_SIZE));
 
         switch (packet.data_type) {
-            case 0: {
-                sprintf(data_type, "INT");
-                notification.append(data_type)
-                            .append(" - ");
+            case 0:
+                if (available < 1 + sizeof(uint32_t)) {
+                    return 0;
+                }
 
-                payload = (char *)packet.payload;
+                out = format_int(append_text(out, " - INT - ", 9), packet.payload);
+                break;
 
-                char sign = payload[0];
+            case 1:
+                if (available < sizeof(uint16_t)) {
+                    return 0;
+                }
 
-                payload++;
-                uint32_t value = *(uint32_t *)payload;
+                out = format_short_real(append_text(out, " - SHORT_REAL - ", 16), packet.payload);
+                break;
 
-                if (ntohl(value) != 0 && sign == 1) {
-                    notification.append("-");
+            case 2:
+                if (available < 1 + sizeof(uint32_t) + 1) {
+                    return 0;
                 }
 
-                notification.append(std::to_string(ntohl(value)));
+                out = format_float(append_text(out, " - FLOAT - ", 11), packet.payload);
+                break;
 
+            case 3:
+                out = append_text(out, " - STRING - ", 12);
+                out = append_text(out, packet.payload, strnlen(packet.payload, available));
                 break;
-            }
-            case 1: {
-                sprintf(data_type, "SHORT_REAL");
-                notification.append(data_type)
-                            .append(" - ");
 
-                payload = (char *)packet.payload;
+            default:
+                return 0;
+        }
 
-                uint16_t value = ntohs(*(uint16_t *)payload);
+        *out = '\0';
 
-                char formatted_value[MAX_COMMAND_LEN];
+        return out - buffer;
+    }
 
-                sprintf(formatted_value, "%.2f", (float)value / 100);
+    /**
+     * Notifies given (deduplicated) clients about a datagram. Every wire
+     * format needed (legacy packet, text frame, raw frame) is encoded at
+     * most once, into a pooled connection::message_buffer handed to
+     * deliver(client, message); deliver takes its own reference to keep it
+     * queued, and the buffer goes back to the pool with the last one.
+     *
+     * Offline clients, and clients whose backlog (or log replay) is still
+     * being forwarded, are offered the datagram through store(client)
+     * instead; it returns true if the datagram has been kept for the client.
+     * Offline sequenced sessions that did not keep it still go through
+     * deliver(), which numbers the notification and keeps it for a resume.
+     *
+     * With stats, the time spent encoding and the rest (handing the
+     * notification to the subscribers) are recorded as separate stages.
+    */
+    template <typename Deliver, typename Store>
+    void notify_clients(const struct udp_packet& packet, size_t packet_length, struct sockaddr_in& from,
+                            const std::vector<struct TCP_Client *>& clients, Deliver&& deliver, Store&& store,
+                            server_stats::thread_stats *stats = NULL) {
+        char notification[MAX_NOTIFICATION_LEN];
+        size_t notification_length = 0;
+        bool formatted = false;
 
-                notification.append(formatted_value);
+        uint64_t start = stats != NULL ? server_stats::ticks() : 0;
+        uint64_t encoding = 0;
 
-                break;
+        /* Each format is encoded once, into a buffer the slow subscribers' queues share */
+        struct connection::message_buffer *legacy = NULL;
+        struct connection::message_buffer *framed = NULL;
+        struct connection::message_buffer *raw = NULL;
+
+        size_t topic_length = strnlen(packet.topic, MAX_TOPIC_SIZE);
+
+        for (auto& client: clients) {
+            if (!client->isActive || !client->backlog.empty() || client->replay_pending) {
+                if (store(client) || (!client->isActive && !client->sequenced)) {
+                    continue;
+                }
             }
-            case 2: {
-                sprintf(data_type, "FLOAT");
-                notification.append(data_type)
-                            .append(" - ");
 
-                payload = (char *)packet.payload;
+            if (client->raw_notifications) {
+                if (raw == NULL) {
+                    uint64_t encode_start = stats != NULL ? server_stats::ticks() : 0;
+
+                    char payload[MAX_FRAME_PAYLOAD];
+                    size_t payload_length = encode_raw_notification(payload, packet, packet_length, from);
 
-                if (payload[0] == 1) {
-                    notification.append("-");
+                    raw = connection::acquire_buffer();
+                    raw->length = connection::encode_frame(raw->data, FRAME_RAW_NOTIFICATION, 0,
+                                                            payload, payload_length);
+                    raw->topic_length = topic_length;
+
+                    if (stats != NULL) {
+                        encoding += server_stats::ticks() - encode_start;
+                    }
                 }
 
-                payload++;
-                uint32_t whole_value = ntohl(*(uint32_t *)payload);
-                uint8_t power = *((uint8_t *)((uint32_t *)payload + 1));
+                deliver(client, raw);
+                continue;
+            }
 
-                char formatted_value[MAX_COMMAND_LEN];
+            if (!formatted) {
+                uint64_t encode_start = stats != NULL ? server_stats::ticks() : 0;
 
-                sprintf(formatted_value, "%.*f", power, (float)whole_value / pow(10, power));
+                notification_length = format_notification(notification, packet, packet_length);
+                formatted = true;
 
-                notification.append(formatted_value);
+                if (stats != NULL) {
+                    encoding += server_stats::ticks() - encode_start;
+                }
+            }
 
-                break;
+            if (notification_length == 0) {     // Malformed datagram; nothing to tell text clients
+                continue;
             }
-            case 3: {
-                sprintf(data_type, "STRING");
-                notification.append(data_type)
-                            .append(" - ");
 
-                payload = (char *)packet.payload;
+            if (client->protocol_version >= PROTOCOL_FRAMED) {
+                if (framed == NULL) {
+                    uint64_t encode_start = stats != NULL ? server_stats::ticks() : 0;
 
-                notification.append(payload);
+                    framed = connection::acquire_buffer();
+                    framed->length = encode_message(framed->data, PROTOCOL_FRAMED, FRAME_NOTIFICATION,
+                                                    notification, notification_length);
+                    framed->topic_length = topic_length;
 
-                break;
+                    if (stats != NULL) {
+                        encoding += server_stats::ticks() - encode_start;
+                    }
+                }
+
+                deliver(client, framed);
+                continue;
             }
+
+            if (legacy == NULL) {
+                uint64_t encode_start = stats != NULL ? server_stats::ticks() : 0;
+
+                legacy = connection::acquire_buffer();
+                legacy->length = encode_message(legacy->data, PROTOCOL_LEGACY, FRAME_NOTIFICATION,
+                                                notification, notification_length);
+                legacy->topic_length = topic_length;
+
+                if (stats != NULL) {
+                    encoding += server_stats::ticks() - encode_start;
+                }
+            }
+
+            deliver(client, legacy);
         }
 
-        char *result = (char *) calloc(MAX_NOTIFICATION_LEN, sizeof(char));
-        DIE(result == NULL, "Allocation error");
+        for (struct connection::message_buffer *message: {legacy, framed, raw}) {
+            if (message != NULL) {
+                connection::release_buffer(message);
+            }
+        }
 
-        sprintf(result, "%s", notification.c_str());
-                
-        return result;
+        if (stats != NULL && !clients.empty()) {
+            if (formatted || raw != NULL) {
+                stats->stages[server_stats::STAGE_ENCODE].record(encoding);
+            }
+
+            stats->stages[server_stats::STAGE_ENQUEUE].record(server_stats::ticks() - start - encoding);
+        }
     }
 
     /**
-     * Goes through topic mapping and notifies subscribers about given message.
+     * Notifies the subscribers of the topic of given datagram (with stats,
+     * the topic match is timed and its fan-out recorded as well).
     */
-    void notify_subscribers(std::string new_topic, const char *notification,
-							    std::unordered_map<std::string, std::vector<struct TCP_Client *>>& subscriptions) {
-        // Create set of sockets we've notified so we don't notify the same client twice
-        std::unordered_set<int> notified_sockets;
-
-        for (auto& entry: subscriptions) {
-            // Replace '*' and '+' wildcards with regular expressions
-            std::string topic = entry.first;
-
-            topic = std::regex_replace(topic, std::regex("\\*"), ".*");
-            topic = std::regex_replace(topic, std::regex("\\+"), "[^/]*");
-
-            // Check if new_topic matches regex designated by current entry
-            if (std::regex_match(new_topic, std::regex(topic))) {
-                // Notify clients
-                subscription_packet packet{};
-
-                sprintf(packet.message, "%s", notification);
-                packet.length = strlen(packet.message);
-
-                for (auto& client: entry.second) {
-                    // If client has not been notified
-                    if (notified_sockets.find(client->socket) == notified_sockets.end()
-                        && client->isActive) {
-                        connection::send_full_message(client->socket, (void *)&packet, sizeof(packet));
-                        notified_sockets.insert(client->socket); // Add client to set
-                    }
+    template <typename Deliver, typename Store>
+    void notify_subscribers(const struct udp_packet& packet, size_t packet_length, struct sockaddr_in& from,
+                                topic_trie& subscriptions, fanout_cache& fanout, Deliver&& deliver, Store&& store,
+                                server_stats::thread_stats *stats = NULL) {
+        std::string_view new_topic{packet.topic, strnlen(packet.topic, MAX_TOPIC_SIZE)};
+
+        if (stats == NULL) {
+            notify_clients(packet, packet_length, from, fanout.lookup(new_topic, subscriptions), deliver, store);
+            return;
+        }
+
+        uint64_t start = server_stats::ticks();
+        const std::vector<struct TCP_Client *>& clients = fanout.lookup(new_topic, subscriptions);
+
+        stats->stages[server_stats::STAGE_MATCH].record(server_stats::ticks() - start);
+        stats->matches.record(clients.size());
+
+        notify_clients(packet, packet_length, from, clients, deliver, store, stats);
+    }
+
+    /**
+     * Encodes a notification about a datagram in the format of a client.
+     *
+     * @param buffer at least sizeof(subscription_packet) bytes
+     * @param client
+     * @param packet
+     * @param packet_length
+     * @param from
+     * @return message length (0 for a malformed datagram; nothing to send)
+     */
+    size_t encode_notification(char *buffer, const struct TCP_Client *client, const struct udp_packet& packet,
+                                size_t packet_length, const struct sockaddr_in& from) {
+        if (client->raw_notifications) {
+            char payload[MAX_FRAME_PAYLOAD];
+            size_t payload_length = encode_raw_notification(payload, packet, packet_length, from);
+
+            return connection::encode_frame(buffer, FRAME_RAW_NOTIFICATION, 0, payload, payload_length);
+        }
+
+        char notification[MAX_NOTIFICATION_LEN];
+        size_t length = format_notification(notification, packet, packet_length);
+
+        if (length == 0) {
+            return 0;
+        }
+
+        return encode_message(buffer, client->protocol_version, FRAME_NOTIFICATION, notification, length);
+    }
+
+    /**
+     * Longest header a notification gets on one connection: the frame
+     * header, the sequence number, the topic alias and the bytes of the
+     * payload before the topic (raw notifications). It replaces the
+     * header of the shared frame (and the topic) in the output queue.
+     */
+    static_assert(sizeof(struct connection::frame_header) + sizeof(uint64_t) + sizeof(uint16_t)
+                    + sizeof(struct raw_notification_header) <= MESSAGE_HEADER_MAX, "Notification header too long");
+
+    /**
+     * Locates the topic in the payload of a notification frame: it opens
+     * a text notification and follows the header of a raw one. Its length
+     * is the one of the datagram's topic (message_buffer::topic_length),
+     * never searched for in the text: a topic may contain " - " itself.
+     *
+     * @param type frame type
+     * @param length payload length
+     * @param topic_length
+     * @param offset set to the offset of the topic
+     * @return topic length, or 0 if the frame has no topic to alias
+     */
+    size_t find_topic(uint8_t type, size_t length, size_t topic_length, size_t& offset) {
+        if (type != FRAME_NOTIFICATION && type != FRAME_RAW_NOTIFICATION) {
+            return 0;
+        }
+
+        offset = type == FRAME_RAW_NOTIFICATION ? sizeof(struct raw_notification_header) : 0;
+
+        return length >= offset && topic_length <= length - offset ? topic_length : 0;
+    }
+
+    /**
+     * Puts the topic of an aliased notification back into its payload.
+     *
+     * @param type frame type
+     * @param message payload without the topic; at least MAX_FRAME_PAYLOAD + 1
+     *                bytes, null-terminated on return
+     * @param length
+     * @param topic
+     * @return payload length, or 0 if the payload is malformed
+     */
+    size_t restore_topic(uint8_t type, char *message, size_t length, std::string_view topic) {
+        size_t offset = type == FRAME_RAW_NOTIFICATION ? sizeof(struct raw_notification_header) : 0;
+
+        if (length < offset || length + topic.size() > MAX_FRAME_PAYLOAD) {
+            return 0;
+        }
+
+        memmove(message + offset + topic.size(), message + offset, length - offset);
+        memcpy(message + offset, topic.data(), topic.size());
+
+        length += topic.size();
+        message[length] = '\0';
+
+        return length;
+    }
+
+    /**
+     * Gets the alias of a topic on the connection of a client. A topic
+     * without one is given an alias while the output queue has room for
+     * its definition and the notification: the FRAME_ALIAS is queued
+     * first, and never dropped (later notifications depend on it).
+     *
+     * @param client
+     * @param topic
+     * @param length length of the notification
+     * @return alias, -1 if the topic goes out by name, or -2 if the
+     *         connection failed
+     */
+    int get_alias(struct TCP_Client *client, std::string_view topic, size_t length) {
+        int alias = client->aliases.find(topic);
+
+        if (alias >= 0) {
+            return alias;
+        }
+
+        char frame[sizeof(struct connection::frame_header) + sizeof(uint16_t) + MAX_TOPIC_SIZE];
+        size_t frame_length = sizeof(struct connection::frame_header) + sizeof(uint16_t) + topic.size();
+
+        if (topic.size() > MAX_TOPIC_SIZE
+            || (!client->output.empty()
+                && client->output.queued_bytes + frame_length + length > client->output.max_bytes)) {
+            return -1;
+        }
+
+        alias = client->aliases.assign(topic);
+
+        /* FRAME_ALIAS payload: the alias (network byte order), then the topic */
+        char payload[sizeof(uint16_t) + MAX_TOPIC_SIZE];
+        uint16_t number = htons(alias);
+
+        memcpy(payload, &number, sizeof(number));
+        memcpy(payload + sizeof(number), topic.data(), topic.size());
+
+        connection::encode_frame(frame, FRAME_ALIAS, 0, payload, sizeof(number) + topic.size());
+
+        if (connection::queue_pinned(client->socket, client->output, frame, frame_length) == connection::QUEUE_ERROR) {
+            return -2;
+        }
+
+        return alias;
+    }
+
+    /**
+     * Gets the alias a queued notification went out with.
+     *
+     * @param message
+     * @return alias, or -1 if it carries its topic
+     */
+    int queued_alias(const struct connection::queued_message& message) {
+        const struct connection::frame_header *frame = (const struct connection::frame_header *)message.header;
+
+        if (message.header_length == 0 || !(frame->flags & FRAME_FLAG_ALIAS)) {
+            return -1;
+        }
+
+        size_t offset = sizeof(struct connection::frame_header) + (frame->flags & FRAME_FLAG_SEQUENCE ? sizeof(uint64_t) : 0);
+        uint16_t number;
+
+        memcpy(&number, message.header + offset, sizeof(number));
+
+        return ntohs(number);
+    }
+
+    /**
+     * Encodes a FRAME_GAP: notifications [first, end) will never come.
+     *
+     * @param buffer
+     * @param first
+     * @param end
+     * @return frame length
+     */
+    size_t encode_gap(char *buffer, uint64_t first, uint64_t end) {
+        uint64_t range[2] = {htobe64(first), htobe64(end)};
+
+        return connection::encode_frame(buffer, FRAME_GAP, 0, range, sizeof(range));
+    }
+
+    /**
+     * Gets the sequence number a queued notification went out with.
+     *
+     * @param message
+     * @return number, or 0 if it is not numbered
+     */
+    uint64_t queued_sequence(const struct connection::queued_message& message) {
+        const struct connection::frame_header *frame = (const struct connection::frame_header *)message.header;
+
+        if (message.header_length == 0 || !(frame->flags & FRAME_FLAG_SEQUENCE)) {
+            return 0;
+        }
+
+        uint64_t number;
+
+        memcpy(&number, message.header + sizeof(struct connection::frame_header), sizeof(number));
+
+        return be64toh(number);
+    }
+
+    /**
+     * Reads the range of a queued FRAME_GAP (see encode_gap()).
+     *
+     * @param message
+     * @param range filled in with first and end, in network byte order
+     * @return false if the message is not a gap
+     */
+    bool queued_gap(const struct connection::queued_message& message, uint64_t *range) {
+        const char *data = message.buffer->data + message.skip;
+        size_t length = message.buffer->length - message.skip;
+
+        if (message.header_length > 0 || length != sizeof(struct connection::frame_header) + 2 * sizeof(uint64_t)
+            || ((const struct connection::frame_header *)data)->type != FRAME_GAP) {
+            return false;
+        }
+
+        memcpy(range, data + sizeof(struct connection::frame_header), 2 * sizeof(uint64_t));
+
+        return true;
+    }
+
+    /**
+     * Takes a numbered notification replaced by a newer one out of a
+     * sequenced session's queue: a FRAME_GAP for its number goes out in its
+     * place, so the numbers the subscriber gets still go up. Adjacent gaps
+     * are merged once replaced messages make up half of the queue.
+     *
+     * @param client
+     * @param pending queued notification (see connection::find_latest())
+     * @param number its sequence number
+     */
+    void retire_notification(struct TCP_Client *client, struct connection::queued_message *pending, uint64_t number) {
+        char gap[sizeof(struct connection::frame_header) + 2 * sizeof(uint64_t)];
+
+        connection::overwrite_message(client->output, pending, gap, encode_gap(gap, number, number + 1));
+
+        if (client->output.overwritten > client->output.messages.size() / 2) {
+            connection::compact_queue(client->output, [](struct connection::queued_message& previous,
+                                                         const struct connection::queued_message& next) {
+                uint64_t first[2], second[2];
+
+                if (!queued_gap(previous, first) || !queued_gap(next, second) || first[1] != second[0]) {
+                    return false;
                 }
+
+                /* The gap buffer is this queue's own copy */
+                memcpy(previous.buffer->data + previous.skip + sizeof(struct connection::frame_header) + sizeof(uint64_t),
+                       &second[1], sizeof(uint64_t));
+
+                return true;
+            });
+        }
+    }
+
+    /**
+     * Builds the header a connection puts in front of a shared framed
+     * notification: its sequence number, and the alias of its topic, which
+     * replaces the topic.
+     *
+     * @param message shared frame
+     * @param sequence number of the notification (0: not sequenced)
+     * @param topic_offset where the topic starts in the payload
+     * @param topic_length
+     * @param alias alias of the topic (-1: the topic stays)
+     * @param header room for MESSAGE_HEADER_MAX bytes
+     * @param skip set to the number of bytes at the start of the frame the header replaces
+     * @return header length (0: the shared frame goes out as it is)
+     */
+    size_t encode_connection_header(const struct connection::message_buffer *message, uint64_t sequence,
+                                    size_t topic_offset, size_t topic_length, int alias, char *header, size_t *skip) {
+        const struct connection::frame_header *frame = (const struct connection::frame_header *)message->data;
+        struct connection::frame_header *header_frame = (struct connection::frame_header *)header;
+
+        size_t header_length = sizeof(struct connection::frame_header);
+        size_t length = ntohs(frame->length);
+
+        *header_frame = *frame;
+        *skip = sizeof(struct connection::frame_header);
+
+        if (sequence != 0) {
+            uint64_t number = htobe64(sequence);
+
+            memcpy(header + header_length, &number, sizeof(number));
+            header_length += sizeof(number);
+            length += sizeof(number);
+            header_frame->flags |= FRAME_FLAG_SEQUENCE;
+        }
+
+        if (alias >= 0) {
+            uint16_t number = htons(alias);
+
+            memcpy(header + header_length, &number, sizeof(number));
+            memcpy(header + header_length + sizeof(number), message->data + sizeof(struct connection::frame_header),
+                   topic_offset);
+            header_length += sizeof(number) + topic_offset;
+            *skip += topic_offset + topic_length;
+            length += sizeof(number) - topic_length;
+            header_frame->flags |= FRAME_FLAG_ALIAS;
+        }
+
+        /* Nothing of this connection to add: the shared frame goes out as it is */
+        if (header_length == sizeof(struct connection::frame_header)) {
+            *skip = 0;
+            return 0;
+        }
+
+        header_frame->length = htons(length);
+
+        return header_length;
+    }
+
+    /**
+     * Prepares a notification to be written straight to a client whose
+     * output queue is empty, by a caller placing the header itself (e.g.
+     * in a batch of io_uring writes): same header as queue_notification(),
+     * and an alias the topic needs is defined first. If the definition has
+     * to wait in the queue, so does the notification.
+     *
+     * @param client
+     * @param message encoded once for all subscribers, with the topic length of its datagram
+     * @param sequence number of the notification (0: not sequenced)
+     * @param header room for MESSAGE_HEADER_MAX bytes
+     * @param skip set to the number of bytes at the start of the message the header replaces
+     * @return header length, or -1 if the connection failed
+     */
+    ssize_t prepare_notification(struct TCP_Client *client, const struct connection::message_buffer *message,
+                                    uint64_t sequence, char *header, size_t *skip) {
+        *skip = 0;
+
+        if (client->protocol_version < PROTOCOL_FRAMED) {
+            return 0;
+        }
+
+        const struct connection::frame_header *frame = (const struct connection::frame_header *)message->data;
+        const char *payload = message->data + sizeof(struct connection::frame_header);
+
+        size_t topic_offset = 0;
+        size_t topic_length = client->aliases.enabled()
+                                ? find_topic(frame->type, message->length - sizeof(struct connection::frame_header),
+                                             message->topic_length, topic_offset)
+                                : 0;
+        int alias = topic_length > 0 ? get_alias(client, std::string_view(payload + topic_offset, topic_length),
+                                                 message->length)
+                                     : -1;
+
+        if (alias == -2) {
+            return -1;
+        }
+
+        return encode_connection_header(message, sequence, topic_offset, topic_length, alias, header, skip);
+    }
+
+    /**
+     * Sends a notification to a client, with its sequence number (sequenced
+     * sessions) and its topic replaced by an alias (aliasing connections);
+     * the encoded frame stays shared, and only a header of this connection
+     * is put in front of what is left of it (see connection::queue_message()).
+     *
+     * Conflated subscriptions: while the connection is backed up (bytes
+     * left over from an earlier flush, not only corked), a notification
+     * still waiting for its topic is replaced by the new one, so the
+     * subscriber gets the latest value of each topic when the queue drains.
+     * The replacement can only use an alias defined before the notification
+     * it replaces; it carries its topic otherwise. In a sequenced session,
+     * the replaced notification leaves a gap instead, and the new one goes
+     * to the back of the queue (see retire_notification()).
+     *
+     * @param client
+     * @param message encoded once for all subscribers, with the topic length of its datagram
+     * @param sequence number of the notification (0: not sequenced)
+     * @param policy
+     * @return queue_status
+     */
+    enum connection::queue_status queue_notification(struct TCP_Client *client, struct connection::message_buffer *message,
+                                                        uint64_t sequence, enum connection::overflow_policy policy) {
+        bool framed = client->protocol_version >= PROTOCOL_FRAMED;
+        const struct connection::frame_header *frame = (const struct connection::frame_header *)message->data;
+        const char *payload = framed ? message->data + sizeof(struct connection::frame_header) : message->data;
+        size_t payload_length = framed ? message->length - sizeof(struct connection::frame_header)
+                                       : strnlen(payload, MAX_NOTIFICATION_LEN);
+
+        size_t topic_offset = 0;
+        size_t topic_length = client->aliases.enabled() || !client->conflate.empty()
+                                ? find_topic(framed ? frame->type : FRAME_NOTIFICATION, payload_length,
+                                             message->topic_length, topic_offset)
+                                : 0;
+        std::string_view topic(payload + topic_offset, topic_length);
+
+        bool conflate = topic_length > 0 && client->output.queued_bytes > client->output.corked_bytes
+                            && wants_conflation(client, topic);
+        struct connection::queued_message *pending = conflate ? connection::find_latest(client->output, topic) : NULL;
+
+        if (pending != NULL && sequence != 0) {
+            retire_notification(client, pending, queued_sequence(*pending));
+            pending = NULL;
+        }
+
+        if (!framed) {
+            if (pending != NULL) {
+                connection::replace_message(client->output, pending, message, message->data, NULL, 0);
+                return connection::QUEUE_OK;
             }
+
+            return connection::queue_message(client->socket, client->output, message->data, message->length, policy,
+                                                message, NULL, 0, conflate ? topic : std::string_view());
         }
+
+        int alias = -1;
+
+        if (topic_length > 0 && client->aliases.enabled()) {
+            if (pending != NULL) {
+                alias = client->aliases.find(topic);
+                alias = alias == queued_alias(*pending) ? alias : -1;
+            } else {
+                alias = get_alias(client, topic, message->length);
+            }
+
+            if (alias == -2) {
+                return connection::QUEUE_ERROR;
+            }
+        }
+
+        char header[MESSAGE_HEADER_MAX];
+        size_t skip;
+        size_t header_length = encode_connection_header(message, sequence, topic_offset, topic_length, alias,
+                                                        header, &skip);
+
+        if (pending != NULL) {
+            connection::replace_message(client->output, pending, message, message->data + skip, header, header_length);
+            return connection::QUEUE_OK;
+        }
+
+        return connection::queue_message(client->socket, client->output, message->data + skip,
+                                            message->length - skip, policy, message, header, header_length,
+                                            conflate ? topic : std::string_view());
     }
 }
 
@@ -5,6 +5,11 @@ import time
 import os
 import pprint
 import json
+import socket
+import struct
+import base64
+import tempfile
+import shutil
 
 from contextlib import contextmanager
 from subprocess import Popen, PIPE, STDOUT
@@ -14,6 +19,9 @@ from time import sleep
 # default port for the  server
 port = "12345"
 
+# port for the servers started with extra options
+options_port = "12346"
+
 # default IP for the server
 ip = "127.0.0.1"
 
@@ -43,8 +51,17 @@ tests = {
   "c2_subscribe_star_wildcard": "not executed",
   "c2_subscribe_compound_wildcard": "not executed",
   "c2_subscribe_wildcard_set_inclusion": "not executed",
+  "framed_login": "not executed",
+  "legacy_subscriber": "not executed",
+  "sf_reconnect": "not executed",
+  "c2_subscribe_conflate_sequenced": "not executed",
+  "conflate_backlog": "not executed",
   "quick_flow": "not executed",
   "server_stop": "not executed",
+  "log_restart": "not executed",
+  "resume": "not executed",
+  "resume_history_gap": "not executed",
+  "retained": "not executed",
 }
 
 def pass_test(test):
@@ -274,13 +291,34 @@ def run_udp_client(mode=True, types=["0"], input_file="sample_payloads.json"):
     udpcl.send_input("exit")
     udpcl.finish()
 
-def start_and_check_client(server, id, restart=False, test=True):
+def publish(topic, values, server_port=port):
+  """Sends STRING messages on a topic straight to the server, in order from one socket."""
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for value in values:
+    udp.sendto(topic.encode().ljust(50, b"\0") + b"\3" + value.encode() + b"\0", (ip, int(server_port)))
+  udp.close()
+
+def start_server(options):
+  """Starts a server with extra options on the port for such servers."""
+  print("Starting a server with " + " ".join(options))
+  server = Process(["./server", options_port] + options)
+  server.start()
+  sleep(1)
+  return server
+
+def stop_server(server):
+  """Stops a server and checks that it stops."""
+  server.send_input("exit")
+  sleep(1)
+  return not server.is_alive()
+
+def start_and_check_client(server, id, restart=False, test=True, options=[], server_port=port):
   """Starts a TCP client and checks that it starts."""
   if test:
     fail_test("c" + id + ("_restart" if restart else "_start"))
 
   print("Starting subscriber C" + id)
-  client = Process(["./subscriber", "C" + id, ip, port])
+  client = Process(["./subscriber", "C" + id, ip, server_port] + options)
   client.start()
   outs = server.get_output_timeout(2)
 
@@ -561,6 +599,158 @@ def run_test_server_stop(server, c1):
   if success:
     pass_test("server_stop")
 
+def run_test_log_restart():
+  """Tests that the disk log replays to an offline SF subscriber after a server restart."""
+  fail_test("log_restart")
+
+  log_dir = tempfile.mkdtemp()
+  server = start_server(["--log-dir=" + log_dir])
+
+  c6, success = start_and_check_client(server, "6", test=False, server_port=options_port)
+  if success:
+    print("Subscribing C6 to topic log_topic with SF")
+    success = subscribe_to_topic(c6, "log_topic", " 1") != -1 and check_subscriber_stop(server, c6, "6")
+
+  if success:
+    print("Generating three messages for topic log_topic while C6 is offline")
+    publish("log_topic", ["logged " + str(i) for i in range(3)], options_port)
+    sleep(1)
+
+    # the log and the sessions file carry everything across the restart
+    print("Restarting the server")
+    if not stop_server(server):
+      print("Error: server is still up")
+      success = False
+    server = start_server(["--log-dir=" + log_dir])
+
+    c6, success = start_and_check_client(server, "6", test=False, server_port=options_port)
+
+  if success:
+    for i in range(3):
+      if not check_subscriber_output(c6, "6", "log_topic - STRING - logged " + str(i)):
+        success = False
+
+    outc6 = c6.get_output_timeout(1)
+    if outc6 != "timeout":
+      print("Error: C6 should get nothing else, got [" + outc6.rstrip() + "]")
+      success = False
+
+    success = check_subscriber_stop(server, c6, "6") and success
+
+  if not stop_server(server):
+    print("Error: server is still up")
+    success = False
+  shutil.rmtree(log_dir)
+
+  if success:
+    pass_test("log_restart")
+
+def check_resumed_output(c, id, first, last):
+  """Checks that a resumed subscriber gets the notifications numbered first to last, and nothing else."""
+  success = True
+  for sequence in range(first, last + 1):
+    if not check_subscriber_output(c, id, "resume_topic - STRING - resumed " + str(sequence)):
+      success = False
+
+  outc = c.get_output_timeout(1)
+  if outc != "timeout":
+    print("Error: C" + id + " should get nothing else, got [" + outc.rstrip() + "]")
+    success = False
+
+  return success
+
+def run_test_resume(server):
+  """Tests that a subscriber resuming from a sequence number gets the notifications from it on."""
+  fail_test("resume")
+
+  c7, success = start_and_check_client(server, "7", test=False, server_port=options_port)
+  if not success:
+    return
+
+  # the value of each notification is its sequence number in the session
+  print("Subscribing C7 to topic resume_topic")
+  if subscribe_to_topic(c7, "resume_topic") == -1:
+    return
+
+  print("Generating three messages for topic resume_topic")
+  publish("resume_topic", ["resumed " + str(i) for i in range(1, 4)], options_port)
+  success = check_resumed_output(c7, "7", 1, 3)
+
+  if not check_subscriber_stop(server, c7, "7"):
+    return
+
+  print("Generating six messages for topic resume_topic while C7 is offline")
+  publish("resume_topic", ["resumed " + str(i) for i in range(4, 10)], options_port)
+  sleep(1)
+
+  c7, started = start_and_check_client(server, "7", test=False, options=["--resume=7"], server_port=options_port)
+  if not started:
+    return
+
+  success = check_resumed_output(c7, "7", 7, 9) and success
+
+  errc7 = c7.get_error_timeout(1)
+  if errc7 != "timeout":
+    print("Error: C7 reported [" + errc7.rstrip() + "]")
+    success = False
+
+  if check_subscriber_stop(server, c7, "7") and success:
+    pass_test("resume")
+
+def run_test_resume_history_gap(server):
+  """Tests that resuming from before the kept history reports the notifications left out."""
+  fail_test("resume_history_gap")
+
+  # the server keeps the last four notifications (6 to 9) of the session
+  c7, success = start_and_check_client(server, "7", test=False, options=["--resume=4"], server_port=options_port)
+  if not success:
+    return
+
+  errc7 = c7.get_error_timeout(1)
+  if errc7.rstrip() != "Missed notifications 4 to 5":
+    print("Error: C7 should report [Missed notifications 4 to 5], reported [" + errc7.rstrip() + "]")
+    success = False
+
+  success = check_resumed_output(c7, "7", 6, 9) and success
+
+  if check_subscriber_stop(server, c7, "7") and success:
+    pass_test("resume_history_gap")
+
+def run_test_retained(server):
+  """Tests that a new subscription gets only the latest value of each matching topic."""
+  fail_test("retained")
+
+  print("Generating messages for topics retained/a, retained/b and other/c before anyone subscribes")
+  publish("retained/a", ["old a", "latest a"], options_port)
+  publish("retained/b", ["latest b"], options_port)
+  publish("other/c", ["latest c"], options_port)
+  sleep(1)
+
+  c9, success = start_and_check_client(server, "9", test=False, server_port=options_port)
+  if not success:
+    return
+
+  print("Subscribing C9 to topic retained/+")
+  if subscribe_to_topic(c9, "retained/+") == -1:
+    return
+
+  received = set()
+  for i in range(2):
+    received.add(c9.get_output_timeout(1).rstrip())
+
+  expected = {"retained/a - STRING - latest a", "retained/b - STRING - latest b"}
+  if received != expected:
+    print("Error: C9 should get " + str(sorted(expected)) + ", got " + str(sorted(received)))
+    success = False
+
+  outc9 = c9.get_output_timeout(1)
+  if outc9 != "timeout":
+    print("Error: C9 should get nothing else, got [" + outc9.rstrip() + "]")
+    success = False
+
+  if check_subscriber_stop(server, c9, "9") and success:
+    pass_test("retained")
+
 def run_test_c2_subscribe_plus_wildcard(c2, topics):
   """Tests that subscriber C2 can subscribe to a topic with wildcard."""
   # setup the test and the wildcard flow
@@ -826,6 +1016,242 @@ def run_test_c2_subscribe_wildcard_set_inclusion(c2, topics):
   if success:
     pass_test("c2_subscribe_wildcard_set_inclusion")
 
+def read_frame(reader):
+  """Reads one protocol v2 frame and returns its type and payload."""
+  frame_type, flags, length = struct.unpack("!BBH", reader.read(4))
+  return frame_type, reader.read(length)
+
+def run_test_framed_login(server):
+  """Tests that a v2 login is answered with v2 framing for commands and notifications."""
+  fail_test("framed_login")
+
+  print("Logging C3 in with protocol v2 from a raw socket")
+  sock = socket.create_connection((ip, int(port)))
+  sock.settimeout(2)
+  reader = sock.makefile("rb")
+
+  # login packet: the ID, then the capabilities block (magic, version 2, no flags), then the ID length
+  login = b"C3".ljust(64, b"\0") + b"PCOMv2\0" + bytes([2, 0])
+  sock.sendall(login.ljust(2000, b"\0") + struct.pack("=Q", 2))
+
+  success = True
+  try:
+    reply = reader.read(2008)
+    outs = server.get_output_timeout(2)
+    if not outs.startswith("New client C3 connected from"):
+      print("Error: server did not print that C3 is connected")
+      success = False
+
+    if not reply.startswith(b"Success\0") or reply[64:71] != b"PCOMv2\0" or reply[71] != 2:
+      print("Error: C3 login was not answered with protocol v2")
+      success = False
+
+    command = b"subscribe framed_topic"
+    sock.sendall(struct.pack("!BBH", 2, 0, len(command)) + command)
+    frame_type, payload = read_frame(reader)
+    if frame_type != 3:
+      print("Error: C3 subscribe should be acknowledged by an ACK frame, got type " + str(frame_type))
+      success = False
+
+    print("Generating one message for topic framed_topic")
+    publish("framed_topic", ["framed value"])
+    frame_type, payload = read_frame(reader)
+    if frame_type != 1 or not payload.endswith(b"framed_topic - STRING - framed value"):
+      print("Error: C3 should get a notification frame, got type " + str(frame_type) + " [" + str(payload) + "]")
+      success = False
+  except (OSError, struct.error):
+    print("Error: C3 did not get a complete reply")
+    success = False
+
+  reader.close()
+  sock.close()
+  outs = server.get_output_timeout(2)
+  if outs.rstrip() != "Client C3 disconnected.":
+    print("Error: client C3 not disconnected")
+    success = False
+
+  if success:
+    pass_test("framed_login")
+
+def run_test_legacy_subscriber(server):
+  """Tests that a subscriber speaking only fixed-size packets still works."""
+  fail_test("legacy_subscriber")
+
+  c4, success = start_and_check_client(server, "4", test=False, options=["--legacy"])
+  if not success:
+    return
+
+  print("Subscribing C4 to topic legacy_topic")
+  if subscribe_to_topic(c4, "legacy_topic") == -1:
+    return
+
+  print("Generating one message for topic legacy_topic")
+  publish("legacy_topic", ["legacy value"])
+  success = check_subscriber_output(c4, "4", "legacy_topic - STRING - legacy value")
+
+  if check_subscriber_stop(server, c4, "4") and success:
+    pass_test("legacy_subscriber")
+
+def run_test_sf_reconnect(server):
+  """Tests that an SF subscriber gets the notifications sent while it was offline, in order."""
+  fail_test("sf_reconnect")
+
+  c5, success = start_and_check_client(server, "5", test=False)
+  if not success:
+    return
+
+  print("Subscribing C5 to topic sf_topic with SF")
+  if subscribe_to_topic(c5, "sf_topic", " 1") == -1 or not check_subscriber_stop(server, c5, "5"):
+    return
+
+  print("Generating three messages for topic sf_topic while C5 is offline")
+  publish("sf_topic", ["stored " + str(i) for i in range(3)])
+  sleep(1)
+
+  c5, success = start_and_check_client(server, "5", test=False)
+  if not success:
+    return
+
+  for i in range(3):
+    if not check_subscriber_output(c5, "5", "sf_topic - STRING - stored " + str(i)):
+      success = False
+
+  outc5 = c5.get_output_timeout(1)
+  if outc5 != "timeout":
+    print("Error: C5 should get nothing else, got [" + outc5.rstrip() + "]")
+    success = False
+
+  if check_subscriber_stop(server, c5, "5") and success:
+    pass_test("sf_reconnect")
+
+def run_test_c2_subscribe_conflate_sequenced(c2):
+  """Tests that a conflated subscription keeps the notifications of a sequenced session in order."""
+  fail_test("c2_subscribe_conflate_sequenced")
+
+  # subscribe to topics
+  print("Subscribing C2 to topics topic_a (conflate) and topic_b")
+  if subscribe_to_topic(c2, "topic_a", " conflate") == -1:
+    return
+
+  if subscribe_to_topic(c2, "topic_b") == -1:
+    return
+
+  # generate a burst of messages on three topics, taking turns (15 each)
+  print("Generating 15 messages for each of three topics, taking turns")
+  with open(path.join(udp_client_path, "three_topics_payloads.json")) as payloads_file:
+    payloads = [base64.b64decode(p["payload_base64"]) for p in json.load(payloads_file)]
+
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for i in range(15):
+    for topic_id in range(3):
+      udp.sendto(payloads[15 * topic_id + i], (ip, int(port)))
+  udp.close()
+
+  # a subscriber keeping up gets every notification, in order and without gaps
+  success = True
+  for i in range(15):
+    for name in ["topic_a", "topic_b"]:
+      outc2 = c2.get_output_timeout(1)
+      if not outc2.startswith(name + " - "):
+        print("Error: C2 output should start with [" + name + " - ], is actually [" + outc2.rstrip() + "]")
+        success = False
+
+  errc2 = c2.get_error_timeout(1)
+  if errc2 != "timeout":
+    print("Error: C2 reported [" + errc2.rstrip() + "]")
+    success = False
+
+  # unsubscribe from topics
+  c2.send_input("unsubscribe topic_a")
+  c2.get_output_timeout(1)
+
+  c2.send_input("unsubscribe topic_b")
+  c2.get_output_timeout(1)
+
+  if success:
+    pass_test("c2_subscribe_conflate_sequenced")
+
+def run_test_conflate_backlog(server):
+  """Tests that a backed-up subscriber gets the latest value of each conflated topic and the gaps left."""
+  fail_test("conflate_backlog")
+
+  c8, success = start_and_check_client(server, "8", test=False)
+  if not success:
+    return
+
+  print("Subscribing C8 to topics burst_a and burst_b (conflate)")
+  if subscribe_to_topic(c8, "burst_a", " conflate") == -1 or subscribe_to_topic(c8, "burst_b", " conflate") == -1:
+    return
+
+  # C8 stops reading, so the burst backs its connection up
+  print("Stopping C8 and generating 3000 messages for each of burst_a and burst_b, taking turns")
+  c8.proc.send_signal(signal.SIGSTOP)
+
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for i in range(3000):
+    for name in ["burst_a", "burst_b"]:
+      value = "burst " + str(i) + " " + "x" * 1400
+      udp.sendto(name.encode().ljust(50, b"\0") + b"\3" + value.encode() + b"\0", (ip, int(port)))
+    if i % 10 == 0:
+      sleep(0.01)
+  udp.close()
+
+  sleep(1)
+  c8.proc.send_signal(signal.SIGCONT)
+
+  # the values of each topic arrive in order and end with the last one published
+  success = True
+  received = 0
+  last = {"burst_a": -1, "burst_b": -1}
+  while True:
+    outc8 = c8.get_output_timeout(2)
+    if outc8 == "timeout" or outc8 == "":
+      break
+
+    fields = outc8.split(" - ")
+    if len(fields) != 3 or fields[0] not in last or not fields[2].startswith("burst "):
+      print("Error: C8 output should be a burst notification, is actually [" + outc8.rstrip()[:80] + "]")
+      success = False
+      break
+
+    value = int(fields[2].split()[1])
+    if value <= last[fields[0]]:
+      print("Error: C8 got value " + str(value) + " of " + fields[0] + " after " + str(last[fields[0]]))
+      success = False
+    last[fields[0]] = value
+    received += 1
+
+  if last["burst_a"] != 2999 or last["burst_b"] != 2999:
+    print("Error: C8 should end with value 2999 of both topics, got " + str(last))
+    success = False
+
+  # the conflated notifications are reported as increasing, disjoint gaps
+  missed = 0
+  previous_end = 0
+  while True:
+    errc8 = c8.get_error_timeout(1)
+    if errc8 == "timeout" or errc8 == "":
+      break
+
+    fields = errc8.split()
+    if len(fields) != 5 or fields[0] != "Missed" or int(fields[2]) <= previous_end or int(fields[4]) < int(fields[2]):
+      print("Error: C8 reported [" + errc8.rstrip() + "]")
+      success = False
+      break
+
+    missed += int(fields[4]) - int(fields[2]) + 1
+    previous_end = int(fields[4])
+
+  if missed == 0 or received + missed != 6000:
+    print("Error: C8 got " + str(received) + " notifications and missed " + str(missed) + " of 6000")
+    success = False
+
+  if not check_subscriber_stop(server, c8, "8"):
+    success = False
+
+  if success:
+    pass_test("conflate_backlog")
+
 def h2_test():
   """Runs all the tests."""
 
@@ -888,15 +1314,46 @@ def h2_test():
           # subscribe C2 to topics containing wildcards and check for duplicate messages
           run_test_c2_subscribe_wildcard_set_inclusion(c2, wildcard_topics)
 
+          # subscribe C2 to a conflated topic and check that a burst arrives in order
+          run_test_c2_subscribe_conflate_sequenced(c2)
+
           # stop C2 and check it exits correctly
           success = run_test_c2_stop(server, c2)
 
+        # log in with protocol v2 from a raw socket and check the framing
+        run_test_framed_login(server)
+
+        # check that a legacy subscriber still gets its notifications
+        run_test_legacy_subscriber(server)
+
+        # reconnect an SF subscriber and check it gets what it missed
+        run_test_sf_reconnect(server)
+
+        # stop reading on a conflated subscriber during a burst and check what it gets
+        run_test_conflate_backlog(server)
+
     # send all types of message 30 times in quick succesion and check
     run_test_quick_flow(c1, topics)
 
   # close the server and check that C1 also closes
   run_test_server_stop(server, c1)
 
+  # restart a server with a disk log and check that an SF subscriber gets what it missed
+  run_test_log_restart()
+
+  # reconnect a subscriber resuming within and before the kept history and check
+  server = start_server(["--resume-history=4"])
+  run_test_resume(server)
+  run_test_resume_history_gap(server)
+  if not stop_server(server):
+    print("Error: server is still up")
+
+  # subscribe after the values were published and check that only the latest ones arrive
+  server = start_server(["--retained-bytes=65536"])
+  run_test_retained(server)
+  if not stop_server(server):
+    print("Error: server is still up")
+
   # clean up
   make_clean()
 
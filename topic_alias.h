@@ -0,0 +1,101 @@
+#ifndef TOPIC_ALIAS_H
+#define TOPIC_ALIAS_H
+
+#include "topic_trie.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define TOPIC_ALIASES_MAX 1024      // aliases of a connection, unless the subscriber asks for fewer
+
+namespace subscription_protocol {
+    /**
+     * Topic aliases given out on one connection (LOGIN_FLAG_ALIASES): the
+     * first notification about a topic defines an alias for it, and the
+     * following ones carry the alias instead of the topic.
+     *
+     * The subscriber holds at most limit aliases (agreed at login). Once
+     * they are all in use, a new topic takes over the alias of a topic not
+     * used since the hand last went past it (second chance); defining it
+     * again replaces the old topic on the subscriber's side as well.
+     */
+    struct alias_table {
+        std::unordered_map<std::string, uint16_t, level_hasher, std::equal_to<>> aliases;    // topic -> alias
+        std::vector<std::string> topics;    // by alias
+        std::vector<bool> referenced;       // used since the hand last went past
+
+        size_t limit = 0;
+        size_t hand = 0;
+
+        bool enabled() const {
+            return limit > 0;
+        }
+
+        /**
+         * Forgets every alias (a new connection starts with none).
+         *
+         * @param limit aliases the subscriber holds (0: no aliasing)
+         */
+        void reset(size_t limit) {
+            aliases.clear();
+            topics.clear();
+            referenced.clear();
+
+            this->limit = limit;
+            hand = 0;
+        }
+
+        /**
+         * @param topic
+         * @return alias of the topic, or -1 if it has none
+         */
+        int find(std::string_view topic) {
+            auto iter = aliases.find(topic);
+
+            if (iter == aliases.end()) {
+                return -1;
+            }
+
+            referenced[iter->second] = true;
+
+            return iter->second;
+        }
+
+        /**
+         * Gives a topic without an alias one, replacing the alias of another
+         * topic if they are all in use.
+         *
+         * @param topic
+         * @return alias
+         */
+        uint16_t assign(std::string_view topic) {
+            uint16_t alias;
+
+            if (topics.size() < limit) {
+                alias = topics.size();
+
+                topics.emplace_back(topic);
+                referenced.push_back(true);
+            } else {
+                while (referenced[hand]) {
+                    referenced[hand] = false;
+                    hand = (hand + 1) % limit;
+                }
+
+                alias = hand;
+                hand = (hand + 1) % limit;
+
+                aliases.erase(topics[alias]);
+                topics[alias].assign(topic);
+                referenced[alias] = true;
+            }
+
+            aliases.emplace(topics[alias], alias);
+
+            return alias;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef TOPIC_INTERN_H
+#define TOPIC_INTERN_H
+
+#include "helpers.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define TOPIC_TABLE_MAX 65536       // distinct topics interned before a sweep
+#define TOPIC_INDEX_MIN_SLOTS 64
+
+namespace subscription_protocol {
+    /**
+     * Topic known to an intern table.
+     */
+    struct interned_topic {
+        std::string name;
+        size_t hash = 0;            // computed once, when the topic is interned
+        uint32_t generation = 0;    // last sweep generation the topic was seen in
+        bool used = false;
+    };
+
+    /**
+     * Intern table giving every distinct topic a dense 32-bit ID the
+     * first time it is seen, so that per-topic state can live in arrays
+     * indexed by ID instead of string-keyed maps.
+     *
+     * The index is open-addressed (linear probing) and keeps the hash of
+     * each topic next to its ID: probes compare hashes before names, and
+     * growing the index never hashes a topic again.
+     *
+     * The table holds at most max_topics topics. When a new topic finds it
+     * full, a sweep frees the IDs of the topics not seen since the previous
+     * sweep; freed IDs are handed out again, so holders of per-topic state
+     * are told about every eviction.
+     *
+     * A table is used by a single thread.
+     */
+    struct topic_table {
+        struct index_slot {
+            uint32_t id = 0;        // ID + 1; 0 marks a free slot
+            uint32_t hash = 0;      // low bits of the topic hash
+        };
+
+        std::vector<struct interned_topic> topics;      // by ID
+        std::vector<uint32_t> free_ids;
+        std::vector<struct index_slot> slots;
+
+        size_t max_topics;
+        size_t count = 0;
+        uint32_t generation = 0;
+
+        size_t sweeps = 0;
+        size_t evictions = 0;
+
+        explicit topic_table(size_t max_topics = TOPIC_TABLE_MAX) : slots(TOPIC_INDEX_MIN_SLOTS),
+                                                                        max_topics(std::max(max_topics, (size_t)1)) {}
+
+        /**
+         * Gets the ID of a topic, interning it if it is new.
+         *
+         * @param topic
+         * @param evict called with the IDs freed by a sweep, before any of
+         *              them is reused
+         * @param added set to whether the topic has just been interned
+         * @return topic ID
+         */
+        template <typename Evict>
+        uint32_t intern(std::string_view topic, Evict&& evict, bool *added = NULL) {
+            size_t hash = std::hash<std::string_view>{}(topic);
+            size_t slot = find_slot(topic, hash);
+
+            if (slots[slot].id != 0) {
+                uint32_t id = slots[slot].id - 1;
+
+                topics[id].generation = generation;
+
+                if (added != NULL) {
+                    *added = false;
+                }
+
+                return id;
+            }
+
+            if (count == max_topics) {
+                sweep(evict);
+                slot = find_slot(topic, hash);
+            } else if ((count + 1) * 2 > slots.size()) {
+                grow();
+                slot = find_slot(topic, hash);
+            }
+
+            uint32_t id;
+
+            if (!free_ids.empty()) {
+                id = free_ids.back();
+                free_ids.pop_back();
+            } else {
+                id = topics.size();
+                topics.emplace_back();
+            }
+
+            struct interned_topic& entry = topics[id];
+
+            entry.name.assign(topic);
+            entry.hash = hash;
+            entry.generation = generation;
+            entry.used = true;
+
+            slots[slot] = {id + 1, (uint32_t)hash};
+            count++;
+
+            if (added != NULL) {
+                *added = true;
+            }
+
+            return id;
+        }
+
+        uint32_t intern(std::string_view topic) {
+            return intern(topic, [](uint32_t) {});
+        }
+
+        /**
+         * @param id
+         * @return name of an interned topic
+         */
+        std::string_view name(uint32_t id) const {
+            return topics[id].name;
+        }
+
+        /**
+         * @return one past the largest ID handed out so far
+         */
+        size_t id_limit() const {
+            return topics.size();
+        }
+
+    private:
+        /**
+         * Finds the slot of a topic, or the free slot where it belongs.
+         */
+        size_t find_slot(std::string_view topic, size_t hash) const {
+            size_t mask = slots.size() - 1;
+
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                const struct index_slot& entry = slots[slot];
+
+                if (entry.id == 0) {
+                    return slot;
+                }
+
+                if (entry.hash == (uint32_t)hash && topics[entry.id - 1].name == topic) {
+                    return slot;
+                }
+            }
+        }
+
+        /**
+         * Rebuilds the index with given number of slots (a power of two),
+         * from the stored hashes.
+         */
+        void rebuild(size_t slot_count) {
+            slots.assign(slot_count, {});
+
+            size_t mask = slot_count - 1;
+
+            for (uint32_t id = 0; id < topics.size(); id++) {
+                if (!topics[id].used) {
+                    continue;
+                }
+
+                size_t slot = topics[id].hash & mask;
+
+                while (slots[slot].id != 0) {
+                    slot = (slot + 1) & mask;
+                }
+
+                slots[slot] = {id + 1, (uint32_t)topics[id].hash};
+            }
+        }
+
+        void grow() {
+            rebuild(slots.size() * 2);
+        }
+
+        /**
+         * Frees the topics not seen since the previous sweep. If all of them
+         * were (the working set is larger than the table), the whole table
+         * is freed instead.
+         */
+        template <typename Evict>
+        void sweep(Evict&& evict) {
+            size_t freed = 0;
+
+            for (int pass = 0; pass < 2 && freed == 0; pass++) {
+                for (uint32_t id = 0; id < topics.size(); id++) {
+                    struct interned_topic& entry = topics[id];
+
+                    if (!entry.used || (pass == 0 && entry.generation == generation)) {
+                        continue;
+                    }
+
+                    evict(id);
+
+                    entry.used = false;
+                    entry.name.clear();
+                    free_ids.push_back(id);
+                    freed++;
+                }
+            }
+
+            count -= freed;
+            evictions += freed;
+            sweeps++;
+            generation++;
+
+            rebuild(slots.size());
+        }
+    };
+}
+
+#endif
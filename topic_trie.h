@@ -0,0 +1,453 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include "helpers.h"
+
+#include <memory>
+#include <string_view>
+
+#define MAX_TOPIC_LEVELS 64
+
+namespace subscription_protocol {
+    struct TCP_Client;
+
+    /**
+     * Hasher allowing lookups by std::string_view in string-keyed maps
+     * (avoids building a temporary std::string for every topic level).
+     */
+    struct level_hasher {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view level) const noexcept {
+            return std::hash<std::string_view>{}(level);
+        }
+    };
+
+    /**
+     * Splits a topic into its '/'-separated levels (empty levels are kept).
+     *
+     * @param topic
+     * @param levels output array, at least MAX_TOPIC_LEVELS long
+     * @return number of levels, or -1 if the topic is too deep
+     */
+    int split_topic(std::string_view topic, std::string_view *levels) {
+        int count = 0;
+        size_t start = 0;
+
+        while (true) {
+            if (count == MAX_TOPIC_LEVELS) {
+                return -1;
+            }
+
+            size_t end = topic.find('/', start);
+
+            if (end == std::string_view::npos) {
+                levels[count++] = topic.substr(start);
+                return count;
+            }
+
+            levels[count++] = topic.substr(start, end - start);
+            start = end + 1;
+        }
+    }
+
+    /**
+     * Checks whether the given pattern levels match the topic levels,
+     * using the same wildcard semantics as the trie.
+     */
+    bool levels_match(const std::string_view *pattern, int pattern_count,
+                        const std::string_view *topic, int topic_count) {
+        if (pattern_count == 0) {
+            return topic_count == 0;
+        }
+
+        if (topic_count == 0) {
+            return false;
+        }
+
+        if (pattern[0] == "*") {
+            // '*' swallows at least one level
+            for (int skip = 1; skip <= topic_count; skip++) {
+                if (levels_match(pattern + 1, pattern_count - 1, topic + skip, topic_count - skip)) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        if (pattern[0] != "+" && pattern[0] != topic[0]) {
+            return false;
+        }
+
+        return levels_match(pattern + 1, pattern_count - 1, topic + 1, topic_count - 1);
+    }
+
+    /**
+     * Checks whether a pattern has a wildcard inside a level, next to
+     * other characters (e.g. "sensors/temp+" or "a*b").
+     *
+     * @param pattern
+     * @return
+     */
+    bool has_partial_wildcard(std::string_view pattern) {
+        for (size_t index = 0; index < pattern.size(); index++) {
+            if (pattern[index] != '*' && pattern[index] != '+') {
+                continue;
+            }
+
+            bool level_start = index == 0 || pattern[index - 1] == '/';
+            bool level_end = index + 1 == pattern.size() || pattern[index + 1] == '/';
+
+            if (!level_start || !level_end) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Matches a topic against a pattern character by character, as the
+     * old regex translation did: '*' matches any characters ('/'
+     * included) and '+' any characters within a level.
+     *
+     * @param pattern
+     * @param topic
+     * @return
+     */
+    bool glob_matches(std::string_view pattern, std::string_view topic) {
+        // reachable[length]: the pattern so far matches the first length characters of topic
+        bool reachable[MAX_TOPIC_SIZE + 1];
+        size_t size = std::min(topic.size(), (size_t)MAX_TOPIC_SIZE);
+
+        reachable[0] = true;
+        std::fill(reachable + 1, reachable + size + 1, false);
+
+        for (char symbol: pattern) {
+            if (symbol == '*' || symbol == '+') {
+                for (size_t length = 1; length <= size; length++) {
+                    reachable[length] = reachable[length]
+                                        || (reachable[length - 1] && (symbol == '*' || topic[length - 1] != '/'));
+                }
+            } else {
+                for (size_t length = size; length > 0; length--) {
+                    reachable[length] = reachable[length - 1] && topic[length - 1] == symbol;
+                }
+
+                reachable[0] = false;
+            }
+        }
+
+        return reachable[size];
+    }
+
+    /**
+     * Checks whether a concrete topic matches a subscription pattern.
+     *
+     * @param pattern
+     * @param topic
+     * @return
+     */
+    bool topic_matches(std::string_view pattern, std::string_view topic) {
+        if (has_partial_wildcard(pattern)) {
+            return glob_matches(pattern, topic);
+        }
+
+        std::string_view pattern_levels[MAX_TOPIC_LEVELS];
+        std::string_view topic_levels[MAX_TOPIC_LEVELS];
+
+        int pattern_count = split_topic(pattern, pattern_levels);
+        int topic_count = split_topic(topic, topic_levels);
+
+        if (pattern_count < 0 || topic_count < 0) {
+            return false;
+        }
+
+        return levels_match(pattern_levels, pattern_count, topic_levels, topic_count);
+    }
+
+    /**
+     * Node of the subscription trie; each edge is one topic level.
+     * '+' and '*' levels get dedicated children so that matching never
+     * has to scan the literal ones.
+     */
+    struct topic_node {
+        std::unordered_map<std::string, std::unique_ptr<topic_node>, level_hasher, std::equal_to<>> children;
+        std::unique_ptr<topic_node> plus_child;
+        std::unique_ptr<topic_node> star_child;
+
+        std::vector<struct TCP_Client *> subscribers;
+
+        bool empty() const {
+            return subscribers.empty() && children.empty() && !plus_child && !star_child;
+        }
+    };
+
+    /**
+     * Segment-level trie of subscription patterns.
+     *
+     * Wildcards are whole levels: '+' matches exactly one level and
+     * '*' matches one or more levels (same semantics the old regex
+     * translation had for level-sized wildcards). Patterns with a
+     * wildcard inside a level are kept aside and matched one by one
+     * (see glob_matches()).
+     */
+    struct topic_trie {
+        topic_node root;
+        std::unordered_map<std::string, std::vector<struct TCP_Client *>, level_hasher, std::equal_to<>> globs;
+        size_t pattern_count = 0;
+        uint64_t generation = 0;    // bumped by every change (see fanout_cache)
+
+        topic_trie() = default;
+
+        /**
+         * Deep copy, used to publish read-only snapshots of the trie.
+         */
+        topic_trie(const topic_trie& other)
+                : globs(other.globs), pattern_count(other.pattern_count), generation(other.generation) {
+            copy_node(root, other.root);
+        }
+
+        /**
+         * Adds client to the subscriber list of given pattern.
+         *
+         * @return false if client was already subscribed to the pattern
+         */
+        bool insert(std::string_view pattern, struct TCP_Client *client) {
+            if (has_partial_wildcard(pattern)) {
+                auto iter = globs.find(pattern);
+
+                if (iter == globs.end()) {
+                    iter = globs.emplace(std::string{pattern}, std::vector<struct TCP_Client *>{}).first;
+                    pattern_count++;
+                } else if (std::find(iter->second.begin(), iter->second.end(), client) != iter->second.end()) {
+                    return false;
+                }
+
+                iter->second.push_back(client);
+                generation++;
+
+                return true;
+            }
+
+            std::string_view levels[MAX_TOPIC_LEVELS];
+            int count = split_topic(pattern, levels);
+
+            if (count < 0) {
+                return false;
+            }
+
+            topic_node *node = &root;
+
+            for (int i = 0; i < count; i++) {
+                std::unique_ptr<topic_node> *next;
+
+                if (levels[i] == "+") {
+                    next = &node->plus_child;
+                } else if (levels[i] == "*") {
+                    next = &node->star_child;
+                } else {
+                    auto iter = node->children.find(levels[i]);
+
+                    if (iter == node->children.end()) {
+                        iter = node->children.emplace(std::string{levels[i]}, nullptr).first;
+                    }
+
+                    next = &iter->second;
+                }
+
+                if (!*next) {
+                    *next = std::make_unique<topic_node>();
+                }
+
+                node = next->get();
+            }
+
+            if (std::find(node->subscribers.begin(), node->subscribers.end(), client) != node->subscribers.end()) {
+                return false;
+            }
+
+            if (node->subscribers.empty()) {
+                pattern_count++;
+            }
+
+            node->subscribers.push_back(client);
+            generation++;
+
+            return true;
+        }
+
+        /**
+         * Removes client from the subscriber list of the exact pattern given
+         * (wildcards are not expanded) and prunes nodes left empty.
+         *
+         * @return false if client was not subscribed to the pattern
+         */
+        bool remove(std::string_view pattern, struct TCP_Client *client) {
+            if (has_partial_wildcard(pattern)) {
+                auto iter = globs.find(pattern);
+
+                if (iter == globs.end()) {
+                    return false;
+                }
+
+                auto subscriber = std::find(iter->second.begin(), iter->second.end(), client);
+
+                if (subscriber == iter->second.end()) {
+                    return false;
+                }
+
+                iter->second.erase(subscriber);
+
+                if (iter->second.empty()) {
+                    globs.erase(iter);
+                    pattern_count--;
+                }
+
+                generation++;
+
+                return true;
+            }
+
+            std::string_view levels[MAX_TOPIC_LEVELS];
+            int count = split_topic(pattern, levels);
+
+            if (count < 0) {
+                return false;
+            }
+
+            if (!remove_level(&root, levels, 0, count, client)) {
+                return false;
+            }
+
+            generation++;
+
+            return true;
+        }
+
+        /**
+         * Calls visitor(subscribers) for every pattern node matching topic.
+         * The same client may be reported by several nodes.
+         */
+        template <typename Visitor>
+        void match(std::string_view topic, Visitor &&visitor) const {
+            std::string_view levels[MAX_TOPIC_LEVELS];
+            int count = split_topic(topic, levels);
+
+            if (count < 0) {
+                return;
+            }
+
+            match_level(&root, levels, 0, count, visitor);
+
+            for (auto& glob: globs) {
+                if (glob_matches(glob.first, topic)) {
+                    visitor(glob.second);
+                }
+            }
+        }
+
+    private:
+        static void copy_node(topic_node& to, const topic_node& from) {
+            to.subscribers = from.subscribers;
+
+            for (auto& child: from.children) {
+                auto& copy = to.children.emplace(child.first, std::make_unique<topic_node>()).first->second;
+                copy_node(*copy, *child.second);
+            }
+
+            if (from.plus_child) {
+                to.plus_child = std::make_unique<topic_node>();
+                copy_node(*to.plus_child, *from.plus_child);
+            }
+
+            if (from.star_child) {
+                to.star_child = std::make_unique<topic_node>();
+                copy_node(*to.star_child, *from.star_child);
+            }
+        }
+
+        bool remove_level(topic_node *node, std::string_view *levels, int index, int count,
+                            struct TCP_Client *client) {
+            if (index == count) {
+                auto iter = std::find(node->subscribers.begin(), node->subscribers.end(), client);
+
+                if (iter == node->subscribers.end()) {
+                    return false;
+                }
+
+                node->subscribers.erase(iter);
+
+                if (node->subscribers.empty()) {
+                    pattern_count--;
+                }
+
+                return true;
+            }
+
+            std::unique_ptr<topic_node> *next;
+            decltype(node->children)::iterator literal = node->children.end();
+
+            if (levels[index] == "+") {
+                next = &node->plus_child;
+            } else if (levels[index] == "*") {
+                next = &node->star_child;
+            } else {
+                literal = node->children.find(levels[index]);
+
+                if (literal == node->children.end()) {
+                    return false;
+                }
+
+                next = &literal->second;
+            }
+
+            if (!*next || !remove_level(next->get(), levels, index + 1, count, client)) {
+                return false;
+            }
+
+            // Prune branch if nothing is left below it
+            if ((*next)->empty()) {
+                if (literal != node->children.end()) {
+                    node->children.erase(literal);
+                } else {
+                    next->reset();
+                }
+            }
+
+            return true;
+        }
+
+        template <typename Visitor>
+        void match_level(const topic_node *node, std::string_view *levels, int index, int count,
+                            Visitor &visitor) const {
+            if (index == count) {
+                if (!node->subscribers.empty()) {
+                    visitor(node->subscribers);
+                }
+
+                return;
+            }
+
+            auto iter = node->children.find(levels[index]);
+
+            if (iter != node->children.end()) {
+                match_level(iter->second.get(), levels, index + 1, count, visitor);
+            }
+
+            if (node->plus_child) {
+                match_level(node->plus_child.get(), levels, index + 1, count, visitor);
+            }
+
+            if (node->star_child) {
+                // '*' swallows at least one level
+                for (int next = index + 1; next <= count; next++) {
+                    match_level(node->star_child.get(), levels, next, count, visitor);
+                }
+            }
+        }
+    };
+}
+
+#endif
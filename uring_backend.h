@@ -0,0 +1,501 @@
+#ifndef URING_BACKEND_H
+#define URING_BACKEND_H
+
+#include "helpers.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 1024
+
+namespace uring {
+    /**
+     * Minimal io_uring instance (raw syscalls, no liburing dependency).
+     */
+    struct ring {
+        int fd = -1;
+
+        char *sq_ptr = NULL;        // ring mappings (see close_ring())
+        size_t sq_size = 0;
+        char *cq_ptr = NULL;
+        size_t cq_size = 0;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned sq_entries;
+        unsigned sq_local_tail = 0;     // tail including entries not yet published
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+    };
+
+    /**
+     * Ring of buffers the kernel picks from for buffer-select receives.
+     */
+    struct buffer_ring {
+        struct io_uring_buf *entries;   // io_uring_buf_ring; tail overlays entries[0].resv
+        char *buffers;
+        unsigned count;         // power of two
+        unsigned buffer_size;
+        uint16_t group;
+        uint16_t tail = 0;
+    };
+
+    /**
+     * Creates a ring with given number of submission entries.
+     *
+     * @param r
+     * @param entries
+     * @return false if the kernel does not support io_uring
+     */
+    bool setup_ring(struct ring& r, unsigned entries) {
+        struct io_uring_params params = {};
+
+        r.fd = syscall(__NR_io_uring_setup, entries, &params);
+
+        if (r.fd < 0) {
+            return false;
+        }
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+
+        char *sq_ptr = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    r.fd, IORING_OFF_SQ_RING);
+        DIE(sq_ptr == MAP_FAILED, "io_uring SQ mmap failed");
+
+        char *cq_ptr = sq_ptr;
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            cq_ptr = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    r.fd, IORING_OFF_CQ_RING);
+            DIE(cq_ptr == MAP_FAILED, "io_uring CQ mmap failed");
+        }
+
+        r.sq_ptr = sq_ptr;
+        r.sq_size = sq_size;
+        r.cq_ptr = cq_ptr;
+        r.cq_size = cq_size;
+
+        r.sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                r.fd, IORING_OFF_SQES);
+        DIE(r.sqes == MAP_FAILED, "io_uring SQE mmap failed");
+
+        r.sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+        r.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+        r.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+        r.sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+        r.sq_entries = params.sq_entries;
+        r.sq_local_tail = *r.sq_tail;
+
+        r.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+        r.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+        r.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+        r.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+        return true;
+    }
+
+    /**
+     * Unmaps a ring set up by setup_ring() and closes it.
+     *
+     * @param r
+     */
+    void close_ring(struct ring& r) {
+        munmap(r.sqes, r.sq_entries * sizeof(struct io_uring_sqe));
+
+        if (r.cq_ptr != r.sq_ptr) {
+            munmap(r.cq_ptr, r.cq_size);
+        }
+
+        munmap(r.sq_ptr, r.sq_size);
+        close(r.fd);
+
+        r.fd = -1;
+    }
+
+    /**
+     * Gets a cleared submission entry.
+     *
+     * @param r
+     * @return NULL if the submission queue is full
+     */
+    struct io_uring_sqe *get_sqe(struct ring& r) {
+        unsigned head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+
+        if (r.sq_local_tail - head >= r.sq_entries) {
+            return NULL;
+        }
+
+        unsigned index = r.sq_local_tail & *r.sq_mask;
+        struct io_uring_sqe *sqe = &r.sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        r.sq_array[index] = index;
+        r.sq_local_tail++;
+
+        return sqe;
+    }
+
+    /**
+     * @param r
+     * @return number of free submission entries
+     */
+    unsigned sq_space(const struct ring& r) {
+        return r.sq_entries - (r.sq_local_tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE));
+    }
+
+    /**
+     * Publishes queued entries and submits them with a single syscall
+     * (again if a signal interrupts it); entries the kernel has not taken
+     * yet are submitted by the next call.
+     *
+     * @param r
+     * @param wait_nr number of completions to wait for
+     * @return number of entries submitted, or -errno
+     */
+    int submit(struct ring& r, unsigned wait_nr = 0) {
+        __atomic_store_n(r.sq_tail, r.sq_local_tail, __ATOMIC_RELEASE);
+
+        while (true) {
+            unsigned to_submit = r.sq_local_tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+
+            if (to_submit == 0 && wait_nr == 0) {
+                return 0;
+            }
+
+            int rc = syscall(__NR_io_uring_enter, r.fd, to_submit, wait_nr,
+                                wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return rc < 0 ? -errno : rc;
+        }
+    }
+
+    /**
+     * Calls handler(cqe) for every available completion and consumes them.
+     *
+     * @param r
+     * @param handler
+     * @return number of completions handled
+     */
+    template <typename Handler>
+    unsigned reap(struct ring& r, Handler&& handler) {
+        unsigned head = *r.cq_head;
+        unsigned count = 0;
+
+        while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+            handler(r.cqes[head & *r.cq_mask]);
+
+            head++;
+            count++;
+        }
+
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+
+        return count;
+    }
+
+    /**
+     * Registers one fixed buffer (index 0) for *_FIXED operations.
+     *
+     * @param r
+     * @param base
+     * @param length
+     * @return false if registration failed
+     */
+    bool register_buffer(struct ring& r, void *base, size_t length) {
+        struct iovec iov = {base, length};
+
+        return syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    }
+
+    /**
+     * Hands buffer with given id (back) to the kernel.
+     *
+     * @param b
+     * @param id
+     */
+    void provide_buffer(struct buffer_ring& b, uint16_t id) {
+        /* Indexed by hand: the flexible array of io_uring_buf_ring is laid
+         * out differently by C++ compilers */
+        struct io_uring_buf *buf = &b.entries[b.tail & (b.count - 1)];
+
+        buf->addr = (uint64_t)(b.buffers + (size_t)id * b.buffer_size);
+        buf->len = b.buffer_size;
+        buf->bid = id;
+
+        b.tail++;
+        __atomic_store_n(&b.entries[0].resv, b.tail, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * Gets the memory of buffer with given id.
+     */
+    char *get_buffer(struct buffer_ring& b, uint16_t id) {
+        return b.buffers + (size_t)id * b.buffer_size;
+    }
+
+    /**
+     * Registers a provided-buffer ring and fills it.
+     *
+     * @param r
+     * @param b
+     * @param count number of buffers (power of two)
+     * @param buffer_size
+     * @param group buffer group id used by the receives
+     * @return false if the kernel does not support buffer rings
+     */
+    bool setup_buffer_ring(struct ring& r, struct buffer_ring& b, unsigned count, unsigned buffer_size,
+                            uint16_t group) {
+        b.count = count;
+        b.buffer_size = buffer_size;
+        b.group = group;
+
+        b.entries = (struct io_uring_buf *)mmap(NULL, count * sizeof(struct io_uring_buf),
+                                                        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        DIE(b.entries == MAP_FAILED, "Buffer ring mmap failed");
+
+        struct io_uring_buf_reg reg = {};
+
+        reg.ring_addr = (uint64_t)b.entries;
+        reg.ring_entries = count;
+        reg.bgid = group;
+
+        if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            munmap(b.entries, count * sizeof(struct io_uring_buf));
+            return false;
+        }
+
+        b.buffers = (char *)malloc((size_t)count * buffer_size);
+        DIE(b.buffers == NULL, "Allocation error");
+
+        for (unsigned id = 0; id < count; id++) {
+            provide_buffer(b, id);
+        }
+
+        return true;
+    }
+
+    /**
+     * Frees a buffer ring set up by setup_buffer_ring(); the ring it was
+     * registered with is closed first.
+     *
+     * @param b
+     */
+    void free_buffer_ring(struct buffer_ring& b) {
+        munmap(b.entries, b.count * sizeof(struct io_uring_buf));
+        free(b.buffers);
+    }
+
+    /**
+     * Arms a multishot recvmsg() picking buffers from given group; each
+     * datagram produces one completion until IORING_CQE_F_MORE is cleared.
+     *
+     * @param r
+     * @param socket
+     * @param header message header describing name/control sizes (must outlive the request)
+     * @param group
+     * @param user_data
+     * @return false if the submission queue is full
+     */
+    bool arm_recvmsg_multishot(struct ring& r, int socket, struct msghdr *header, uint16_t group,
+                                uint64_t user_data) {
+        struct io_uring_sqe *sqe = get_sqe(r);
+
+        if (sqe == NULL) {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = socket;
+        sqe->addr = (uint64_t)header;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        sqe->user_data = user_data;
+
+        return true;
+    }
+
+    /**
+     * Write queued in a send_batch (data lives in the staging buffer).
+     */
+    struct pending_write {
+        int fd;
+        size_t offset;
+        size_t length;
+        bool linked;        // the next write only goes ahead once this one is complete
+        int result;
+    };
+
+    /**
+     * Fan-out sends of one message, submitted together.
+     * Payloads are staged once in a registered buffer and written with
+     * IORING_OP_WRITE_FIXED to every destination.
+     */
+    struct send_batch {
+        struct ring ring;
+
+        char *staging;
+        size_t staging_size;
+        size_t staged = 0;
+
+        std::vector<struct pending_write> writes;
+    };
+
+    /**
+     * Creates the ring and registers the staging buffer.
+     *
+     * @param batch
+     * @param staging_size
+     * @return false if io_uring (or fixed buffers) are not available
+     */
+    bool setup_send_batch(struct send_batch& batch, size_t staging_size) {
+        if (!setup_ring(batch.ring, URING_ENTRIES)) {
+            return false;
+        }
+
+        batch.staging = (char *)aligned_alloc(4096, staging_size);
+        DIE(batch.staging == NULL, "Allocation error");
+
+        batch.staging_size = staging_size;
+
+        if (!register_buffer(batch.ring, batch.staging, staging_size)) {
+            close_ring(batch.ring);
+            free(batch.staging);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Closes the ring of a send batch and frees its staging buffer.
+     *
+     * @param batch
+     */
+    void free_send_batch(struct send_batch& batch) {
+        close_ring(batch.ring);
+        free(batch.staging);
+    }
+
+    /**
+     * Copies data into the staging buffer.
+     *
+     * @return offset of the copy, or -1 if the staging buffer is full
+     */
+    ssize_t stage(struct send_batch& batch, const void *data, size_t length) {
+        if (batch.staged + length > batch.staging_size) {
+            return -1;
+        }
+
+        memcpy(batch.staging + batch.staged, data, length);
+        batch.staged += length;
+
+        return batch.staged - length;
+    }
+
+    /**
+     * Queues a write of staged bytes to given descriptor.
+     *
+     * @param batch
+     * @param fd
+     * @param offset
+     * @param length
+     * @param linked the next queued write (same descriptor) waits for this one,
+     *               and is canceled unless this one is written in full
+     */
+    void queue_write(struct send_batch& batch, int fd, size_t offset, size_t length, bool linked = false) {
+        batch.writes.push_back({fd, offset, length, linked, 0});
+    }
+
+    /**
+     * Submits all queued writes (one io_uring_enter() per SQ-full of them)
+     * and waits for their completion. Writes that fail with EAGAIN or
+     * complete partially are handed to fallback(fd, data, length, error),
+     * in the order they were queued, with the unwritten part and the errno
+     * of failed writes (0 if short, ECANCELED if the write linked to was).
+     *
+     * @param batch
+     * @param fallback
+     */
+    template <typename Fallback>
+    void flush(struct send_batch& batch, Fallback&& fallback) {
+        size_t next = 0;
+
+        while (next < batch.writes.size()) {
+            size_t first = next;
+
+            for (; next < batch.writes.size(); next++) {
+                struct pending_write& write = batch.writes[next];
+
+                /* A link does not carry over to the next submission */
+                if (sq_space(batch.ring) < (write.linked ? 2u : 1u)) {
+                    break;
+                }
+
+                struct io_uring_sqe *sqe = get_sqe(batch.ring);
+
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->fd = write.fd;
+                sqe->addr = (uint64_t)(batch.staging + write.offset);
+                sqe->len = write.length;
+                sqe->buf_index = 0;
+                sqe->rw_flags = RWF_NOWAIT;     // fail with EAGAIN instead of waiting on a full socket
+                sqe->flags = write.linked ? IOSQE_IO_LINK : 0;
+                sqe->user_data = next;
+            }
+
+            unsigned submitted = next - first;
+            unsigned completed = 0;
+            int rc = submit(batch.ring, submitted);
+
+            while (completed < submitted) {
+                /* Short of resources (EAGAIN) or of room for completions (EBUSY) for now:
+                 * what has completed is reaped, and the rest submitted again */
+                DIE(rc < 0 && rc != -EAGAIN && rc != -EBUSY, "io_uring_enter failed");
+
+                completed += reap(batch.ring, [&](const struct io_uring_cqe& cqe) {
+                    batch.writes[cqe.user_data].result = cqe.res;
+                });
+
+                if (completed < submitted) {
+                    rc = submit(batch.ring, submitted - completed);
+                }
+            }
+
+            /* Completions of linked writes may come in any order: the rest
+             * of a header has to be handed over before its payload */
+            for (size_t index = first; index < next; index++) {
+                struct pending_write& write = batch.writes[index];
+                size_t written = write.result > 0 ? write.result : 0;
+
+                if (written < write.length) {
+                    fallback(write.fd, batch.staging + write.offset + written, write.length - written,
+                                write.result < 0 ? -write.result : 0);
+                }
+            }
+        }
+
+        batch.writes.clear();
+        batch.staged = 0;
+    }
+}
+
+#endif